@@ -0,0 +1,556 @@
+// Benchmark.cc
+//
+// Headless micro-benchmarks of the Datastructures operations, linked directly
+// with datastructures.cc and independent of MainProgram and the UI.
+//
+// Usage: benchmark [--sizes n1,n2,...] [--reps r] [--batch b] [--warmup w]
+//                  [--seed s] [--filter op1,op2,...] [--csv]
+//
+// For each size the data is generated from the seed and added in bulk. Each
+// operation then gets its inputs generated ahead, a warm-up, and r timed
+// repetitions of b calls. The mean time per call is reported with the 95 %
+// confidence interval of the repetitions.
+
+#include "datastructures.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+struct Options
+{
+    std::vector<unsigned int> sizes{1000, 10000, 100000};
+    unsigned int reps = 10;
+    unsigned int batch = 100;
+    unsigned int warmup = 10;
+    unsigned long int seed = 1;
+    std::vector<std::string> filter;
+    bool csv = false;
+};
+
+// Keeps the compiler from dropping a call whose result isn't otherwise used
+template <typename Type>
+void keep(Type const& value)
+{
+#if defined(__GNUC__)
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static void const* volatile sink;
+    sink = &value;
+#endif
+}
+
+// Random data of a given size, in the shape of the perftest data of prg2: stations
+// in a 10000 x 10000 square, a region for every 10 stations forming a binary tree,
+// half of the stations in a random region and trains of 2 to 10 stops
+class Fixture
+{
+public:
+    Fixture(unsigned int n, unsigned long int seed) : n_(n), rand_(seed) {}
+
+    static StationID station_id(unsigned long int k) { return "S" + std::to_string(k); }
+    static TrainID train_id(unsigned long int k) { return "T" + std::to_string(k); }
+    static Name name(unsigned long int k)
+    {
+        std::string text;
+        do { text += static_cast<char>('a' + k % 26); k /= 26; } while (k > 0);
+        return text;
+    }
+
+    unsigned long int random(unsigned long int end) { return std::uniform_int_distribution<unsigned long int>(0, end - 1)(rand_); }
+    Coord random_coord() { return {static_cast<int>(1 + random(10000)), static_cast<int>(1 + random(10000))}; }
+    Time random_time() { return static_cast<Time>(100 * random(24) + random(60)); }
+    StationID random_station() { return station_id(random(stations_)); }
+    RegionID random_region() { return random(regions_); }
+
+    void build(Datastructures& ds)
+    {
+        std::vector<std::tuple<StationID, Name, Coord>> stations;
+        for (unsigned long int k = 0; k < n_; ++k)
+        {
+            stations.emplace_back(station_id(k), name(k), random_coord());
+        }
+        ds.add_stations(stations);
+        stations_ = n_;
+
+        regions_ = std::max(1u, n_ / 10);
+        for (RegionID r = 0; r < regions_; ++r)
+        {
+            ds.add_region(r, name(r), {random_coord(), random_coord(), random_coord()});
+            if (r > 0) { ds.add_subregion_to_region(r, r / 2); }
+        }
+        for (unsigned long int k = 0; k < n_; ++k)
+        {
+            if (random(2) == 0) { ds.add_station_to_region(station_id(k), random_region()); }
+        }
+
+        departures_.clear();
+        std::vector<std::pair<TrainID, std::vector<std::pair<StationID, Time>>>> trains;
+        for (unsigned long int t = 0; t < n_; ++t)
+        {
+            trains.emplace_back(train_id(t), random_stops());
+            for (auto const& stop : trains.back().second) { departures_.emplace_back(stop.first, trains.back().first, stop.second); }
+        }
+        ds.add_trains(trains);
+        trains_ = n_;
+    }
+
+    std::vector<std::pair<StationID, Time>> random_stops()
+    {
+        std::vector<std::pair<StationID, Time>> stops;
+        auto count = 2 + random(9);
+        int time = random_time();
+        for (unsigned long int j = 0; j < count; ++j)
+        {
+            stops.emplace_back(random_station(), static_cast<Time>(time));
+            time += random(61);
+            if (time % 100 > 59) { time += 40; }
+            if (time > 2359) { time -= 2400; }
+        }
+        return stops;
+    }
+
+    // Identifiers not used by the data yet, for the operations that add
+    StationID new_station() { return station_id(stations_++); }
+    TrainID new_train() { return train_id(trains_++); }
+    RegionID new_region() { return regions_++; }
+
+    std::vector<std::tuple<StationID, TrainID, Time>> const& departures() const { return departures_; }
+    unsigned int size() const { return n_; }
+
+private:
+    unsigned int n_;
+    std::mt19937_64 rand_;
+    unsigned long int stations_ = 0;
+    unsigned long int trains_ = 0;
+    RegionID regions_ = 0;
+    std::vector<std::tuple<StationID, TrainID, Time>> departures_;
+};
+
+// One call of an operation, the argument telling which of the prepared inputs to use
+using Call = std::function<void(std::size_t)>;
+
+struct Benchmark
+{
+    char const* name;
+    // Generates the inputs of the given number of calls outside the timing, and returns the call
+    std::function<Call(Datastructures&, Fixture&, std::size_t)> prepare;
+    // Each repetition is a single call on freshly built data, for operations that use the data up
+    bool single = false;
+    // Left out unless named in --filter
+    bool explicit_only = false;
+};
+
+template <typename Input>
+std::vector<Input> inputs(std::size_t calls, std::function<Input()> make)
+{
+    std::vector<Input> result;
+    result.reserve(calls);
+    for (std::size_t i = 0; i < calls; ++i) { result.push_back(make()); }
+    return result;
+}
+
+std::string temporary_file(char const* name)
+{
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+std::vector<Benchmark> benchmarks()
+{
+    using Pair = std::pair<StationID, StationID>;
+    auto station_pairs = [](Fixture& f, std::size_t calls) {
+        return inputs<Pair>(calls, [&f] { return Pair(f.random_station(), f.random_station()); }); };
+    auto stations = [](Fixture& f, std::size_t calls) {
+        return inputs<StationID>(calls, [&f] { return f.random_station(); }); };
+
+    return {
+        {"station_count", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            return [&ds](std::size_t) { keep(ds.station_count()); }; }},
+        {"all_stations", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            return [&ds](std::size_t) { keep(ds.all_stations()); }; }},
+        {"add_station", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<std::tuple<StationID, Name, Coord>>>();
+            for (std::size_t i = 0; i < calls; ++i) { in->emplace_back(f.new_station(), Fixture::name(i), f.random_coord()); }
+            return [&ds, in](std::size_t i) { auto const& [id, name, xy] = (*in)[i]; keep(ds.add_station(id, name, xy)); }; }},
+        {"get_station_name", [stations](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<StationID>>(stations(f, calls));
+            return [&ds, in](std::size_t i) { keep(ds.get_station_name((*in)[i])); }; }},
+        {"get_station_coordinates", [stations](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<StationID>>(stations(f, calls));
+            return [&ds, in](std::size_t i) { keep(ds.get_station_coordinates((*in)[i])); }; }},
+        {"stations_alphabetically", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            return [&ds](std::size_t) { keep(ds.stations_alphabetically()); }; }},
+        {"stations_distance_increasing", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            return [&ds](std::size_t) { keep(ds.stations_distance_increasing()); }; }},
+        {"find_station_with_coord", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<Coord>>(inputs<Coord>(calls, [&f] { return f.random_coord(); }));
+            return [&ds, in](std::size_t i) { keep(ds.find_station_with_coord((*in)[i])); }; }},
+        {"change_station_coord", [stations](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto ids = std::make_shared<std::vector<StationID>>(stations(f, calls));
+            auto xys = std::make_shared<std::vector<Coord>>(inputs<Coord>(calls, [&f] { return f.random_coord(); }));
+            return [&ds, ids, xys](std::size_t i) { keep(ds.change_station_coord((*ids)[i], (*xys)[i])); }; }},
+        {"add_departure", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<std::tuple<StationID, TrainID, Time>>>();
+            for (std::size_t i = 0; i < calls; ++i) { in->emplace_back(f.random_station(), f.new_train(), f.random_time()); }
+            return [&ds, in](std::size_t i) { auto const& [s, t, time] = (*in)[i]; keep(ds.add_departure(s, t, time)); }; }},
+        {"remove_departure", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            // Existing departures in a random order, repeating if there are fewer than calls
+            auto in = std::make_shared<std::vector<std::tuple<StationID, TrainID, Time>>>(f.departures());
+            std::shuffle(in->begin(), in->end(), std::mt19937_64(calls));
+            return [&ds, in](std::size_t i) { auto const& [s, t, time] = (*in)[i % in->size()]; keep(ds.remove_departure(s, t, time)); }; }},
+        {"station_departures_after", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<std::pair<StationID, Time>>>();
+            for (std::size_t i = 0; i < calls; ++i) { in->emplace_back(f.random_station(), f.random_time()); }
+            return [&ds, in](std::size_t i) { keep(ds.station_departures_after((*in)[i].first, (*in)[i].second)); }; }},
+        {"add_region", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<std::pair<RegionID, std::vector<Coord>>>>();
+            for (std::size_t i = 0; i < calls; ++i)
+            {
+                in->emplace_back(f.new_region(), std::vector<Coord>{f.random_coord(), f.random_coord(), f.random_coord()});
+            }
+            return [&ds, in](std::size_t i) { keep(ds.add_region((*in)[i].first, "region", (*in)[i].second)); }; }},
+        {"all_regions", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            return [&ds](std::size_t) { keep(ds.all_regions()); }; }},
+        {"get_region_name", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<RegionID>>(inputs<RegionID>(calls, [&f] { return f.random_region(); }));
+            return [&ds, in](std::size_t i) { keep(ds.get_region_name((*in)[i])); }; }},
+        {"get_region_coords", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<RegionID>>(inputs<RegionID>(calls, [&f] { return f.random_region(); }));
+            return [&ds, in](std::size_t i) { keep(ds.get_region_coords((*in)[i])); }; }},
+        {"add_subregion_to_region", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            // Fresh regions, each put under one of the existing ones
+            auto in = std::make_shared<std::vector<std::pair<RegionID, RegionID>>>();
+            for (std::size_t i = 0; i < calls; ++i)
+            {
+                auto parent = f.random_region();
+                auto id = f.new_region();
+                ds.add_region(id, "region", {f.random_coord(), f.random_coord(), f.random_coord()});
+                in->emplace_back(id, parent);
+            }
+            return [&ds, in](std::size_t i) { keep(ds.add_subregion_to_region((*in)[i].first, (*in)[i].second)); }; }},
+        {"add_station_to_region", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            // Fresh stations, as a station can be in only one region
+            auto in = std::make_shared<std::vector<std::pair<StationID, RegionID>>>();
+            for (std::size_t i = 0; i < calls; ++i)
+            {
+                auto id = f.new_station();
+                ds.add_station(id, Fixture::name(i), f.random_coord());
+                in->emplace_back(id, f.random_region());
+            }
+            return [&ds, in](std::size_t i) { keep(ds.add_station_to_region((*in)[i].first, (*in)[i].second)); }; }},
+        {"station_in_regions", [stations](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<StationID>>(stations(f, calls));
+            return [&ds, in](std::size_t i) { keep(ds.station_in_regions((*in)[i])); }; }},
+        {"all_subregions_of_region", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<RegionID>>(inputs<RegionID>(calls, [&f] { return f.random_region(); }));
+            return [&ds, in](std::size_t i) { keep(ds.all_subregions_of_region((*in)[i])); }; }},
+        {"stations_closest_to", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<Coord>>(inputs<Coord>(calls, [&f] { return f.random_coord(); }));
+            return [&ds, in](std::size_t i) { keep(ds.stations_closest_to((*in)[i])); }; }},
+        {"remove_station", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            // Each station once, in a random order. Calls beyond the stations find nothing to remove
+            auto in = std::make_shared<std::vector<StationID>>();
+            for (unsigned long int k = 0; k < f.size(); ++k) { in->push_back(Fixture::station_id(k)); }
+            std::shuffle(in->begin(), in->end(), std::mt19937_64(calls));
+            return [&ds, in](std::size_t i) { keep(ds.remove_station(i < in->size() ? (*in)[i] : NO_STATION)); }; }},
+        {"common_parent_of_regions", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<std::pair<RegionID, RegionID>>>();
+            for (std::size_t i = 0; i < calls; ++i) { in->emplace_back(f.random_region(), f.random_region()); }
+            return [&ds, in](std::size_t i) { keep(ds.common_parent_of_regions((*in)[i].first, (*in)[i].second)); }; }},
+        {"add_train", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<std::pair<TrainID, std::vector<std::pair<StationID, Time>>>>>();
+            for (std::size_t i = 0; i < calls; ++i) { in->emplace_back(f.new_train(), f.random_stops()); }
+            return [&ds, in](std::size_t i) { keep(ds.add_train((*in)[i].first, (*in)[i].second)); }; }},
+        {"next_stations_from", [stations](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<StationID>>(stations(f, calls));
+            return [&ds, in](std::size_t i) { keep(ds.next_stations_from((*in)[i])); }; }},
+        {"train_stations_from", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<std::pair<StationID, TrainID>>>();
+            for (std::size_t i = 0; i < calls; ++i)
+            {
+                auto const& departure = f.departures()[f.random(f.departures().size())];
+                in->emplace_back(std::get<0>(departure), std::get<1>(departure));
+            }
+            return [&ds, in](std::size_t i) { keep(ds.train_stations_from((*in)[i].first, (*in)[i].second)); }; }},
+        {"clear_trains", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            return [&ds](std::size_t) { ds.clear_trains(); }; }, true},
+        {"route_any", [station_pairs](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<Pair>>(station_pairs(f, calls));
+            return [&ds, in](std::size_t i) { keep(ds.route_any((*in)[i].first, (*in)[i].second)); }; }},
+        {"route_least_stations", [station_pairs](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<Pair>>(station_pairs(f, calls));
+            return [&ds, in](std::size_t i) { keep(ds.route_least_stations((*in)[i].first, (*in)[i].second)); }; }},
+        {"route_with_cycle", [stations](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<StationID>>(stations(f, calls));
+            return [&ds, in](std::size_t i) { keep(ds.route_with_cycle((*in)[i])); }; }},
+        {"route_shortest_distance", [station_pairs](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<Pair>>(station_pairs(f, calls));
+            return [&ds, in](std::size_t i) { keep(ds.route_shortest_distance((*in)[i].first, (*in)[i].second)); }; }},
+        {"route_earliest_arrival", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<std::tuple<StationID, StationID, Time>>>();
+            for (std::size_t i = 0; i < calls; ++i) { in->emplace_back(f.random_station(), f.random_station(), f.random_time()); }
+            return [&ds, in](std::size_t i) { auto const& [a, b, t] = (*in)[i]; keep(ds.route_earliest_arrival(a, b, t)); }; }},
+        {"route_earliest_arrival_transfers", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            auto in = std::make_shared<std::vector<std::tuple<StationID, StationID, Time>>>();
+            for (std::size_t i = 0; i < calls; ++i) { in->emplace_back(f.random_station(), f.random_station(), f.random_time()); }
+            return [&ds, in](std::size_t i) { auto const& [a, b, t] = (*in)[i]; keep(ds.route_earliest_arrival_transfers(a, b, t, 3)); }; }},
+        {"distance_matrix", [stations](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            // 4 x 4 stations per call
+            auto in = std::make_shared<std::vector<StationID>>(stations(f, calls * 8));
+            return [&ds, in](std::size_t i) {
+                std::vector<StationID> sources(in->begin() + i * 8, in->begin() + i * 8 + 4);
+                std::vector<StationID> targets(in->begin() + i * 8 + 4, in->begin() + i * 8 + 8);
+                keep(ds.distance_matrix(sources, targets)); }; }},
+        {"use_contraction_hierarchy", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            // Building the hierarchy, which asking for the shortcuts forces
+            return [&ds](std::size_t) { ds.use_contraction_hierarchy(true); keep(ds.contraction_hierarchy_shortcuts()); }; }, true},
+        {"use_landmarks", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            return [&ds](std::size_t) { ds.use_landmarks(8); keep(ds.landmark_table_bytes()); }; }, true},
+        {"run_queries", [station_pairs](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            // 64 shortest distance queries per call on all hardware threads
+            auto in = std::make_shared<std::vector<std::vector<Datastructures::Query>>>();
+            for (std::size_t i = 0; i < calls; ++i)
+            {
+                in->emplace_back();
+                for (auto const& [from, to] : station_pairs(f, 64))
+                {
+                    Datastructures::Query query{Datastructures::QueryKind::ROUTE_SHORTEST_DISTANCE};
+                    query.from = from;
+                    query.to = to;
+                    in->back().push_back(query);
+                }
+            }
+            auto threads = std::max(1u, std::thread::hardware_concurrency());
+            return [&ds, in, threads](std::size_t i) { keep(ds.run_queries((*in)[i], threads)); }; }},
+        {"add_stations", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            // 100 stations per call
+            auto in = std::make_shared<std::vector<std::vector<std::tuple<StationID, Name, Coord>>>>(calls);
+            for (auto& part : *in)
+            {
+                for (unsigned int j = 0; j < 100; ++j) { part.emplace_back(f.new_station(), Fixture::name(j), f.random_coord()); }
+            }
+            return [&ds, in](std::size_t i) { keep(ds.add_stations((*in)[i])); }; }},
+        {"add_trains", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            // 100 trains per call
+            auto in = std::make_shared<std::vector<std::vector<std::pair<TrainID, std::vector<std::pair<StationID, Time>>>>>>(calls);
+            for (auto& part : *in)
+            {
+                for (unsigned int j = 0; j < 100; ++j) { part.emplace_back(f.new_train(), f.random_stops()); }
+            }
+            return [&ds, in](std::size_t i) { keep(ds.add_trains((*in)[i])); }; }},
+        {"add_departures", [](Datastructures& ds, Fixture& f, std::size_t calls) -> Call {
+            // 100 departures per call
+            auto in = std::make_shared<std::vector<std::vector<std::tuple<StationID, TrainID, Time>>>>(calls);
+            for (auto& part : *in)
+            {
+                for (unsigned int j = 0; j < 100; ++j) { part.emplace_back(f.random_station(), f.new_train(), f.random_time()); }
+            }
+            return [&ds, in](std::size_t i) { keep(ds.add_departures((*in)[i])); }; }},
+        {"save_snapshot", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            auto file = temporary_file("benchmark-snapshot.bin");
+            return [&ds, file](std::size_t) { keep(ds.save_snapshot(file)); }; }, true},
+        {"load_snapshot", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            auto file = temporary_file("benchmark-snapshot.bin");
+            ds.save_snapshot(file);
+            return [&ds, file](std::size_t) { keep(ds.load_snapshot(file)); }; }, true},
+        {"save_image", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            auto file = temporary_file("benchmark-image.bin");
+            return [&ds, file](std::size_t) { keep(ds.save_image(file)); }; }, true},
+        {"open_image", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            auto file = temporary_file("benchmark-image.bin");
+            ds.save_image(file);
+            return [&ds, file](std::size_t) { keep(ds.open_image(file)); }; }, true},
+        {"clear_all", [](Datastructures& ds, Fixture&, std::size_t) -> Call {
+            return [&ds](std::size_t) { ds.clear_all(); }; }, true},
+    };
+}
+
+// Two-sided 95 % critical values of Student's t for 1 to 30 degrees of freedom
+double t_critical(unsigned int df)
+{
+    static double const table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                   2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                   2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    if (df == 0) { return 0; }
+    return (df <= 30) ? table[df - 1] : 1.96;
+}
+
+struct Result
+{
+    double mean_ns = 0;
+    double stddev_ns = 0;
+    double ci95_ns = 0;
+    unsigned int reps = 0;
+    unsigned int batch = 0;
+};
+
+Result run(Benchmark const& benchmark, unsigned int n, Options const& options)
+{
+    using Clock = std::chrono::steady_clock;
+    auto batch = benchmark.single ? 1u : options.batch;
+    auto warmup = benchmark.single ? 0u : options.warmup;
+    std::vector<double> samples;
+
+    std::unique_ptr<Datastructures> ds;
+    Call call;
+    for (unsigned int rep = 0; rep < options.reps; ++rep)
+    {
+        // Same data for every size and operation, so that the operations can be compared
+        if (!ds || benchmark.single)
+        {
+            ds = std::make_unique<Datastructures>();
+            // Queries should see the fixture, the first one waits for its snapshot during warmup
+            ds->wait_for_updates(true);
+            Fixture fixture(n, options.seed);
+            fixture.build(*ds);
+            auto calls = benchmark.single ? 1 : warmup + static_cast<std::size_t>(options.reps) * batch;
+            call = benchmark.prepare(*ds, fixture, calls);
+            for (unsigned int i = 0; i < warmup; ++i) { call(i); }
+        }
+
+        std::size_t first = benchmark.single ? 0 : warmup + static_cast<std::size_t>(rep) * batch;
+        auto start = Clock::now();
+        for (std::size_t i = first; i < first + batch; ++i) { call(i); }
+        auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        samples.push_back(elapsed / batch);
+    }
+
+    Result result;
+    result.reps = samples.size();
+    result.batch = batch;
+    for (auto sample : samples) { result.mean_ns += sample; }
+    result.mean_ns /= samples.size();
+    double squares = 0;
+    for (auto sample : samples) { squares += (sample - result.mean_ns) * (sample - result.mean_ns); }
+    if (samples.size() > 1)
+    {
+        result.stddev_ns = std::sqrt(squares / (samples.size() - 1));
+        result.ci95_ns = t_critical(samples.size() - 1) * result.stddev_ns / std::sqrt(samples.size());
+    }
+    return result;
+}
+
+bool parse_options(int argc, char* argv[], Options& options)
+{
+    auto list = [](std::string const& text) {
+        std::vector<std::string> items;
+        std::istringstream stream(text);
+        for (std::string item; std::getline(stream, item, ','); ) { if (!item.empty()) { items.push_back(item); } }
+        return items; };
+
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            bool has_value = (i + 1 < argc);
+            if (arg == "--csv") { options.csv = true; }
+            else if (arg == "--sizes" && has_value)
+            {
+                options.sizes.clear();
+                for (auto const& size : list(argv[++i])) { options.sizes.push_back(std::stoul(size)); }
+            }
+            else if (arg == "--reps" && has_value) { options.reps = std::max(1ul, std::stoul(argv[++i])); }
+            else if (arg == "--batch" && has_value) { options.batch = std::max(1ul, std::stoul(argv[++i])); }
+            else if (arg == "--warmup" && has_value) { options.warmup = std::stoul(argv[++i]); }
+            else if (arg == "--seed" && has_value) { options.seed = std::stoul(argv[++i]); }
+            else if (arg == "--filter" && has_value) { options.filter = list(argv[++i]); }
+            else { return false; }
+        }
+    }
+    catch (std::exception const&)
+    {
+        return false;
+    }
+    return !options.sizes.empty();
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!parse_options(argc, argv, options))
+    {
+        std::cerr << "Usage: " << argv[0] << " [--sizes n1,n2,...] [--reps r] [--batch b] [--warmup w]"
+                  << " [--seed s] [--filter op1,op2,...] [--csv]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Benchmark> selected;
+    for (auto const& benchmark : benchmarks())
+    {
+        bool named = std::find(options.filter.begin(), options.filter.end(), benchmark.name) != options.filter.end();
+        if (named || (options.filter.empty() && !benchmark.explicit_only)) { selected.push_back(benchmark); }
+    }
+    if (selected.empty())
+    {
+        std::cerr << "No operations match the filter" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (options.csv)
+    {
+        std::cout << "operation,n,mean_ns,ci95_ns,stddev_ns,reps,batch" << std::endl;
+    }
+    else
+    {
+        std::cout << "Seed " << options.seed << ", " << options.reps << " repetitions of " << options.batch
+                  << " calls after " << options.warmup << " warm-up calls" << std::endl;
+        std::cout << std::setw(34) << std::left << "operation" << std::right << std::setw(9) << "N"
+                  << std::setw(14) << "mean ns/call" << std::setw(14) << "95% CI" << std::setw(8) << "rel" << std::endl;
+    }
+
+    for (auto n : options.sizes)
+    {
+        for (auto const& benchmark : selected)
+        {
+            Result result;
+            try
+            {
+                result = run(benchmark, n, options);
+            }
+            catch (NotImplemented const& e)
+            {
+                if (!options.csv)
+                {
+                    std::cout << std::setw(34) << std::left << benchmark.name << std::right << std::setw(9) << n
+                              << "  " << e.what() << std::endl;
+                }
+                continue;
+            }
+
+            if (options.csv)
+            {
+                std::cout << benchmark.name << ',' << n << ',' << result.mean_ns << ',' << result.ci95_ns << ','
+                          << result.stddev_ns << ',' << result.reps << ',' << result.batch << std::endl;
+            }
+            else
+            {
+                std::ostringstream ci;
+                ci << "+-" << std::setprecision(3) << result.ci95_ns;
+                std::ostringstream rel;
+                rel << std::fixed << std::setprecision(1) << (result.mean_ns > 0 ? 100 * result.ci95_ns / result.mean_ns : 0) << "%";
+                std::cout << std::setw(34) << std::left << benchmark.name << std::right << std::setw(9) << n
+                          << std::setw(14) << std::setprecision(4) << result.mean_ns << std::setw(14) << ci.str()
+                          << std::setw(8) << rel.str() << std::endl;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
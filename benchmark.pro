@@ -0,0 +1,15 @@
+# Headless benchmark of the Datastructures operations, see benchmark.cc
+TEMPLATE = app
+TARGET = benchmark
+CONFIG += c++17 console warn_on thread
+CONFIG -= qt app_bundle
+
+SOURCES += \
+        benchmark.cc \
+        datastructures.cc \
+        trace.cc
+
+HEADERS += \
+    datastructures.hh \
+    mappedfile.hh \
+    trace.hh
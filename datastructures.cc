@@ -5,6 +5,8 @@
 // Student number: 150281685
 
 #include "datastructures.hh"
+#include "mappedfile.hh"
+#include "trace.hh"
 
 #include <random>
 
@@ -12,9 +14,277 @@
 
 #include <queue>
 #include <iostream>
+#include <algorithm>
+#include <map>
+#include <stack>
+#include <thread>
+#include <exception>
+#include <fstream>
+#include <string_view>
+#include <array>
+#include <cstring>
+#include <numeric>
+#include <type_traits>
 
 std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
 
+namespace {
+// Snapshot files start with a header of the magic bytes, the format version, the payload
+// size and an FNV-1a checksum of the payload. Numbers are little-endian whatever the
+// platform, and strings are stored as their length followed by the characters
+constexpr std::string_view SNAPSHOT_MAGIC = "PRG2SNAP";
+constexpr std::uint32_t SNAPSHOT_VERSION = 2;
+constexpr std::size_t SNAPSHOT_HEADER_SIZE = 8 + 4 + 4 + 8 + 8;
+
+std::uint64_t fnv1a(std::string_view bytes)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (char c : bytes) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+class BinaryWriter {
+public:
+    void u16(std::uint16_t value) { put(value, 2); }
+    void u32(std::uint32_t value) { put(value, 4); }
+    void u64(std::uint64_t value) { put(value, 8); }
+    void i32(std::int32_t value) { put(static_cast<std::uint32_t>(value), 4); }
+    void str(std::string const& value) { u32(value.size()); buffer.append(value); }
+    std::string buffer;
+
+private:
+    void put(std::uint64_t value, unsigned int bytes)
+    {
+        for (unsigned int i = 0; i < bytes; ++i)
+            buffer.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+};
+
+// Reads the values back in place. Reading past the end clears 'ok' and gives zeros,
+// so the caller checks once at the end instead of after every value
+class BinaryReader {
+public:
+    explicit BinaryReader(std::string_view bytes) : bytes(bytes) {}
+    std::uint16_t u16() { return get(2); }
+    std::uint32_t u32() { return get(4); }
+    std::uint64_t u64() { return get(8); }
+    std::int32_t i32() { return static_cast<std::int32_t>(static_cast<std::uint32_t>(get(4))); }
+    std::string str()
+    {
+        auto length = u32();
+        if (!ok || bytes.size() - pos < length) {
+            ok = false;
+            return {};
+        }
+        pos += length;
+        return std::string(bytes.substr(pos - length, length));
+    }
+    // A count of items each taking at least 'item_size' bytes, checked against what is left
+    std::uint32_t count(std::size_t item_size)
+    {
+        auto value = u32();
+        if (value > (bytes.size() - pos) / item_size)
+            ok = false;
+        return ok ? value : 0;
+    }
+    bool at_end() const { return pos == bytes.size(); }
+    bool ok = true;
+
+private:
+    std::uint64_t get(unsigned int size)
+    {
+        if (!ok || bytes.size() - pos < size) {
+            ok = false;
+            return 0;
+        }
+        std::uint64_t value = 0;
+        for (unsigned int i = 0; i < size; ++i)
+            value |= std::uint64_t(static_cast<unsigned char>(bytes[pos + i])) << (8 * i);
+        pos += size;
+        return value;
+    }
+    std::string_view bytes;
+    std::size_t pos = 0;
+};
+
+// Network images start with the magic bytes, the format version, a byte order mark and
+// the number of sections, followed by the offset and length of each section and the
+// sections themselves, each aligned to 8 bytes. The arrays are stored as they are in
+// memory so that the queries can use them in place, which is why an image can only be
+// opened on a machine with the same byte order and type sizes
+constexpr std::string_view IMAGE_MAGIC = "PRG2NETI";
+constexpr std::uint32_t IMAGE_VERSION = 1;
+constexpr std::uint32_t IMAGE_BYTE_ORDER = 0x01020304;
+enum ImageSection : unsigned int {
+    IDS_OFFSETS, IDS_CHARS, ID_ORDER, COORDS, EDGE_BEGIN, EDGE_TO, EDGE_DIST,
+    PATTERN_STOP_BEGIN, PATTERN_STOPS, PATTERN_TRIP_BEGIN, PATTERN_TRIPS,
+    PATTERN_TIME_BEGIN, PATTERN_TIMES, TRAIN_OFFSETS, TRAIN_CHARS,
+    STOP_ROUTES_BEGIN, STOP_ROUTES, DEPARTURE_BEGIN, DEPARTURE_TIMES, DEPARTURE_TRAINS,
+    NAME_OFFSETS, NAME_CHARS, STATION_REGIONS_BEGIN, STATION_REGIONS,
+    REGION_IDS, REGION_NAME_OFFSETS, REGION_NAME_CHARS,
+    IMAGE_SECTIONS
+};
+constexpr std::size_t IMAGE_HEADER_SIZE = 8 + 4 + 4 + 4 + 4 + IMAGE_SECTIONS * 16;
+
+template <typename T>
+T read_raw(std::string_view bytes, std::size_t pos)
+{
+    T value;
+    std::memcpy(&value, bytes.data() + pos, sizeof(T));
+    return value;
+}
+
+template <typename T>
+void append_raw(std::string& bytes, T value)
+{
+    bytes.append(reinterpret_cast<char const*>(&value), sizeof(T));
+}
+
+// Strings back to back with the offset where each one starts and the last one ends
+struct StringTable {
+    std::vector<std::uint32_t> offsets {0};
+    std::string chars;
+    void add(std::string_view value)
+    {
+        chars.append(value);
+        offsets.push_back(chars.size());
+    }
+    std::string_view operator[](std::size_t i) const
+    {
+        return std::string_view(chars).substr(offsets[i], offsets[i + 1] - offsets[i]);
+    }
+};
+
+class ImageWriter {
+public:
+    template <typename T>
+    void add(ImageSection section, T const* values, std::size_t count)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Image arrays are copied byte by byte");
+        data.resize((data.size() + 7) / 8 * 8, '\0');
+        sections[section] = {IMAGE_HEADER_SIZE + data.size(), count};
+        data.append(reinterpret_cast<char const*>(values), count * sizeof(T));
+    }
+    template <typename T>
+    void add(ImageSection section, std::vector<T> const& values) { add(section, values.data(), values.size()); }
+    void add(ImageSection offsets, ImageSection chars, StringTable const& strings)
+    {
+        add(offsets, strings.offsets);
+        add(chars, strings.chars.data(), strings.chars.size());
+    }
+    std::string finish() const
+    {
+        std::string image(IMAGE_MAGIC);
+        append_raw(image, IMAGE_VERSION);
+        append_raw(image, IMAGE_BYTE_ORDER);
+        append_raw<std::uint32_t>(image, IMAGE_SECTIONS);
+        append_raw<std::uint32_t>(image, 0);
+        for (auto const& [offset, count] : sections) {
+            append_raw(image, offset);
+            append_raw(image, count);
+        }
+        return image + data;
+    }
+
+private:
+    std::string data;
+    std::array<std::pair<std::uint64_t, std::uint64_t>, IMAGE_SECTIONS> sections {};
+};
+
+// Operation counters, in the order of the fields of Datastructures::OperationCounters
+enum Counter { HASH_PROBES, SEARCHES, NODES_VISITED, HEAP_PUSHES, HEAP_POPS, INDEX_REBUILDS,
+               DEPARTURES_SCANNED, COUNTER_COUNT };
+using CounterArray = std::array<unsigned long long, COUNTER_COUNT>;
+
+// Each thread adds to its own counters, which are summed when read. Only the owning
+// thread writes, so a load and a store do without a locked add; the counters are
+// atomic so that other threads can read them while they change.
+// The counters are process-wide: a thread's counters take the work of every
+// Datastructures instance it runs, and each instance only keeps its own zero point
+struct ThreadCounters;
+std::mutex process_counters_mutex;
+std::vector<ThreadCounters*> process_thread_counters;
+CounterArray process_exited_counts {}; // Left by the threads that have ended
+
+struct ThreadCounters {
+    std::array<std::atomic<unsigned long long>, COUNTER_COUNT> counts {};
+
+    ThreadCounters()
+    {
+        std::lock_guard<std::mutex> lock(process_counters_mutex);
+        process_thread_counters.push_back(this);
+    }
+    ~ThreadCounters()
+    {
+        std::lock_guard<std::mutex> lock(process_counters_mutex);
+        for (unsigned int i = 0; i < COUNTER_COUNT; ++i)
+            process_exited_counts[i] += counts[i].load(std::memory_order_relaxed);
+        process_thread_counters.erase(std::find(process_thread_counters.begin(), process_thread_counters.end(), this));
+    }
+};
+
+void count(Counter counter, unsigned long long amount = 1)
+{
+    static thread_local ThreadCounters counters;
+    auto& slot = counters.counts[counter];
+    slot.store(slot.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// Called with process_counters_mutex held
+Datastructures::OperationCounters total_counts()
+{
+    auto totals = process_exited_counts;
+    for (auto counters : process_thread_counters)
+        for (unsigned int i = 0; i < COUNTER_COUNT; ++i)
+            totals[i] += counters->counts[i].load(std::memory_order_relaxed);
+    Datastructures::OperationCounters result;
+    result.hash_probes = totals[HASH_PROBES];
+    result.searches = totals[SEARCHES];
+    result.nodes_visited = totals[NODES_VISITED];
+    result.heap_pushes = totals[HEAP_PUSHES];
+    result.heap_pops = totals[HEAP_POPS];
+    result.index_rebuilds = totals[INDEX_REBUILDS];
+    result.departures_scanned = totals[DEPARTURES_SCANNED];
+    return result;
+}
+}
+
+/**
+ * @brief one_to_all
+ * Dijkstra over flat adjacency arrays, settling every station reachable from the source
+ * @param begin offsets of each station's edges
+ * @param to edge targets
+ * @param dist edge lengths
+ * @param source the station searched from
+ * @param result distance of each station, unreachable ones get the largest value
+ */
+template <typename Offsets, typename Targets, typename Lengths>
+static void one_to_all(Offsets const& begin, Targets const& to, Lengths const& dist,
+                       unsigned int source, std::vector<Distance>& result)
+{
+    using Entry = std::pair<Distance, unsigned int>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+
+    result.assign(begin.size() - 1, std::numeric_limits<Distance>::max());
+    result[source] = 0;
+    queue.push({0, source});
+    while (!queue.empty()) {
+        auto [d, station] = queue.top();
+        queue.pop();
+        if (d > result[station])
+            continue;
+        for (auto e = begin[station]; e < begin[station + 1]; ++e) {
+            if (d + dist[e] < result[to[e]]) {
+                result[to[e]] = d + dist[e];
+                queue.push({d + dist[e], to[e]});
+            }
+        }
+    }
+}
+
 template <typename Type>
 Type random_in_range(Type start, Type end)
 {
@@ -34,19 +304,32 @@ Type random_in_range(Type start, Type end)
 Datastructures::Datastructures()
 {
     // Write any initialization you need here
+    publish_snapshot();
+    builder = std::thread(&Datastructures::build_snapshots, this);
 }
 
 Datastructures::~Datastructures()
 {
     // Write any cleanup you need here
+    {
+        std::lock_guard<std::mutex> lock(versions_mutex);
+        stopping = true;
+    }
+    build_wanted.notify_one();
+    builder.join();
 }
 
 /**
  * @brief Datastructures::station_count the amount of stations
  * @return the size of stations_vector
  */
-unsigned int Datastructures::station_count()
+unsigned int Datastructures::station_count() const
 {
+    if (image_open) {
+        auto snap = current_snapshot();
+        if (snap->network->has_lookups())
+            return snap->network->ids.size();
+    }
     return stations_vector.size();
 }
 
@@ -55,16 +338,17 @@ unsigned int Datastructures::station_count()
  */
 void Datastructures::clear_all()
 {
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
     stations_vector.clear();
     stations_map.clear();
     stations_map_coord.clear();
-    departures.clear();
+    station_departures.clear();
+    departure_index.clear();
+    live_departures = 0;
     regions.clear();
-    region_stations_set.clear();
-    region_stations_vec.clear();
-    parent_regions_set.clear();
-    subregions_set.clear();
-    subregions_vec.clear();
+    image_network = nullptr;
+    image_open = false;
+    changed(NETWORK | REGIONS);
 }
 
 /**
@@ -72,8 +356,10 @@ void Datastructures::clear_all()
  * adds each station to StationID vector
  * @return all stations in a vector with StationID
  */
-std::vector<StationID> Datastructures::all_stations()
+std::vector<StationID> Datastructures::all_stations() const
 {
+    if (image_open)
+        throw NotAvailable("all_stations()");
     std::vector<StationID> station_ids;
     for (const auto &i : stations_vector) {
         station_ids.push_back(i.station_id);
@@ -93,6 +379,10 @@ std::vector<StationID> Datastructures::all_stations()
  */
 bool Datastructures::add_station(StationID id, const Name& name, Coord xy)
 {
+    if (image_open)
+        throw NotAvailable("add_station()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    count(HASH_PROBES);
     auto found = stations_map.find(id);
     if (found != stations_map.end())
         return false;
@@ -104,6 +394,8 @@ bool Datastructures::add_station(StationID id, const Name& name, Coord xy)
         stations_map.insert(std::make_pair(id, s));
         stations_map_coord.insert(std::make_pair(xy, s));
         stations_vector.push_back(s);
+        mark_station(id, true);
+        changed(NETWORK);
         return true;
     }
 }
@@ -115,8 +407,17 @@ bool Datastructures::add_station(StationID id, const Name& name, Coord xy)
  * @param id station's id
  * @return name of station
  */
-Name Datastructures::get_station_name(StationID id)
+Name Datastructures::get_station_name(StationID id) const
 {
+    if (image_open) {
+        auto snap = current_snapshot();
+        auto const& network = *snap->network;
+        if (network.has_lookups()) {
+            auto station = network_index(network, id);
+            return station == NO_INDEX ? NO_NAME : Name(network.names[station]);
+        }
+    }
+    count(HASH_PROBES);
     auto found = stations_map.find(id);
     if (found != stations_map.end())
         return found->second.station_name;
@@ -131,8 +432,17 @@ Name Datastructures::get_station_name(StationID id)
  * @param id station's id
  * @return coordinates of the station
  */
-Coord Datastructures::get_station_coordinates(StationID id)
+Coord Datastructures::get_station_coordinates(StationID id) const
 {
+    if (image_open) {
+        auto snap = current_snapshot();
+        auto const& network = *snap->network;
+        if (network.has_lookups()) {
+            auto station = network_index(network, id);
+            return station == NO_INDEX ? NO_COORD : network.coords[station];
+        }
+    }
+    count(HASH_PROBES);
     auto found = stations_map.find(id);
     if (found != stations_map.end())
         return found->second.station_coord;
@@ -146,6 +456,8 @@ Coord Datastructures::get_station_coordinates(StationID id)
  */
 std::vector<StationID> Datastructures::stations_alphabetically()
 {
+    if (image_open)
+        throw NotAvailable("stations_alphabetically()");
     std::vector<StationID> temp;
     std::sort(stations_vector.begin(), stations_vector.end(), []
               (const Station &s1, const Station &s2) {
@@ -164,6 +476,8 @@ std::vector<StationID> Datastructures::stations_alphabetically()
  */
 std::vector<StationID> Datastructures::stations_distance_increasing()
 {
+    if (image_open)
+        throw NotAvailable("stations_distance_increasing()");
     std::vector<StationID> temp;
     std::sort(stations_vector.begin(), stations_vector.end(),
               [temp](const Station& st1, const Station& st2)
@@ -191,8 +505,11 @@ std::vector<StationID> Datastructures::stations_distance_increasing()
  * @param xy the station's coordinates
  * @return id of the station
  */
-StationID Datastructures::find_station_with_coord(Coord xy)
+StationID Datastructures::find_station_with_coord(Coord xy) const
 {
+    if (image_open)
+        throw NotAvailable("find_station_with_coord()");
+    count(HASH_PROBES);
     auto found = stations_map_coord.find(xy);
     if (found != stations_map_coord.end())
         return found->second.station_id;
@@ -210,6 +527,10 @@ StationID Datastructures::find_station_with_coord(Coord xy)
  */
 bool Datastructures::change_station_coord(StationID id, Coord newcoord)
 {
+    if (image_open)
+        throw NotAvailable("change_station_coord()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    count(HASH_PROBES);
     auto found = stations_map.find(id);
 
     if (found != stations_map.end()) {
@@ -218,6 +539,7 @@ bool Datastructures::change_station_coord(StationID id, Coord newcoord)
         auto nh = stations_map_coord.extract(previous_coord);
         nh.key() = newcoord;
         stations_map_coord.insert(std::move(nh));
+        changed(NETWORK);
         return true;
     }
     return false;
@@ -230,37 +552,24 @@ bool Datastructures::change_station_coord(StationID id, Coord newcoord)
  * @param stationid the station of the departure
  * @param trainid the train's id
  * @param time the time of departure
- * @return true if given train is not due to depart somewhere else
- * simultaneously false if else
+ * @return true if given train doesn't already leave from the station,
+ * false if else
  */
 bool Datastructures::add_departure(StationID stationid, TrainID trainid, Time time)
 {
+    if (image_open)
+        throw NotAvailable("add_departure()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    count(HASH_PROBES);
     auto found = stations_map.find(stationid);
 
     if (found == stations_map.end()) {
         return false;
     }
 
-    auto find_departure = std::find_if(departures.begin(), departures.end(),
-                           [trainid, stationid, time] (Departure dt) {
-        return (trainid == dt.train_id
-                && stationid == dt.departure_station)
-                ||
-               (stationid == dt.departure_station &&
-                time == dt.departure_time);
-    });
-
-    if (find_departure != departures.end())
-        return false;
-
-    else {
-        Departure d;
-        d.departure_station = stationid;
-        d.train_id = trainid;
-        d.departure_time = time;
-        departures.push_back(d);
-        return true;
-    }
+    bool added = insert_departure(stationid, trainid, time);
+    publish_departures();
+    return added;
 }
 
 /**
@@ -275,18 +584,12 @@ bool Datastructures::add_departure(StationID stationid, TrainID trainid, Time ti
  */
 bool Datastructures::remove_departure(StationID stationid, TrainID trainid, Time time)
 {
-    auto find_departure = std::find_if(departures.begin(), departures.end(),
-                           [trainid, stationid, time] (Departure dt) {
-        return trainid == dt.train_id && stationid == dt.departure_station
-                && time == dt.departure_time;
-    });
-
-    if (find_departure != departures.end()) {
-        departures.erase(find_departure);
-        return true;
-    }
-    else
-        return false;
+    if (image_open)
+        throw NotAvailable("remove_departure()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    bool removed = erase_departure(stationid, trainid, time);
+    publish_departures();
+    return removed;
 }
 
 /**
@@ -299,21 +602,46 @@ bool Datastructures::remove_departure(StationID stationid, TrainID trainid, Time
  * @return a vector of pairs with time and train id
  */
 std::vector<std::pair<Time, TrainID>> Datastructures::station_departures_after
-    (StationID stationid, Time time)
+    (StationID stationid, Time time) const
 {
     std::vector<std::pair<Time, TrainID>> no_station { {NO_TIME, NO_TRAIN} };
     std::vector<std::pair<Time, TrainID>> no_departures;
     std::vector<std::pair<Time, TrainID>> train_times;
 
-    auto found = stations_map.find(stationid);
+    auto snap = current_snapshot();
+    auto const& network = *snap->network;
+    auto station = network_index(network, stationid);
 
-    if (found == stations_map.end()) {
+    if (station == NO_INDEX) {
         return no_station;
     }
 
-    for (auto &i : departures) {
-        if (stationid == i.departure_station && time <= i.departure_time) {
-            train_times.push_back(std::make_pair(i.departure_time, i.train_id));
+    // An image has the departures it was saved with in its arrays
+    if (!snap->departures) {
+        count(DEPARTURES_SCANNED, network.departure_begin[station + 1] - network.departure_begin[station]);
+        for (auto i = network.departure_begin[station]; i < network.departure_begin[station + 1]; ++i) {
+            if (time <= network.departure_times[i]) {
+                train_times.push_back({network.departure_times[i], TrainID(network.trains[network.departure_trains[i]])});
+            }
+        }
+        return train_times;
+    }
+
+    // The version is read before the list, so that every entry of that version or older is
+    // in the list, and the newer ones are left out as they may belong to an unfinished update
+    auto version = departures_published.load(std::memory_order_acquire);
+    auto list = std::atomic_load(&(*snap->departures)[station]->list);
+    if (!list) {
+        return no_departures;
+    }
+
+    auto size = list->size.load(std::memory_order_acquire);
+    count(DEPARTURES_SCANNED, size);
+    for (std::size_t i = 0; i < size; ++i) {
+        auto const& departure = list->entries[i];
+        auto removed = departure.removed.load(std::memory_order_acquire);
+        if (departure.added <= version && (removed == 0 || removed > version) && time <= departure.time) {
+            train_times.push_back({departure.time, departure.train});
         }
     }
     return train_times;
@@ -330,6 +658,10 @@ std::vector<std::pair<Time, TrainID>> Datastructures::station_departures_after
  */
 bool Datastructures::add_region(RegionID id, const Name &name, std::vector<Coord> coords)
 {
+    if (image_open)
+        throw NotAvailable("add_region()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    count(HASH_PROBES);
     auto it = regions.find(id);
 
     if (it == regions.end()) {
@@ -339,6 +671,7 @@ bool Datastructures::add_region(RegionID id, const Name &name, std::vector<Coord
         r.region_id = id;
         r.region_name = name;
         regions.insert(std::pair(id, r));
+        changed(REGIONS);
         return true;
     }
     else
@@ -350,8 +683,10 @@ bool Datastructures::add_region(RegionID id, const Name &name, std::vector<Coord
  * returns a vector with all regions added
  * @return vector of region id's
  */
-std::vector<RegionID> Datastructures::all_regions()
+std::vector<RegionID> Datastructures::all_regions() const
 {
+    if (image_open)
+        throw NotAvailable("all_regions()");
     std::vector<RegionID> region_ids;
     for (auto &i : regions) {
         region_ids.push_back(i.second.region_id);
@@ -366,8 +701,20 @@ std::vector<RegionID> Datastructures::all_regions()
  * @param id the region's id
  * @return name of region
  */
-Name Datastructures::get_region_name(RegionID id)
+Name Datastructures::get_region_name(RegionID id) const
 {
+    if (image_open) {
+        auto snap = current_snapshot();
+        auto const& network = *snap->network;
+        if (network.has_lookups()) {
+            auto found = std::lower_bound(network.region_ids.begin(), network.region_ids.end(), id);
+            if (found == network.region_ids.end() || *found != id)
+                return NO_NAME;
+            return Name(network.region_names[found - network.region_ids.begin()]);
+        }
+    }
+
+    count(HASH_PROBES);
     auto it = regions.find(id);
 
     if (it != regions.end())
@@ -383,10 +730,13 @@ Name Datastructures::get_region_name(RegionID id)
  * @param id the region's id
  * @return name of the region
  */
-std::vector<Coord> Datastructures::get_region_coords(RegionID id)
+std::vector<Coord> Datastructures::get_region_coords(RegionID id) const
 {
+    if (image_open)
+        throw NotAvailable("get_region_coords()");
     std::vector<Coord> no_coords {{NO_COORD}};
 
+    count(HASH_PROBES);
     auto it = regions.find(id);
     if (it != regions.end())
         return it->second.region_coords;
@@ -403,12 +753,17 @@ std::vector<Coord> Datastructures::get_region_coords(RegionID id)
  */
 bool Datastructures::add_subregion_to_region(RegionID id, RegionID parentid)
 {
+    if (image_open)
+        throw NotAvailable("add_subregion_to_region()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    count(HASH_PROBES, 2);
     auto find_region = regions.find(parentid);
     auto find_sub = regions.find(id);
 
     if (find_region != regions.end() && find_sub != regions.end()) {
         find_region->second.children.push_back(&find_sub->second);
         find_sub->second.parent = &find_region->second;
+        changed(REGIONS);
         return true;
     }
     else
@@ -424,15 +779,21 @@ bool Datastructures::add_subregion_to_region(RegionID id, RegionID parentid)
  */
 bool Datastructures::add_station_to_region(StationID id, RegionID parentid)
 {
+    if (image_open)
+        throw NotAvailable("add_station_to_region()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    count(HASH_PROBES);
     auto found = stations_map.find(id);
 
     if (found == stations_map.end())
         return false;
 
+    count(HASH_PROBES);
     auto find_region = regions.find(parentid);
 
     if (find_region != regions.end()) {
         find_region->second.stations.insert(std::pair(id, found->second));
+        changed(REGIONS);
         return true;
     }
     return false;
@@ -445,23 +806,28 @@ bool Datastructures::add_station_to_region(StationID id, RegionID parentid)
  * @param id the id of the station
  * @return vector of region id's
  */
-std::vector<RegionID> Datastructures::station_in_regions(StationID id)
+std::vector<RegionID> Datastructures::station_in_regions(StationID id) const
 {
-    region_stations_vec.clear();
-    region_stations_set.clear();
-
-    auto find_station = stations_map.find(id);
-
-    if (find_station == stations_map.end())
+    auto snap = current_snapshot();
+    auto const& network = *snap->network;
+    auto station = network_index(network, id);
+    if (station == NO_INDEX)
         return no_region_vec;
 
-    for (auto &i : regions) {
-        if (i.second.stations.find(id) != i.second.stations.end()) {
-            find_parent(&i.second);
-
-        }
+    // An image has the regions of its stations listed in its arrays
+    if (!snap->regions) {
+        if (!network.has_lookups())
+            return {};
+        auto found = network.station_regions.slice(network.station_regions_begin[station],
+                                                   network.station_regions_begin[station + 1]);
+        return std::vector<RegionID>(found.begin(), found.end());
     }
-    return region_stations_vec;
+
+    count(HASH_PROBES);
+    auto found = snap->regions->station_regions.find(id);
+    if (found == snap->regions->station_regions.end())
+        return {};
+    return found->second;
 }
 
 /**
@@ -471,18 +837,22 @@ std::vector<RegionID> Datastructures::station_in_regions(StationID id)
  * @param id the 'parent' region's id
  * @return vector of region id's with the 'children'
  */
-std::vector<RegionID> Datastructures::all_subregions_of_region(RegionID id)
+std::vector<RegionID> Datastructures::all_subregions_of_region(RegionID id) const
 {
-    subregions_vec.clear();
+    if (image_open)
+        throw NotAvailable("all_subregions_of_region()");
+    auto& ctx = query_context();
+    ctx.subregions_vec.clear();
 
+    count(HASH_PROBES);
     auto it = regions.find(id);
 
     if (it != regions.end())
-        find_children(&it->second);
+        find_children(&it->second, ctx);
     else
         return no_region_vec;
 
-    return subregions_vec;
+    return ctx.subregions_vec;
 }
 
 /**
@@ -494,6 +864,8 @@ std::vector<RegionID> Datastructures::all_subregions_of_region(RegionID id)
  */
 std::vector<StationID> Datastructures::stations_closest_to(Coord xy)
 {
+    if (image_open)
+        throw NotAvailable("stations_closest_to()");
     std::vector<StationID> stations_closest;
     std::sort(stations_vector.begin(), stations_vector.end(), [xy]
               (const Station &a, const Station &b) {
@@ -518,15 +890,21 @@ std::vector<StationID> Datastructures::stations_closest_to(Coord xy)
  */
 bool Datastructures::remove_station(StationID id)
 {
+    if (image_open)
+        throw NotAvailable("remove_station()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
     auto found = std::find_if(stations_vector.begin(), stations_vector.end(), [id]
                               (const Station &s) {
        return s.station_id == id;
     });
 
     if (found != stations_vector.end()) {
+        Coord coord = found->station_coord;
         stations_vector.erase(found);
         stations_map.erase(id);
-        stations_map_coord.erase(found->station_coord);
+        stations_map_coord.erase(coord);
+        mark_station(id, false);
+        changed(NETWORK);
         return true;
     }
     return false;
@@ -539,22 +917,30 @@ bool Datastructures::remove_station(StationID id)
  * @param id2 the id of region No.2
  * @return the common parents region if such exists
  */
-RegionID Datastructures::common_parent_of_regions(RegionID id1, RegionID id2)
+RegionID Datastructures::common_parent_of_regions(RegionID id1, RegionID id2) const
 {
-    parent_regions_set.clear();
-    has_common = false;
+    if (image_open)
+        throw NotAvailable("common_parent_of_regions()");
+    auto snap = current_snapshot();
+    if (!snap->regions)
+        return NO_REGION;
+    auto const& index = *snap->regions;
+    auto& ctx = query_context();
+    ctx.parent_regions_set.clear();
+    ctx.has_common = false;
 
-    auto it1 = regions.find(id1);
-    auto it2 = regions.find(id2);
+    count(HASH_PROBES, 2);
+    auto it1 = index.parents.find(id1);
+    auto it2 = index.parents.find(id2);
 
-    if (it1 == regions.end() || it2 == regions.end())
+    if (it1 == index.parents.end() || it2 == index.parents.end())
             return NO_REGION;
 
-    common_parent(it1->second.parent);
-    common_parent(it2->second.parent);
+    common_parent(index, it1->second, ctx);
+    common_parent(index, it2->second, ctx);
 
-    if (has_common == true)
-        return common_parent_id;
+    if (ctx.has_common == true)
+        return ctx.common_parent_id;
     else
         return NO_REGION;
 }
@@ -569,6 +955,10 @@ RegionID Datastructures::common_parent_of_regions(RegionID id1, RegionID id2)
 bool Datastructures::add_train
 (TrainID trainid, std::vector<std::pair<StationID, Time>> stationtimes)
 {
+    if (image_open)
+        throw NotAvailable("add_train()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    count(HASH_PROBES);
     auto find_train = trains_uo_map.find(trainid);
 
 
@@ -576,28 +966,26 @@ bool Datastructures::add_train
         return false;
 
     for (auto &i : stationtimes) {
-        if (get_station_name(i.first) == NO_NAME)
+        count(HASH_PROBES);
+        if (stations_map.find(i.first) == stations_map.end())
             return false;
     }
 
 
+    // The departures are published together, as far as the train got
     for (auto it = stationtimes.begin(); it != stationtimes.end(); ++it) {
-        if (!add_departure(it->first, trainid, it->second)) {
+        if (!insert_departure(it->first, trainid, it->second)) {
+            publish_departures();
             return false;
         }
-        add_departure(it->first, trainid, it->second);
-        if (it != stationtimes.end() - 1) {
-            auto next = it;
-            std::advance(next, 1);
-            destinations.insert({it->first, next->first});
-        }
-
     }
+    publish_departures();
     Train t;
     t.id = trainid;
     t.station_times = stationtimes;
     trains_uo_map.insert(std::make_pair(trainid, t));
     trains_vector.push_back(t);
+    changed(NETWORK);
     return true;
 
 }
@@ -608,19 +996,18 @@ bool Datastructures::add_train
  * @param id the stations id
  * @return vector of direct connections to station
  */
-std::vector<StationID> Datastructures::next_stations_from(StationID id)
+std::vector<StationID> Datastructures::next_stations_from(StationID id) const
 {
-    // Replace the line below with your implementation
-    // Also uncomment parameters ( /* param */ -> param )
     std::vector<StationID> stations_next_to;
 
-    if (get_station_name(id) == NO_NAME)
+    auto snap = current_snapshot();
+    auto const& network = *snap->network;
+    auto station = network_index(network, id);
+    if (station == NO_INDEX)
         return std::vector<StationID> {NO_STATION};
 
-    for (auto it = destinations.begin(); it != destinations.end(); ++it) {
-        if (it->first == id)
-            stations_next_to.push_back(it->second);
-    }
+    for (auto i = network.edge_begin[station]; i < network.edge_begin[station + 1]; ++i)
+        stations_next_to.push_back(StationID(network.ids[network.edge_to[i]]));
     return stations_next_to;
 }
 
@@ -632,8 +1019,10 @@ std::vector<StationID> Datastructures::next_stations_from(StationID id)
  * @return vector of stations in a trains route after given station
  */
 std::vector<StationID> Datastructures::train_stations_from
-    (StationID stationid, TrainID trainid)
+    (StationID stationid, TrainID trainid) const
 {
+    if (image_open)
+        throw NotAvailable("train_stations_from()");
     // Replace the line below with your implementation
     // Also uncomment parameters ( /* param */ -> param )
     std::vector<StationID> not_found {NO_STATION};
@@ -642,6 +1031,7 @@ std::vector<StationID> Datastructures::train_stations_from
     if (get_station_name(stationid) == NO_NAME)
         return not_found;
 
+    count(HASH_PROBES);
     auto found_train = trains_uo_map.find(trainid);
     if (found_train == trains_uo_map.end())
         return not_found;
@@ -666,15 +1056,15 @@ std::vector<StationID> Datastructures::train_stations_from
 
 /**
  * @brief Datastructures::clear_trains
- * clears all the data structures storing trains, destinations and departures
+ * clears all the data structures storing trains and departures
  */
 void Datastructures::clear_trains()
 {
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
     trains_uo_map.clear();
     trains_vector.clear();
-    destinations.clear();
-    departures.clear();
-
+    clear_departures();
+    changed(NETWORK);
 }
 
 /**
@@ -683,112 +1073,2295 @@ void Datastructures::clear_trains()
  * an arrival station, if such route is possible
  * @param fromid the station of departure
  * @param toid the station of arrival
- * @return vector of stations and distances in an unspecific route between two stations
+ * @return vector of stations and distances in an unspecific route between two stations,
+ * empty if no route exists
  */
 std::vector<std::pair<StationID, Distance>> Datastructures::route_any
-    (StationID fromid, StationID toid)
+    (StationID fromid, StationID toid) const
+{
+    std::vector<std::pair<StationID, Distance>> not_found {{NO_STATION, NO_DISTANCE}};
+
+    // Any route will do, so the shortest one found in the snapshot is as good as any
+    auto snap = current_snapshot();
+    auto const& network = *snap->network;
+    auto from = network_index(network, fromid);
+    auto to = network_index(network, toid);
+    if (from == NO_INDEX || to == NO_INDEX)
+        return not_found;
+
+    return route_from_path(network, shortest_path(query_context(), *snap, from, to));
+}
+
+/**
+ * @brief Datastructures::route_least_stations
+ * @return
+ */
+std::vector<std::pair<StationID, Distance>> Datastructures::route_least_stations
+    (StationID /*fromid*/, StationID /*toid*/) const
 {
     // Replace the line below with your implementation
     // Also uncomment parameters ( /* param */ -> param )
-    std::vector<std::pair<StationID, Distance>> route_with_distance;
-    std::vector<std::pair<StationID, Distance>> not_found {{NO_STATION, NO_DISTANCE}};
-    std::vector<std::pair<StationID, Distance>> no_route;
-    std::deque<StationID> path;
+    throw NotImplemented("route_least_stations()");
+}
+
+/**
+ * @brief Datastructures::route_with_cycle
+ * returns a route from the given station which ends at the first station
+ * visited twice, found with an iterative depth-first search
+ * @param fromid the station of departure
+ * @return vector of stations ending with the repeated station, empty if
+ * no cycle can be reached from the station
+ */
+std::vector<StationID> Datastructures::route_with_cycle(StationID fromid) const
+{
+    std::vector<StationID> not_found {NO_STATION};
+    std::vector<StationID> route;
 
-    if (get_station_name(fromid) == NO_NAME)
+    auto snap = current_snapshot();
+    auto const& network = *snap->network;
+    auto& ctx = query_context();
+    auto from = network_index(network, fromid);
+    if (from == NO_INDEX)
         return not_found;
 
-    if (get_station_name(toid) == NO_NAME)
+    if (ctx.dfs_colour.size() != network.ids.size())
+        ctx.dfs_colour.assign(network.ids.size(), Colour::WHITE);
+
+    ctx.dfs_stack.clear();
+    ctx.dfs_stack.push_back({from, network.edge_begin[from]});
+    ctx.dfs_colour[from] = Colour::GREY;
+    ctx.dfs_touched.push_back(from);
+
+    count(SEARCHES);
+    while (!ctx.dfs_stack.empty()) {
+        auto& [station, edge] = ctx.dfs_stack.back();
+        if (edge == network.edge_begin[station + 1]) {
+            ctx.dfs_colour[station] = Colour::BLACK;
+            ctx.dfs_stack.pop_back();
+            continue;
+        }
+
+        auto next = network.edge_to[edge++];
+        if (ctx.dfs_colour[next] == Colour::GREY) {
+            // Back edge: the stack is the route up to the repeated station
+            for (auto const& frame : ctx.dfs_stack)
+                route.push_back(StationID(network.ids[frame.first]));
+            route.push_back(StationID(network.ids[next]));
+            break;
+        }
+        if (ctx.dfs_colour[next] == Colour::WHITE) {
+            ctx.dfs_colour[next] = Colour::GREY;
+            ctx.dfs_touched.push_back(next);
+            ctx.dfs_stack.push_back({next, network.edge_begin[next]});
+        }
+    }
+
+    count(NODES_VISITED, ctx.dfs_touched.size());
+    for (auto station : ctx.dfs_touched)
+        ctx.dfs_colour[station] = Colour::WHITE;
+    ctx.dfs_touched.clear();
+    return route;
+}
+
+/**
+ * @brief Datastructures::route_shortest_distance
+ * returns the shortest route in distance between two stations, using the
+ * contraction hierarchy if it has been taken into use
+ * @param fromid the station of departure
+ * @param toid the station of arrival
+ * @return vector of stations and distances travelled so far, empty if no
+ * route exists
+ */
+std::vector<std::pair<StationID, Distance>> Datastructures::route_shortest_distance
+    (StationID fromid, StationID toid) const
+{
+    std::vector<std::pair<StationID, Distance>> not_found {{NO_STATION, NO_DISTANCE}};
+
+    auto snap = current_snapshot();
+    auto const& network = *snap->network;
+    auto& ctx = query_context();
+    auto from = network_index(network, fromid);
+    auto to = network_index(network, toid);
+    if (from == NO_INDEX || to == NO_INDEX)
         return not_found;
 
-    path.push_front(toid);
+    return route_from_path(network, shortest_path(ctx, *snap, from, to));
+}
+
+/**
+ * @brief Datastructures::shortest_path
+ * finds the shortest path with the contraction hierarchy, the landmarks or plain
+ * Dijkstra, whichever the snapshot has been built for
+ * @param snap the snapshot searched
+ * @param from index of the station of departure
+ * @param to index of the station of arrival
+ * @return station indices from the departure to the arrival, empty if no route exists
+ */
+std::vector<unsigned int> Datastructures::shortest_path
+    (QueryContext& ctx, const Snapshot &snap, unsigned int from, unsigned int to) const
+{
+    if (snap.ch_enabled)
+        return ch_path(ctx, snap, from, to);
+
+    if (snap.landmarks)
+        alt_search(ctx, snap, from, to);
+    else
+        dijkstra(ctx, *snap.network, from, to);
 
-    StationID end = toid;
-    unsigned long counter = 0;
+    std::vector<unsigned int> path;
+    if (ctx.search_dist[to] != INFINITE_DISTANCE) {
+        for (auto station = to; station != NO_INDEX; station = ctx.search_parent[station])
+            path.push_back(station);
+        std::reverse(path.begin(), path.end());
+    }
+    for (auto station : ctx.search_touched) {
+        ctx.search_dist[station] = INFINITE_DISTANCE;
+        ctx.search_parent[station] = NO_INDEX;
+    }
+    ctx.search_touched.clear();
+    return path;
+}
 
-    while (end != fromid) {
+/**
+ * @brief Datastructures::route_from_path
+ * pairs each station on a path with the distance travelled when reaching it
+ * @param network the snapshot's network the path is in
+ * @param path station indices from the departure to the arrival
+ * @return vector of stations and distances, empty if the path is empty
+ */
+std::vector<std::pair<StationID, Distance>> Datastructures::route_from_path
+    (const Network &network, const std::vector<unsigned int> &path) const
+{
+    std::vector<std::pair<StationID, Distance>> route;
+    Distance current_dist = 0;
 
-        for (auto iter = destinations.begin(); iter != destinations.end(); ++iter) {
-            if (iter->second == end) {
-                path.push_front(iter->first);
-                end = iter->first;
-                counter = 0;
-            }
-            if (end == fromid)
-                break;
-            if (counter > destinations.size()) {
-                return no_route;
+    for (unsigned int i = 0; i < path.size(); ++i) {
+        if (i > 0)
+            current_dist += calculate_distance(network.coords[path[i - 1]], network.coords[path[i]]);
+        route.push_back({StationID(network.ids[path[i]]), current_dist});
+    }
+    return route;
+}
+
+/**
+ * @brief Datastructures::dijkstra
+ * shortest distances from a station, stopping once the destination is settled.
+ * The caller reads search_dist and search_parent and resets the touched stations
+ * @param from index of the station of departure
+ * @param to index of the station of arrival, NO_INDEX to settle every station
+ */
+void Datastructures::dijkstra(QueryContext& ctx, const Network &network, unsigned int from, unsigned int to) const
+{
+    prepare_search(ctx, network);
+
+    using Entry = std::pair<Distance, unsigned int>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+
+    ctx.search_dist[from] = 0;
+    ctx.search_touched.push_back(from);
+    queue.push({0, from});
+    unsigned long long pushes = 1;
+    unsigned long long pops = 0;
+    unsigned long long visited = 0;
+
+    while (!queue.empty()) {
+        auto [dist, station] = queue.top();
+        queue.pop();
+        ++pops;
+        if (dist > ctx.search_dist[station])
+            continue;
+        ++visited;
+        if (station == to)
+            break;
+
+        for (auto e = network.edge_begin[station]; e < network.edge_begin[station + 1]; ++e) {
+            auto next = network.edge_to[e];
+            auto next_dist = dist + network.edge_dist[e];
+            if (next_dist < ctx.search_dist[next]) {
+                if (ctx.search_dist[next] == INFINITE_DISTANCE)
+                    ctx.search_touched.push_back(next);
+                ctx.search_dist[next] = next_dist;
+                ctx.search_parent[next] = station;
+                queue.push({next_dist, next});
+                ++pushes;
             }
-            counter++;
         }
     }
 
-    StationID previous = "";
-    Distance current_dist = 0;
+    count(SEARCHES);
+    count(NODES_VISITED, visited);
+    count(HEAP_PUSHES, pushes);
+    count(HEAP_POPS, pops);
+}
+
+/**
+ * @brief Datastructures::distance_matrix
+ * returns the shortest distances from each source to each target, computed with
+ * one Dijkstra per source which stops once all the targets are settled
+ * @param sources the stations of departure, one row each
+ * @param targets the stations of arrival, one column each
+ * @return matrix of distances, NO_DISTANCE where either station doesn't exist or
+ * no route exists
+ */
+std::vector<std::vector<Distance>> Datastructures::distance_matrix
+    (const std::vector<StationID> &sources, const std::vector<StationID> &targets) const
+{
+    std::vector<std::vector<Distance>> matrix(sources.size(), std::vector<Distance>(targets.size(), NO_DISTANCE));
+
+    auto snap = current_snapshot();
+    auto const& network = *snap->network;
+    auto& ctx = query_context();
+    prepare_search(ctx, network);
+    ctx.search_is_target.assign(network.ids.size(), false);
+
+    std::vector<unsigned int> columns;
+    unsigned int distinct = 0;
+    for (auto const& id : targets) {
+        columns.push_back(network_index(network, id));
+        if (columns.back() != NO_INDEX && !ctx.search_is_target[columns.back()]) {
+            ctx.search_is_target[columns.back()] = true;
+            ++distinct;
+        }
+    }
 
-    for (auto &i : path) {
-        if (i == fromid) {
-            route_with_distance.push_back(std::make_pair(i, 0));
-            previous = i;
+    using Entry = std::pair<Distance, unsigned int>;
+    std::vector<Entry> heap;
+    unsigned long long searches = 0;
+    unsigned long long pushes = 0;
+    unsigned long long pops = 0;
+    unsigned long long visited = 0;
+    for (unsigned int row = 0; row < sources.size(); ++row) {
+        auto source = network_index(network, sources[row]);
+        if (source == NO_INDEX || distinct == 0)
             continue;
+
+        auto remaining = distinct;
+        heap.clear();
+        ctx.search_dist[source] = 0;
+        ctx.search_touched.push_back(source);
+        heap.push_back({0, source});
+        ++searches;
+        ++pushes;
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+            auto [dist, station] = heap.back();
+            heap.pop_back();
+            ++pops;
+            if (dist > ctx.search_dist[station])
+                continue;
+            ++visited;
+            if (ctx.search_is_target[station] && --remaining == 0)
+                break;
+
+            for (auto e = network.edge_begin[station]; e < network.edge_begin[station + 1]; ++e) {
+                auto next = network.edge_to[e];
+                auto next_dist = dist + network.edge_dist[e];
+                if (next_dist < ctx.search_dist[next]) {
+                    if (ctx.search_dist[next] == INFINITE_DISTANCE)
+                        ctx.search_touched.push_back(next);
+                    ctx.search_dist[next] = next_dist;
+                    heap.push_back({next_dist, next});
+                    std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+                    ++pushes;
+                }
+            }
         }
-        Coord previous_coord = get_station_coordinates(previous);
-        Coord current_coord = get_station_coordinates(i);
-        current_dist += calculate_distance(previous_coord, current_coord);
 
-        route_with_distance.push_back(std::make_pair(i, current_dist));
-        previous = i;
+        for (unsigned int column = 0; column < columns.size(); ++column) {
+            if (columns[column] != NO_INDEX && ctx.search_dist[columns[column]] != INFINITE_DISTANCE)
+                matrix[row][column] = ctx.search_dist[columns[column]];
+        }
+        for (auto station : ctx.search_touched)
+            ctx.search_dist[station] = INFINITE_DISTANCE;
+        ctx.search_touched.clear();
     }
+    count(SEARCHES, searches);
+    count(NODES_VISITED, visited);
+    count(HEAP_PUSHES, pushes);
+    count(HEAP_POPS, pops);
+    return matrix;
+}
+
+/**
+ * @brief Datastructures::run_queries
+ * answers a batch of read-only queries on a pool of worker threads. With
+ * wait_for_updates set, the snapshot is brought up to date first. The workers only
+ * read published snapshots and use their own scratch memory
+ * @param queries the queries to answer
+ * @param threads the number of worker threads, 0 or 1 to answer on the calling thread
+ * @return the result of each query, in the order of the queries
+ */
+std::vector<Datastructures::QueryResult> Datastructures::run_queries
+    (std::vector<Query> const& queries, unsigned int threads) const
+{
+    current_snapshot();
+
+    std::vector<QueryResult> results(queries.size());
+    auto answer = [&](Query const& query) -> QueryResult {
+        switch (query.kind) {
+        case QueryKind::ROUTE_ANY:
+            return route_any(query.from, query.to);
+        case QueryKind::ROUTE_SHORTEST_DISTANCE:
+            return route_shortest_distance(query.from, query.to);
+        case QueryKind::ROUTE_EARLIEST_ARRIVAL:
+            return route_earliest_arrival(query.from, query.to, query.time);
+        case QueryKind::ROUTE_WITH_CYCLE:
+            return route_with_cycle(query.from);
+        case QueryKind::STATION_IN_REGIONS:
+            return station_in_regions(query.from);
+        case QueryKind::COMMON_PARENT_OF_REGIONS:
+            return common_parent_of_regions(query.region1, query.region2);
+        case QueryKind::STATION_DEPARTURES_AFTER:
+            return station_departures_after(query.from, query.time);
+        }
+        return QueryResult();
+    };
+
+    // Queries are handed out in chunks so that the shared counter isn't touched
+    // on every query, yet a slow chunk doesn't hold up the others for long
+    constexpr std::size_t CHUNK = 16;
+    std::atomic<std::size_t> next {0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto work = [&]() {
+        Trace::Span span("run_queries", "query");
+        try {
+            for (auto begin = next.fetch_add(CHUNK); begin < queries.size(); begin = next.fetch_add(CHUNK)) {
+                auto end = std::min(begin + CHUNK, queries.size());
+                for (auto i = begin; i < end; ++i)
+                    results[i] = answer(queries[i]);
+            }
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; ++i)
+        workers.emplace_back(work);
+    work();
+    for (auto& worker : workers)
+        worker.join();
+
+    if (error)
+        std::rethrow_exception(error);
+    return results;
+}
+
+/**
+ * @brief Datastructures::insert_departure
+ * adds a departure to the end of the station's departures unless the train already
+ * leaves from the station. The departure is left out of station_departures_after until
+ * publish_departures is called. Called with writer_mutex held
+ * @return true if the departure was added, false if it is a repeat
+ */
+bool Datastructures::insert_departure(const StationID &stationid, const TrainID &trainid, Time time)
+{
+    count(HASH_PROBES);
+    auto& station = station_departures[stationid];
+    if (!station)
+        station = std::make_shared<StationDepartures>();
+    auto list = station->list;
+    std::size_t size = list ? list->size.load(std::memory_order_relaxed) : 0;
+    if (!departure_index.insert({{stationid, trainid}, size}).second)
+        return false;
 
+    // A full list is copied into a larger one, and readers still reading the old one
+    // finish with it
+    if (!list || size == list->capacity) {
+        auto larger = std::make_shared<DepartureList>(list ? 2 * list->capacity : 4);
+        for (std::size_t i = 0; i < size; ++i)
+            larger->entries[i] = list->entries[i];
+        larger->size.store(size, std::memory_order_relaxed);
+        std::atomic_store(&station->list, larger);
+        list = larger;
+    }
+    auto& departure = list->entries[size];
+    departure.time = time;
+    departure.train = trainid;
+    departure.added = departures_published.load(std::memory_order_relaxed) + 1;
+    list->size.store(size + 1, std::memory_order_release);
+    ++live_departures;
+    return true;
+}
 
-    return route_with_distance;
+/**
+ * @brief Datastructures::erase_departure
+ * marks a departure removed, compacting the station's departures once half of them are.
+ * The departure stays in station_departures_after until publish_departures is called.
+ * Called with writer_mutex held
+ * @return true if the departure was removed, false if there was no such departure
+ */
+bool Datastructures::erase_departure(const StationID &stationid, const TrainID &trainid, Time time)
+{
+    count(HASH_PROBES);
+    auto found = departure_index.find({stationid, trainid});
+    if (found == departure_index.end())
+        return false;
+    auto& station = *station_departures.at(stationid);
+    auto& departure = station.list->entries[found->second];
+    if (departure.time != time)
+        return false;
+    departure.removed.store(departures_published.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    departure_index.erase(found);
+    --live_departures;
+    if (++station.removed * 2 > station.list->size.load(std::memory_order_relaxed))
+        index_departures(stationid, station);
+    return true;
 }
 
+/**
+ * @brief Datastructures::index_departures
+ * copies the departures of a station not removed into a new list, which replaces
+ * the old one, and indexes them. Called with writer_mutex held
+ * @param stationid the station
+ * @param station the station's departures
+ */
+void Datastructures::index_departures(const StationID &stationid, StationDepartures &station)
+{
+    count(INDEX_REBUILDS);
+    auto const& list = *station.list;
+    auto size = list.size.load(std::memory_order_relaxed);
+    auto compacted = std::make_shared<DepartureList>(std::max<std::size_t>(4, size - station.removed));
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+        if (list.entries[i].removed.load(std::memory_order_relaxed) != 0)
+            continue;
+        compacted->entries[kept] = list.entries[i];
+        departure_index[{stationid, list.entries[i].train}] = kept;
+        ++kept;
+    }
+    compacted->size.store(kept, std::memory_order_relaxed);
+    std::atomic_store(&station.list, compacted);
+    station.removed = 0;
+}
 
+/**
+ * @brief Datastructures::publish_departures
+ * makes the departures added and removed since the last call visible to
+ * station_departures_after, all at once. Called with writer_mutex held
+ */
+void Datastructures::publish_departures()
+{
+    departures_published.store(departures_published.load(std::memory_order_relaxed) + 1,
+                               std::memory_order_release);
+}
 
 /**
- * @brief Datastructures::route_least_stations
- * @return
+ * @brief Datastructures::clear_departures
+ * removes every departure, and the lists of the stations removed. The lists are
+ * replaced rather than emptied, so that the queries stop seeing the departures
+ * with the snapshot in which the trains are gone. Called with writer_mutex held
  */
-std::vector<std::pair<StationID, Distance>> Datastructures::route_least_stations
-    (StationID /*fromid*/, StationID /*toid*/)
+void Datastructures::clear_departures()
 {
-    // Replace the line below with your implementation
-    // Also uncomment parameters ( /* param */ -> param )
-    throw NotImplemented("route_least_stations()");
+    for (auto it = station_departures.begin(); it != station_departures.end(); ) {
+        if (!it->second->exists) {
+            it = station_departures.erase(it);
+            continue;
+        }
+        it->second = std::make_shared<StationDepartures>();
+        it->second->exists = true;
+        ++it;
+    }
+    departure_index.clear();
+    live_departures = 0;
 }
 
 /**
- * @brief Datastructures::route_with_cycle
- * @return
+ * @brief Datastructures::mark_station
+ * tells clear_departures whether a station exists, giving a new station its list.
+ * Called with writer_mutex held
+ * @param id the station's id
+ * @param exists true if the station was added, false if removed
  */
-std::vector<StationID> Datastructures::route_with_cycle(StationID /*fromid*/)
+void Datastructures::mark_station(const StationID &id, bool exists)
 {
-    // Replace the line below with your implementation
-    // Also uncomment parameters ( /* param */ -> param )
-    throw NotImplemented("route_with_cycle()");
+    auto& station = station_departures[id];
+    if (!station)
+        station = std::make_shared<StationDepartures>();
+    station->exists = exists;
 }
 
 /**
- * @brief Datastructures::route_shortest_distance
- * @return
+ * @brief Datastructures::add_stations
+ * adds the stations in order like add_station, taking the writer lock once
+ * @param stations id, name and coordinates of each station
+ * @return the number of stations added, repeated ids are skipped
  */
-std::vector<std::pair<StationID, Distance>> Datastructures::route_shortest_distance
-    (StationID /*fromid*/, StationID /*toid*/)
+unsigned int Datastructures::add_stations(const std::vector<std::tuple<StationID, Name, Coord>> &stations)
 {
-    // Replace the line below with your implementation
-    // Also uncomment parameters ( /* param */ -> param )
-    throw NotImplemented("route_shortest_distance()");
+    if (image_open)
+        throw NotAvailable("add_stations()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    unsigned int added = 0;
+
+    stations_map.reserve(stations_map.size() + stations.size());
+    stations_vector.reserve(stations_vector.size() + stations.size());
+    for (auto const& [id, name, xy] : stations) {
+        Station s;
+        s.station_id = id;
+        s.station_name = name;
+        s.station_coord = xy;
+        if (!stations_map.insert(std::make_pair(id, s)).second)
+            continue;
+        stations_map_coord.insert(std::make_pair(xy, s));
+        stations_vector.push_back(s);
+        mark_station(id, true);
+        ++added;
+    }
+
+    if (added > 0)
+        changed(NETWORK);
+    return added;
 }
 
 /**
- * @brief Datastructures::route_earliest_arrival
- * @return
+ * @brief Datastructures::add_trains
+ * adds the trains in order like add_train, checking for repeated departures
+ * in the departure index instead of a scan per stop. The departures of the whole
+ * batch are published to station_departures_after at once
+ * @param trains id and the stations with times of each train
+ * @return the number of trains added
  */
-std::vector<std::pair<StationID, Time>> Datastructures::route_earliest_arrival
-    (StationID /*fromid*/, StationID /*toid*/, Time /*starttime*/)
+unsigned int Datastructures::add_trains
+    (const std::vector<std::pair<TrainID, std::vector<std::pair<StationID, Time>>>> &trains)
 {
-    // Replace the line below with your implementation
-    // Also uncomment parameters ( /* param */ -> param )
-    throw NotImplemented("route_earliest_arrival()");
+    if (image_open)
+        throw NotAvailable("add_trains()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    unsigned int added = 0;
+
+    for (auto const& [trainid, stationtimes] : trains) {
+        count(HASH_PROBES);
+        if (trains_uo_map.find(trainid) != trains_uo_map.end())
+            continue;
+        bool stations_exist = std::all_of(stationtimes.begin(), stationtimes.end(),
+                                          [this](std::pair<StationID, Time> const& stop) {
+            count(HASH_PROBES);
+            return stations_map.find(stop.first) != stations_map.end();
+        });
+        if (!stations_exist)
+            continue;
+
+        // Like add_train, a repeated departure stops the train half-way
+        bool complete = true;
+        for (auto it = stationtimes.begin(); it != stationtimes.end(); ++it) {
+            if (!insert_departure(it->first, trainid, it->second)) {
+                complete = false;
+                break;
+            }
+        }
+        if (!complete)
+            continue;
+
+        Train t;
+        t.id = trainid;
+        t.station_times = stationtimes;
+        trains_uo_map.insert(std::make_pair(trainid, t));
+        trains_vector.push_back(t);
+        ++added;
+    }
+
+    publish_departures();
+    if (added > 0)
+        changed(NETWORK);
+    return added;
+}
+
+/**
+ * @brief Datastructures::add_departures
+ * adds the departures in order like add_departure, checking for repeats in
+ * the departure index instead of a scan per departure. The whole batch is
+ * published to station_departures_after at once
+ * @param departures station, train and time of each departure
+ * @return the number of departures added
+ */
+unsigned int Datastructures::add_departures(const std::vector<std::tuple<StationID, TrainID, Time>> &departures)
+{
+    if (image_open)
+        throw NotAvailable("add_departures()");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    unsigned int added = 0;
+
+    departure_index.reserve(departure_index.size() + departures.size());
+    for (auto const& [stationid, trainid, time] : departures) {
+        count(HASH_PROBES);
+        if (stations_map.find(stationid) == stations_map.end())
+            continue;
+        if (insert_departure(stationid, trainid, time))
+            ++added;
+    }
+
+    publish_departures();
+    return added;
+}
+
+/**
+ * @brief Datastructures::save_snapshot
+ * writes the stations, regions with their polygons, stations and hierarchy, trains
+ * and departures into a versioned and checksummed binary file
+ * @param filename the file to write
+ * @return true if the file was written, false if not
+ */
+bool Datastructures::save_snapshot(const std::string &filename) const
+{
+    if (image_open)
+        throw NotAvailable("save_snapshot()");
+    Trace::Span span("save_snapshot", "file");
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    BinaryWriter out;
+
+    out.u32(stations_vector.size());
+    for (auto const& vector_station : stations_vector) {
+        auto const& station = stations_map.at(vector_station.station_id);
+        out.str(station.station_id);
+        out.str(station.station_name);
+        out.i32(station.station_coord.x);
+        out.i32(station.station_coord.y);
+    }
+
+    out.u32(regions.size());
+    for (auto const& [id, region] : regions) {
+        out.u64(id);
+        out.str(region.region_name);
+        out.u32(region.region_coords.size());
+        for (auto const& xy : region.region_coords) {
+            out.i32(xy.x);
+            out.i32(xy.y);
+        }
+        out.u64(region.parent ? region.parent->region_id : NO_REGION);
+        out.u32(region.children.size());
+        for (auto const* child : region.children)
+            out.u64(child->region_id);
+        out.u32(region.stations.size());
+        for (auto const& [stationid, station] : region.stations) {
+            out.str(stationid);
+            out.str(station.station_name);
+            out.i32(station.station_coord.x);
+            out.i32(station.station_coord.y);
+        }
+    }
+
+    out.u32(trains_vector.size());
+    for (auto const& train : trains_vector) {
+        out.str(train.id);
+        out.u32(train.station_times.size());
+        for (auto const& [stationid, time] : train.station_times) {
+            out.str(stationid);
+            out.u16(time);
+        }
+    }
+
+    out.u32(live_departures);
+    for (auto const& [stationid, station] : station_departures) {
+        if (!station->list)
+            continue;
+        auto const& list = *station->list;
+        for (std::size_t i = 0; i < list.size; ++i) {
+            if (list.entries[i].removed != 0)
+                continue;
+            out.str(stationid);
+            out.str(list.entries[i].train);
+            out.u16(list.entries[i].time);
+        }
+    }
+
+    BinaryWriter header;
+    header.buffer.append(SNAPSHOT_MAGIC);
+    header.u32(SNAPSHOT_VERSION);
+    header.u32(0);
+    header.u64(out.buffer.size());
+    header.u64(fnv1a(out.buffer));
+
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    file.write(header.buffer.data(), header.buffer.size());
+    file.write(out.buffer.data(), out.buffer.size());
+    return static_cast<bool>(file);
+}
+
+/**
+ * @brief Datastructures::load_snapshot
+ * replaces all stations, regions, trains and departures with the ones in a file
+ * written by save_snapshot. The file is memory-mapped and the values read in place.
+ * Nothing is changed unless the whole file is valid
+ * @param filename the file to read
+ * @return true if the file was loaded, false if it couldn't be read, is of another
+ * version or is damaged
+ */
+bool Datastructures::load_snapshot(const std::string &filename)
+{
+    Trace::Span span("load_snapshot", "file");
+    MappedFile file(filename);
+    if (!file.is_open())
+        return false;
+    auto bytes = file.contents();
+    if (bytes.size() < SNAPSHOT_HEADER_SIZE || bytes.substr(0, SNAPSHOT_MAGIC.size()) != SNAPSHOT_MAGIC)
+        return false;
+
+    BinaryReader header(bytes.substr(SNAPSHOT_MAGIC.size(), SNAPSHOT_HEADER_SIZE - SNAPSHOT_MAGIC.size()));
+    auto version = header.u32();
+    header.u32();
+    auto size = header.u64();
+    auto checksum = header.u64();
+    auto payload = bytes.substr(SNAPSHOT_HEADER_SIZE);
+    if (version != SNAPSHOT_VERSION || size != payload.size() || checksum != fnv1a(payload))
+        return false;
+
+    BinaryReader in(payload);
+    std::vector<Station> new_stations_vector;
+    std::unordered_map<StationID, Station> new_stations_map;
+    std::map<Coord, Station> new_stations_map_coord;
+    std::unordered_map<RegionID, Region> new_regions;
+    std::vector<Train> new_trains_vector;
+    std::unordered_map<TrainID, Train> new_trains_uo_map;
+    std::vector<std::tuple<StationID, TrainID, Time>> new_departures;
+
+    auto station_count = in.count(16);
+    new_stations_vector.reserve(station_count);
+    new_stations_map.reserve(station_count);
+    for (unsigned int i = 0; i < station_count && in.ok; ++i) {
+        Station s;
+        s.station_id = in.str();
+        s.station_name = in.str();
+        s.station_coord.x = in.i32();
+        s.station_coord.y = in.i32();
+        new_stations_map.insert({s.station_id, s});
+        new_stations_map_coord.insert({s.station_coord, s});
+        new_stations_vector.push_back(s);
+    }
+
+    // Parents and children are linked once every region exists
+    std::vector<std::tuple<RegionID, RegionID, std::vector<RegionID>>> hierarchy;
+    auto region_count = in.count(32);
+    new_regions.reserve(region_count);
+    for (unsigned int i = 0; i < region_count && in.ok; ++i) {
+        Region r;
+        r.region_id = in.u64();
+        r.region_name = in.str();
+        r.region_coords.resize(in.count(8));
+        for (auto& xy : r.region_coords) {
+            xy.x = in.i32();
+            xy.y = in.i32();
+        }
+        r.parent = nullptr;
+        auto parentid = in.u64();
+        std::vector<RegionID> children(in.count(8));
+        for (auto& child : children)
+            child = in.u64();
+        auto region_station_count = in.count(16);
+        for (unsigned int j = 0; j < region_station_count && in.ok; ++j) {
+            Station s;
+            s.station_id = in.str();
+            s.station_name = in.str();
+            s.station_coord.x = in.i32();
+            s.station_coord.y = in.i32();
+            r.stations.insert({s.station_id, s});
+        }
+        hierarchy.push_back({r.region_id, parentid, std::move(children)});
+        new_regions.insert({r.region_id, std::move(r)});
+    }
+    for (auto const& [id, parentid, children] : hierarchy) {
+        if (!in.ok)
+            break;
+        auto& region = new_regions.at(id);
+        for (auto childid : children) {
+            auto child = new_regions.find(childid);
+            if (child == new_regions.end() || child->second.parent) {
+                in.ok = false;
+                break;
+            }
+            region.children.push_back(&child->second);
+            child->second.parent = &region;
+        }
+        if (parentid != NO_REGION && new_regions.find(parentid) == new_regions.end())
+            in.ok = false;
+    }
+
+    auto train_count = in.count(8);
+    new_trains_vector.reserve(train_count);
+    new_trains_uo_map.reserve(train_count);
+    for (unsigned int i = 0; i < train_count && in.ok; ++i) {
+        Train t;
+        t.id = in.str();
+        t.station_times.resize(in.count(6));
+        for (auto& [stationid, time] : t.station_times) {
+            stationid = in.str();
+            time = in.u16();
+        }
+        new_trains_uo_map.insert({t.id, t});
+        new_trains_vector.push_back(std::move(t));
+    }
+
+    auto departure_count = in.count(10);
+    new_departures.reserve(departure_count);
+    for (unsigned int i = 0; i < departure_count && in.ok; ++i) {
+        auto stationid = in.str();
+        auto trainid = in.str();
+        auto time = in.u16();
+        new_departures.emplace_back(std::move(stationid), std::move(trainid), time);
+    }
+
+    if (!in.ok || !in.at_end())
+        return false;
+
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    stations_vector.swap(new_stations_vector);
+    stations_map.swap(new_stations_map);
+    stations_map_coord.swap(new_stations_map_coord);
+    regions.swap(new_regions);
+    trains_vector.swap(new_trains_vector);
+    trains_uo_map.swap(new_trains_uo_map);
+
+    // New lists, which the queries see with the snapshot that has the new stations
+    station_departures.clear();
+    departure_index.clear();
+    departure_index.reserve(departure_count);
+    live_departures = 0;
+    for (auto const& station : stations_vector)
+        mark_station(station.station_id, true);
+    for (auto const& [stationid, trainid, time] : new_departures)
+        insert_departure(stationid, trainid, time);
+    publish_departures();
+    image_network = nullptr;
+    image_open = false;
+    changed(NETWORK | REGIONS);
+    return true;
+}
+
+/**
+ * @brief Datastructures::save_image
+ * writes the network the queries use, with the station names and regions, into
+ * a file which open_image can map and query without reading it in
+ * @param filename the file to write
+ * @return true if the file was written, false if not
+ */
+bool Datastructures::save_image(const std::string &filename) const
+{
+    Trace::Span span("save_image", "file");
+    std::string image;
+    {
+        std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+        image = image_network ? std::string(image_network->image) : build_network_image(true);
+    }
+
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    file.write(image.data(), image.size());
+    return static_cast<bool>(file);
+}
+
+/**
+ * @brief Datastructures::open_image
+ * clears all data and maps a network image written by save_image. Until clear_all
+ * or load_snapshot, station_count, get_station_name, get_station_coordinates,
+ * station_departures_after, station_in_regions, get_region_name, next_stations_from
+ * and the route queries are answered from the image in place, and the other operations throw
+ * NotAvailable. The image is trusted beyond its header and array lengths
+ * @param filename the file to map
+ * @return true if the image was opened, false if it couldn't be read or is of
+ * another version or machine
+ */
+bool Datastructures::open_image(const std::string &filename)
+{
+    Trace::Span span("open_image", "file");
+    auto file = std::make_shared<MappedFile>(filename);
+    if (!file->is_open())
+        return false;
+    auto network = std::make_shared<Network>();
+    if (!map_network_image(file->contents(), *network))
+        return false;
+    network->storage = file;
+
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    clear_all();
+    clear_trains();
+    image_network = network;
+    image_open = true;
+    changed(NETWORK);
+    return true;
+}
+
+/**
+ * @brief Datastructures::operation_counters
+ * @return the counts of work done since this instance's last reset, over all threads.
+ * The counts are process-wide, so they include the work of other instances too
+ */
+Datastructures::OperationCounters Datastructures::operation_counters() const
+{
+    std::lock_guard<std::mutex> lock(process_counters_mutex);
+    auto result = total_counts();
+    result.hash_probes -= counters_reset.hash_probes;
+    result.searches -= counters_reset.searches;
+    result.nodes_visited -= counters_reset.nodes_visited;
+    result.heap_pushes -= counters_reset.heap_pushes;
+    result.heap_pops -= counters_reset.heap_pops;
+    result.index_rebuilds -= counters_reset.index_rebuilds;
+    result.departures_scanned -= counters_reset.departures_scanned;
+    return result;
+}
+
+/**
+ * @brief Datastructures::reset_operation_counters
+ * starts this instance's counters over from zero. The threads' own counts are left
+ * as they are, as only the owning thread writes them
+ */
+void Datastructures::reset_operation_counters()
+{
+    std::lock_guard<std::mutex> lock(process_counters_mutex);
+    counters_reset = total_counts();
+}
+
+/**
+ * @brief Datastructures::use_landmarks
+ * selects how many landmarks route_shortest_distance uses for its A* bounds
+ * @param count the number of landmarks, 0 for plain Dijkstra
+ */
+void Datastructures::use_landmarks(unsigned int count)
+{
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    if (count != alt_count) {
+        alt_count = count;
+        changed(SEARCH_SETTINGS);
+    }
+}
+
+/**
+ * @brief Datastructures::landmark_table_bytes
+ * builds the landmark tables if the network has changed since they were last built
+ * @return the memory taken by the landmark distance tables of the current snapshot
+ */
+std::size_t Datastructures::landmark_table_bytes() const
+{
+    auto snap = current_snapshot();
+    if (!snap->landmarks)
+        return 0;
+    auto const& landmarks = *snap->landmarks;
+    return (landmarks.from.capacity() + landmarks.to.capacity()) * sizeof(std::uint32_t) +
+            landmarks.stations.capacity() * sizeof(unsigned int);
+}
+
+/**
+ * @brief Datastructures::build_landmarks
+ * chooses the landmarks by farthest-point selection: each new landmark is the
+ * station farthest from its closest landmark chosen so far, stations no landmark
+ * reaches first. Stores the distances from and to every landmark
+ * @param network the network of the snapshot being built
+ * @param landmarks the tables to fill
+ */
+void Datastructures::build_landmarks(const Network &network, Landmarks &landmarks) const
+{
+    Trace::Span span("build_landmarks", "index");
+    count(INDEX_REBUILDS);
+    auto& alt_landmarks = landmarks.stations;
+    auto& alt_from = landmarks.from;
+    auto& alt_to = landmarks.to;
+    auto n = network.ids.size();
+    auto k = std::min<std::size_t>(alt_count, n);
+    landmarks.count = alt_count;
+
+    alt_landmarks.clear();
+    alt_from.assign(k * n, ALT_UNREACHABLE);
+    alt_to.assign(k * n, ALT_UNREACHABLE);
+    alt_from.shrink_to_fit();
+    alt_to.shrink_to_fit();
+
+    // Reversed connections for the distances to a landmark
+    std::vector<unsigned int> reverse_begin(n + 1, 0);
+    std::vector<unsigned int> reverse_to(network.edge_to.size());
+    std::vector<Distance> reverse_dist(network.edge_to.size());
+    for (auto station : network.edge_to)
+        ++reverse_begin[station + 1];
+    for (unsigned int i = 0; i < n; ++i)
+        reverse_begin[i + 1] += reverse_begin[i];
+    auto fill = reverse_begin;
+    for (unsigned int i = 0; i < n; ++i) {
+        for (auto e = network.edge_begin[i]; e < network.edge_begin[i + 1]; ++e) {
+            reverse_to[fill[network.edge_to[e]]] = i;
+            reverse_dist[fill[network.edge_to[e]]++] = network.edge_dist[e];
+        }
+    }
+
+    std::vector<Distance> result;
+    std::vector<Distance> closest(n, INFINITE_DISTANCE);
+    unsigned int candidate = 0;
+    if (k > 0) {
+        // Start from the station farthest from an arbitrary one
+        one_to_all(network.edge_begin, network.edge_to, network.edge_dist, 0, result);
+        for (unsigned int i = 0; i < n; ++i) {
+            if (result[i] != INFINITE_DISTANCE && result[i] > result[candidate])
+                candidate = i;
+        }
+    }
+
+    for (unsigned int l = 0; l < k; ++l) {
+        alt_landmarks.push_back(candidate);
+
+        one_to_all(network.edge_begin, network.edge_to, network.edge_dist, candidate, result);
+        for (unsigned int i = 0; i < n; ++i) {
+            if (result[i] != INFINITE_DISTANCE)
+                alt_from[i * k + l] = result[i];
+            closest[i] = std::min(closest[i], result[i]);
+        }
+        one_to_all(reverse_begin, reverse_to, reverse_dist, candidate, result);
+        for (unsigned int i = 0; i < n; ++i) {
+            if (result[i] != INFINITE_DISTANCE)
+                alt_to[i * k + l] = result[i];
+        }
+
+        // Stations without connections would make useless landmarks
+        for (unsigned int i = 0; i < n; ++i) {
+            if (closest[i] > closest[candidate] && network.edge_begin[i + 1] > network.edge_begin[i])
+                candidate = i;
+        }
+    }
+}
+
+/**
+ * @brief Datastructures::alt_bound
+ * lower bound for the distance between two stations from the triangle inequality
+ * d(L,v) + d(v,t) >= d(L,t) and d(v,t) + d(t,L) >= d(v,L) over the landmarks L
+ * @param snap the snapshot holding the landmark tables
+ * @param station index of the station
+ * @param to index of the destination
+ * @return the largest bound, INFINITE_DISTANCE if the destination is known
+ * to be unreachable from the station
+ */
+Distance Datastructures::alt_bound(const Snapshot &snap, unsigned int station, unsigned int to) const
+{
+    auto const& landmarks = *snap.landmarks;
+    auto k = landmarks.stations.size();
+    auto const* from_v = &landmarks.from[station * k];
+    auto const* from_t = &landmarks.from[to * k];
+    auto const* to_v = &landmarks.to[station * k];
+    auto const* to_t = &landmarks.to[to * k];
+
+    std::int64_t bound = 0;
+    for (unsigned int l = 0; l < k; ++l) {
+        if (from_v[l] != ALT_UNREACHABLE) {
+            if (from_t[l] == ALT_UNREACHABLE)
+                return INFINITE_DISTANCE;
+            bound = std::max<std::int64_t>(bound, std::int64_t(from_t[l]) - from_v[l]);
+        }
+        if (to_t[l] != ALT_UNREACHABLE) {
+            if (to_v[l] == ALT_UNREACHABLE)
+                return INFINITE_DISTANCE;
+            bound = std::max<std::int64_t>(bound, std::int64_t(to_v[l]) - to_t[l]);
+        }
+    }
+    return bound;
+}
+
+/**
+ * @brief Datastructures::alt_search
+ * A* search guided by the landmark bounds. Leaves the result in search_dist and
+ * search_parent like dijkstra, the caller resets the touched stations
+ * @param from index of the station of departure
+ * @param to index of the station of arrival
+ */
+void Datastructures::alt_search(QueryContext& ctx, const Snapshot &snap, unsigned int from, unsigned int to) const
+{
+    auto const& network = *snap.network;
+    prepare_search(ctx, network);
+
+    // Entries are (distance + bound, distance, station)
+    using Entry = std::tuple<Distance, Distance, unsigned int>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+
+    ctx.search_dist[from] = 0;
+    ctx.search_touched.push_back(from);
+    auto bound = alt_bound(snap, from, to);
+    if (bound == INFINITE_DISTANCE)
+        return;
+    queue.push({bound, 0, from});
+    unsigned long long pushes = 1;
+    unsigned long long pops = 0;
+    unsigned long long visited = 0;
+
+    while (!queue.empty()) {
+        auto [estimate, dist, station] = queue.top();
+        queue.pop();
+        ++pops;
+        if (dist > ctx.search_dist[station])
+            continue;
+        ++visited;
+        if (station == to)
+            break;
+
+        for (auto e = network.edge_begin[station]; e < network.edge_begin[station + 1]; ++e) {
+            auto next = network.edge_to[e];
+            auto next_dist = dist + network.edge_dist[e];
+            if (next_dist < ctx.search_dist[next]) {
+                auto next_bound = alt_bound(snap, next, to);
+                if (next_bound == INFINITE_DISTANCE)
+                    continue;
+                if (ctx.search_dist[next] == INFINITE_DISTANCE)
+                    ctx.search_touched.push_back(next);
+                ctx.search_dist[next] = next_dist;
+                ctx.search_parent[next] = station;
+                queue.push({next_dist + next_bound, next_dist, next});
+                ++pushes;
+            }
+        }
+    }
+
+    count(SEARCHES);
+    count(NODES_VISITED, visited);
+    count(HEAP_PUSHES, pushes);
+    count(HEAP_POPS, pops);
+}
+
+/**
+ * @brief Datastructures::use_contraction_hierarchy
+ * selects whether route_shortest_distance uses the contraction hierarchy
+ * @param enabled true to use the hierarchy, false for plain Dijkstra
+ */
+void Datastructures::use_contraction_hierarchy(bool enabled)
+{
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    if (enabled != ch_enabled) {
+        ch_enabled = enabled;
+        changed(SEARCH_SETTINGS);
+    }
+}
+
+/**
+ * @brief Datastructures::contraction_hierarchy_enabled
+ * @return true if route_shortest_distance uses the contraction hierarchy
+ */
+bool Datastructures::contraction_hierarchy_enabled() const
+{
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex);
+    return ch_enabled;
+}
+
+/**
+ * @brief Datastructures::contraction_hierarchy_shortcuts
+ * builds the contraction hierarchy if the network has changed since it was last built
+ * @return the number of shortcut edges in the hierarchy, 0 if it isn't in use
+ */
+unsigned int Datastructures::contraction_hierarchy_shortcuts() const
+{
+    auto snap = current_snapshot();
+    return snap->ch ? snap->ch->shortcuts : 0;
+}
+
+/**
+ * @brief Datastructures::build_contraction_hierarchy
+ * contracts the stations one by one, least important first, adding a shortcut
+ * between two neighbours of a contracted station whenever no other route of at
+ * most the same length between them is found by a bounded witness search.
+ * Stations never contracted share the top rank n
+ * @param network the network of the snapshot being built
+ * @param ch the hierarchy to fill
+ */
+void Datastructures::build_contraction_hierarchy(const Network &network, ContractionHierarchy &ch) const
+{
+    Trace::Span span("build_contraction_hierarchy", "index");
+    count(INDEX_REBUILDS);
+    auto n = network.ids.size();
+    ch.rank.assign(n, NO_INDEX);
+
+    // Edges between any stations, kept in both directions while contracting
+    std::vector<std::vector<ChEdge>> out(n);
+    std::vector<std::vector<ChEdge>> in(n);
+    for (unsigned int i = 0; i < n; ++i) {
+        for (auto e = network.edge_begin[i]; e < network.edge_begin[i + 1]; ++e) {
+            out[i].push_back({network.edge_to[e], network.edge_dist[e], NO_INDEX});
+            in[network.edge_to[e]].push_back({i, network.edge_dist[e], NO_INDEX});
+        }
+    }
+
+    auto add_edge = [&out, &in, &ch](unsigned int from, unsigned int to, Distance dist, unsigned int via) {
+        for (auto& edge : out[from]) {
+            if (edge.to == to) {
+                if (dist < edge.dist) {
+                    edge = {to, dist, via};
+                    for (auto& back : in[to]) {
+                        if (back.to == from)
+                            back = {from, dist, via};
+                    }
+                }
+                return;
+            }
+        }
+        out[from].push_back({to, dist, via});
+        in[to].push_back({from, dist, via});
+        ++ch.shortcuts;
+    };
+
+    // Witness search from 'source' among the stations not yet contracted, skipping 'skip'
+    std::vector<Distance> witness(n, INFINITE_DISTANCE);
+    std::vector<unsigned int> touched;
+    auto witness_search = [&](unsigned int source, unsigned int skip, Distance limit) {
+        using Entry = std::pair<Distance, unsigned int>;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+        witness[source] = 0;
+        touched.push_back(source);
+        queue.push({0, source});
+        unsigned int settled = 0;
+        while (!queue.empty() && settled < WITNESS_SETTLE_LIMIT) {
+            auto [dist, station] = queue.top();
+            queue.pop();
+            if (dist > witness[station])
+                continue;
+            if (dist > limit)
+                break;
+            ++settled;
+            for (auto const& edge : out[station]) {
+                if (edge.to == skip || ch.rank[edge.to] != NO_INDEX)
+                    continue;
+                auto next_dist = dist + edge.dist;
+                if (next_dist < witness[edge.to]) {
+                    if (witness[edge.to] == INFINITE_DISTANCE)
+                        touched.push_back(edge.to);
+                    witness[edge.to] = next_dist;
+                    queue.push({next_dist, edge.to});
+                }
+            }
+        }
+    };
+    auto reset_witness = [&]() {
+        for (auto station : touched)
+            witness[station] = INFINITE_DISTANCE;
+        touched.clear();
+    };
+
+    // Contracts the station, or only counts the shortcuts needed if 'simulate' is set
+    auto contract = [&](unsigned int station, bool simulate) {
+        int needed = 0;
+        Distance max_out = 0;
+        for (auto const& edge : out[station]) {
+            if (ch.rank[edge.to] == NO_INDEX)
+                max_out = std::max(max_out, edge.dist);
+        }
+        for (auto const& from : in[station]) {
+            if (ch.rank[from.to] != NO_INDEX)
+                continue;
+            witness_search(from.to, station, from.dist + max_out);
+            for (auto const& to : out[station]) {
+                if (ch.rank[to.to] != NO_INDEX || to.to == from.to)
+                    continue;
+                if (witness[to.to] > from.dist + to.dist) {
+                    ++needed;
+                    if (!simulate)
+                        add_edge(from.to, to.to, from.dist + to.dist, station);
+                }
+            }
+            reset_witness();
+        }
+        return needed;
+    };
+
+    std::vector<int> contracted_neighbours(n, 0);
+    auto priority = [&](unsigned int station) {
+        int removed = 0;
+        for (auto const& edge : out[station])
+            removed += ch.rank[edge.to] == NO_INDEX;
+        for (auto const& edge : in[station])
+            removed += ch.rank[edge.to] == NO_INDEX;
+        return contract(station, true) - removed + contracted_neighbours[station];
+    };
+
+    using Entry = std::pair<int, unsigned int>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+    for (unsigned int i = 0; i < n; ++i)
+        queue.push({priority(i), i});
+
+    // Lazy updates: a station is contracted only if its priority is still the smallest.
+    // Contracting stops once the cheapest station left is too densely connected, and
+    // the stations left over form a core which is searched with bidirectional Dijkstra.
+    // Contracting such stations would mostly add shortcuts between other dense stations
+    unsigned int order = 0;
+    while (!queue.empty()) {
+        auto station = queue.top().second;
+        queue.pop();
+        auto current = priority(station);
+        if (!queue.empty() && current > queue.top().first) {
+            queue.push({current, station});
+            continue;
+        }
+        unsigned int degree = 0;
+        for (auto const& edge : out[station])
+            degree += ch.rank[edge.to] == NO_INDEX;
+        for (auto const& edge : in[station])
+            degree += ch.rank[edge.to] == NO_INDEX;
+        if (degree > CH_CORE_DEGREE)
+            break;
+
+        contract(station, false);
+        ch.rank[station] = order++;
+        for (auto const& edge : out[station])
+            ++contracted_neighbours[edge.to];
+        for (auto const& edge : in[station])
+            ++contracted_neighbours[edge.to];
+    }
+
+    for (auto& rank : ch.rank) {
+        if (rank == NO_INDEX)
+            rank = n;
+    }
+
+    // Edges inside the core go both ways, so that the searches can move freely in it
+    ch.up_begin.push_back(0);
+    ch.down_begin.push_back(0);
+    for (unsigned int i = 0; i < n; ++i) {
+        for (auto const& edge : out[i]) {
+            if (ch.rank[edge.to] > ch.rank[i] || (ch.rank[i] == n && ch.rank[edge.to] == n))
+                ch.up.push_back(edge);
+        }
+        for (auto const& edge : in[i]) {
+            if (ch.rank[edge.to] > ch.rank[i] || (ch.rank[i] == n && ch.rank[edge.to] == n))
+                ch.down.push_back(edge);
+        }
+        ch.up_begin.push_back(ch.up.size());
+        ch.down_begin.push_back(ch.down.size());
+    }
+}
+
+/**
+ * @brief Datastructures::ch_path
+ * bidirectional search in the contraction hierarchy, forward along edges to higher
+ * ranked stations from the departure and backward likewise from the arrival, then
+ * bidirectional Dijkstra in the uncontracted core between the core stations they
+ * reached. The shortcuts on the route found are then unpacked into the original connections
+ * @param from index of the station of departure
+ * @param to index of the station of arrival
+ * @return station indices of the shortest route, empty if none exists
+ */
+std::vector<unsigned int> Datastructures::ch_path(QueryContext& ctx, const Snapshot &snap, unsigned int from, unsigned int to) const
+{
+    auto const& ch = *snap.ch;
+    prepare_search(ctx, *snap.network);
+
+    auto n = snap.network->ids.size();
+    using Entry = std::pair<Distance, unsigned int>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> forward;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> backward;
+    unsigned long long pushes = 0;
+    unsigned long long pops = 0;
+    unsigned long long visited = 0;
+
+    Distance best = INFINITE_DISTANCE;
+    unsigned int meeting = NO_INDEX;
+
+    auto label = [&](bool is_forward, unsigned int station, Distance d, unsigned int from_station) {
+        auto& dist = is_forward ? ctx.search_dist : ctx.ch_backward_dist;
+        if (ctx.search_dist[station] == INFINITE_DISTANCE && ctx.ch_backward_dist[station] == INFINITE_DISTANCE)
+            ctx.search_touched.push_back(station);
+        dist[station] = d;
+        (is_forward ? ctx.search_parent : ctx.ch_backward_parent)[station] = from_station;
+        (is_forward ? forward : backward).push({d, station});
+        ++pushes;
+    };
+
+    // Settles the top station of one direction, relaxing its edges unless it is in the
+    // core and 'expand_core' isn't set. A station whose label the other direction has
+    // already set may be where the two routes meet
+    auto settle = [&](bool is_forward, bool expand_core) {
+        auto& queue = is_forward ? forward : backward;
+        auto [d, station] = queue.top();
+        queue.pop();
+        ++pops;
+        if (d > (is_forward ? ctx.search_dist : ctx.ch_backward_dist)[station])
+            return NO_INDEX;
+        ++visited;
+        auto other = (is_forward ? ctx.ch_backward_dist : ctx.search_dist)[station];
+        if (other != INFINITE_DISTANCE && d + other < best) {
+            best = d + other;
+            meeting = station;
+        }
+        if (ch.rank[station] == n && !expand_core)
+            return station;
+
+        auto& dist = is_forward ? ctx.search_dist : ctx.ch_backward_dist;
+        auto& begin = is_forward ? ch.up_begin : ch.down_begin;
+        auto& edges = is_forward ? ch.up : ch.down;
+        for (auto e = begin[station]; e < begin[station + 1]; ++e) {
+            if (d + edges[e].dist < dist[edges[e].to])
+                label(is_forward, edges[e].to, d + edges[e].dist, station);
+        }
+        return NO_INDEX;
+    };
+
+    // Upward searches through the contracted stations, first from the departure and then
+    // from the arrival. They stop at the core, only labelling the core stations they reach
+    ctx.ch_core_reached.clear();
+    label(true, from, 0, NO_INDEX);
+    while (!forward.empty()) {
+        auto core = settle(true, false);
+        if (core != NO_INDEX)
+            ctx.ch_core_reached.push_back(core);
+    }
+    auto forward_reached = ctx.ch_core_reached.size();
+    label(false, to, 0, NO_INDEX);
+    while (!backward.empty() && backward.top().first < best) {
+        auto core = settle(false, false);
+        if (core != NO_INDEX)
+            ctx.ch_core_reached.push_back(core);
+    }
+    backward = {};
+
+    // Bidirectional Dijkstra in the core from the labels of the upward searches. The
+    // core edges go both ways, so both directions see the whole core part of a route
+    // and the search can stop once the two smallest labels add up to the best route
+    for (std::size_t i = 0; i < ctx.ch_core_reached.size(); ++i) {
+        auto station = ctx.ch_core_reached[i];
+        if (i < forward_reached)
+            forward.push({ctx.search_dist[station], station});
+        else
+            backward.push({ctx.ch_backward_dist[station], station});
+    }
+    while (!forward.empty() && !backward.empty() && forward.top().first + backward.top().first < best) {
+        settle(forward.top().first <= backward.top().first, true);
+    }
+    count(SEARCHES);
+    count(NODES_VISITED, visited);
+    count(HEAP_PUSHES, pushes);
+    count(HEAP_POPS, pops);
+
+    // Route in the hierarchy: departure -> meeting station -> arrival
+    std::vector<unsigned int> hierarchy_path;
+    if (meeting != NO_INDEX) {
+        for (auto station = meeting; station != NO_INDEX; station = ctx.search_parent[station])
+            hierarchy_path.push_back(station);
+        std::reverse(hierarchy_path.begin(), hierarchy_path.end());
+        for (auto station = ctx.ch_backward_parent[meeting]; station != NO_INDEX; station = ctx.ch_backward_parent[station])
+            hierarchy_path.push_back(station);
+    }
+
+    for (auto station : ctx.search_touched) {
+        ctx.search_dist[station] = INFINITE_DISTANCE;
+        ctx.search_parent[station] = NO_INDEX;
+        ctx.ch_backward_dist[station] = INFINITE_DISTANCE;
+        ctx.ch_backward_parent[station] = NO_INDEX;
+    }
+    ctx.search_touched.clear();
+
+    if (hierarchy_path.empty())
+        return hierarchy_path;
+
+    // The station a shortcut bypasses is ranked below both of its ends, so
+    // the two halves of the shortcut are found in its own edge lists
+    std::vector<unsigned int> path {hierarchy_path.front()};
+    std::stack<std::pair<unsigned int, unsigned int>> unpack;
+    for (auto i = hierarchy_path.size() - 1; i > 0; --i)
+        unpack.push({hierarchy_path[i - 1], hierarchy_path[i]});
+
+    while (!unpack.empty()) {
+        auto [a, b] = unpack.top();
+        unpack.pop();
+
+        unsigned int via = NO_INDEX;
+        if (ch.rank[a] < ch.rank[b]) {
+            for (auto e = ch.up_begin[a]; e < ch.up_begin[a + 1]; ++e) {
+                if (ch.up[e].to == b)
+                    via = ch.up[e].via;
+            }
+        }
+        else {
+            for (auto e = ch.down_begin[b]; e < ch.down_begin[b + 1]; ++e) {
+                if (ch.down[e].to == a)
+                    via = ch.down[e].via;
+            }
+        }
+
+        if (via == NO_INDEX) {
+            path.push_back(b);
+        }
+        else {
+            unpack.push({via, b});
+            unpack.push({a, via});
+        }
+    }
+    return path;
+}
+
+/**
+ * @brief Datastructures::route_earliest_arrival
+ * returns the route which arrives at the destination earliest when leaving
+ * the departure station at or after the given time. Each station is paired with
+ * the time the train leaves it, the last one with the arrival time
+ * @param fromid the station of departure
+ * @param toid the station of arrival
+ * @param starttime the earliest time to leave
+ * @return vector of stations and times, empty if no route exists
+ */
+std::vector<std::pair<StationID, Time>> Datastructures::route_earliest_arrival
+    (StationID fromid, StationID toid, Time starttime) const
+{
+    std::vector<std::pair<StationID, Time>> not_found {{NO_STATION, NO_TIME}};
+    std::vector<std::pair<StationID, Time>> route;
+
+    auto snap = current_snapshot();
+    auto const& network = *snap->network;
+    auto& ctx = query_context();
+    auto from = network_index(network, fromid);
+    auto to = network_index(network, toid);
+    if (from == NO_INDEX || to == NO_INDEX)
+        return not_found;
+
+    if (from == to)
+        return {{fromid, starttime}};
+
+    // Every trip boarded needs its own round, so there can't be more rounds than patterns
+    raptor(ctx, network, from, to, starttime, network.pattern_count());
+
+    auto label = ctx.raptor_last_label[to];
+    if (label == NO_INDEX)
+        return route;
+    auto arrival = ctx.raptor_labels[label].arrival;
+
+    // Walk the legs backwards from the destination, then emit them in travel order
+    std::vector<RaptorParent> legs;
+    auto station = to;
+    while (station != from) {
+        auto leg = ctx.raptor_labels[label].parent;
+        legs.push_back(leg);
+        station = network.pattern(leg.pattern).stops[leg.board];
+        label = raptor_label(ctx, station, leg.round - 1);
+    }
+
+    for (auto it = legs.rbegin(); it != legs.rend(); ++it) {
+        auto const pattern = network.pattern(it->pattern);
+        auto row = it->trip * pattern.stops.size();
+        for (auto pos = it->board; pos < it->alight; ++pos) {
+            route.push_back({StationID(network.ids[pattern.stops[pos]]), pattern.times[row + pos]});
+        }
+    }
+    route.push_back({toid, arrival});
+    return route;
+}
+
+/**
+ * @brief Datastructures::route_earliest_arrival_transfers
+ * returns the Pareto front of arrival time against the number of transfers
+ * needed, using at most the given number of transfers
+ * @param fromid the station of departure
+ * @param toid the station of arrival
+ * @param starttime the earliest time to leave
+ * @param max_transfers the largest number of changes between trains allowed
+ * @return vector of transfer counts and arrival times, each arriving earlier than
+ * the one before, empty if no route exists
+ */
+std::vector<std::pair<int, Time>> Datastructures::route_earliest_arrival_transfers
+    (StationID fromid, StationID toid, Time starttime, unsigned int max_transfers) const
+{
+    std::vector<std::pair<int, Time>> not_found {{NO_VALUE, NO_TIME}};
+    std::vector<std::pair<int, Time>> front;
+
+    auto snap = current_snapshot();
+    auto const& network = *snap->network;
+    auto& ctx = query_context();
+    auto from = network_index(network, fromid);
+    auto to = network_index(network, toid);
+    if (from == NO_INDEX || to == NO_INDEX)
+        return not_found;
+
+    if (from == to)
+        return {{0, starttime}};
+
+    // More rounds than patterns can't improve anything, and max_transfers + 1 mustn't wrap
+    auto rounds = std::min<std::size_t>(max_transfers, network.pattern_count());
+    raptor(ctx, network, from, to, starttime, static_cast<unsigned int>(rounds) + 1);
+
+    // Each label of the destination arrives earlier with more trains than the one before
+    for (auto label = ctx.raptor_last_label[to]; label != NO_INDEX; label = ctx.raptor_labels[label].previous) {
+        front.push_back({static_cast<int>(ctx.raptor_labels[label].parent.round) - 1,
+                         ctx.raptor_labels[label].arrival});
+    }
+    std::reverse(front.begin(), front.end());
+    return front;
+}
+
+/**
+ * @brief Datastructures::network_index
+ * returns the index of the station in the integer-indexed network
+ * @param network the network of a snapshot
+ * @param id the station's id
+ * @return index of the station, NO_INDEX if no such station
+ */
+unsigned int Datastructures::network_index(const Network &network, const StationID &id)
+{
+    auto found = std::lower_bound(network.id_order.begin(), network.id_order.end(), id,
+                                  [&network](unsigned int station, StationID const& key) {
+                                      return network.ids[station] < key;
+                                  });
+    if (found == network.id_order.end() || network.ids[*found] != id)
+        return NO_INDEX;
+    return *found;
+}
+
+/**
+ * @brief Datastructures::map_network_image
+ * points the arrays of a network into an image. Only the header and the lengths
+ * of the arrays are checked, so that opening an image reads hardly any of it
+ * @param image the image, aligned to 8 bytes, which must outlive the network
+ * @param network the network to set up
+ * @return true if the image is of this version and its arrays fit together
+ */
+bool Datastructures::map_network_image(std::string_view image, Network &network)
+{
+    if (image.size() < IMAGE_HEADER_SIZE || image.substr(0, IMAGE_MAGIC.size()) != IMAGE_MAGIC ||
+        reinterpret_cast<std::uintptr_t>(image.data()) % 8 != 0)
+        return false;
+    if (read_raw<std::uint32_t>(image, 8) != IMAGE_VERSION ||
+        read_raw<std::uint32_t>(image, 12) != IMAGE_BYTE_ORDER ||
+        read_raw<std::uint32_t>(image, 16) != IMAGE_SECTIONS)
+        return false;
+
+    bool ok = true;
+    auto section = [&image, &ok](ImageSection id, auto& array) {
+        using T = std::remove_const_t<std::remove_reference_t<decltype(array[0])>>;
+        auto offset = read_raw<std::uint64_t>(image, 24 + id * 16);
+        auto count = read_raw<std::uint64_t>(image, 24 + id * 16 + 8);
+        if (offset % alignof(T) != 0 || offset > image.size() || count > (image.size() - offset) / sizeof(T))
+            ok = false;
+        else
+            array = {reinterpret_cast<T const*>(image.data() + offset), count};
+    };
+    section(IDS_OFFSETS, network.ids.offsets);
+    section(IDS_CHARS, network.ids.chars);
+    section(ID_ORDER, network.id_order);
+    section(COORDS, network.coords);
+    section(EDGE_BEGIN, network.edge_begin);
+    section(EDGE_TO, network.edge_to);
+    section(EDGE_DIST, network.edge_dist);
+    section(PATTERN_STOP_BEGIN, network.pattern_stop_begin);
+    section(PATTERN_STOPS, network.pattern_stops);
+    section(PATTERN_TRIP_BEGIN, network.pattern_trip_begin);
+    section(PATTERN_TRIPS, network.pattern_trips);
+    section(PATTERN_TIME_BEGIN, network.pattern_time_begin);
+    section(PATTERN_TIMES, network.pattern_times);
+    section(TRAIN_OFFSETS, network.trains.offsets);
+    section(TRAIN_CHARS, network.trains.chars);
+    section(STOP_ROUTES_BEGIN, network.stop_routes_begin);
+    section(STOP_ROUTES, network.stop_routes);
+    section(DEPARTURE_BEGIN, network.departure_begin);
+    section(DEPARTURE_TIMES, network.departure_times);
+    section(DEPARTURE_TRAINS, network.departure_trains);
+    section(NAME_OFFSETS, network.names.offsets);
+    section(NAME_CHARS, network.names.chars);
+    section(STATION_REGIONS_BEGIN, network.station_regions_begin);
+    section(STATION_REGIONS, network.station_regions);
+    section(REGION_IDS, network.region_ids);
+    section(REGION_NAME_OFFSETS, network.region_names.offsets);
+    section(REGION_NAME_CHARS, network.region_names.chars);
+    if (!ok)
+        return false;
+
+    // Each offset array has one entry more than it has items and ends at the array it indexes
+    auto fits = [](auto const& begin, std::size_t items, std::size_t total) {
+        return begin.size() == items + 1 && begin[0] == 0 && begin[items] == total;
+    };
+    auto n = network.coords.size();
+    auto patterns = network.pattern_stop_begin.empty() ? 0 : network.pattern_stop_begin.size() - 1;
+    auto lookups = !network.names.offsets.empty();
+    if (!fits(network.ids.offsets, n, network.ids.chars.size()) ||
+        network.trains.offsets.empty() ||
+        !fits(network.trains.offsets, network.trains.offsets.size() - 1, network.trains.chars.size()) ||
+        network.id_order.size() != n ||
+        !fits(network.edge_begin, n, network.edge_to.size()) ||
+        network.edge_dist.size() != network.edge_to.size() ||
+        !fits(network.pattern_stop_begin, patterns, network.pattern_stops.size()) ||
+        !fits(network.pattern_trip_begin, patterns, network.pattern_trips.size()) ||
+        !fits(network.pattern_time_begin, patterns, network.pattern_times.size()) ||
+        !fits(network.stop_routes_begin, n, network.stop_routes.size()) ||
+        !fits(network.departure_begin, n, network.departure_times.size()) ||
+        network.departure_trains.size() != network.departure_times.size() ||
+        (lookups && !fits(network.names.offsets, n, network.names.chars.size())) ||
+        (lookups && !fits(network.station_regions_begin, n, network.station_regions.size())) ||
+        (lookups && !fits(network.region_names.offsets, network.region_ids.size(), network.region_names.chars.size())))
+        return false;
+
+    network.image = image;
+    return true;
+}
+
+/**
+ * @brief Datastructures::current_snapshot
+ * returns the latest published snapshot. Only with wait_for_updates set does it first
+ * wait for the builder thread if updates made before the call aren't in it yet, and
+ * then it must not be called with writer_mutex held. Readers never build snapshots
+ * @return the snapshot, which stays valid for as long as the caller holds it
+ */
+std::shared_ptr<Datastructures::Snapshot const> Datastructures::current_snapshot() const
+{
+    auto wanted = changes.load();
+    if (wait_updates && published < wanted) {
+        std::unique_lock<std::mutex> lock(versions_mutex);
+        ++readers_waiting;
+        build_wanted.notify_one();
+        build_done.wait(lock, [this, wanted] { return published >= wanted; });
+        --readers_waiting;
+    }
+    return std::atomic_load(&snapshot);
+}
+
+/**
+ * @brief Datastructures::wait_for_updates
+ * sets whether the queries wait for the updates made before them. A program making
+ * updates and queries one after another in one thread wants this, while queries
+ * running alongside the updates in other threads shouldn't wait for them
+ * @param enabled true to wait, false to read the latest published snapshot
+ */
+void Datastructures::wait_for_updates(bool enabled)
+{
+    wait_updates = enabled;
+}
+
+/**
+ * @brief Datastructures::changed
+ * counts a new version of what the snapshots hold and wakes the builder thread.
+ * Called with writer_mutex held
+ * @param parts NETWORK if stations or trains changed, REGIONS if regions did, or
+ * SEARCH_SETTINGS if only the search settings did
+ */
+void Datastructures::changed(unsigned int parts)
+{
+    if (parts & NETWORK)
+        network_changed = true;
+    if (parts & REGIONS)
+        regions_changed = true;
+    std::lock_guard<std::mutex> lock(versions_mutex);
+    last_change = std::chrono::steady_clock::now();
+    if (changes++ == published) {
+        first_change = last_change;
+        build_wanted.notify_one();
+    }
+}
+
+/**
+ * @brief Datastructures::build_snapshots
+ * the builder thread. Publishes a snapshot with the updates not in the latest one
+ * once no update has been made or started for BUILD_DELAY, so that a burst of updates
+ * is built only once, but at the latest BUILD_LIMIT after the first of them, and right
+ * away if a reader is waiting for them. Holds writer_mutex while building so that no
+ * update is half-way through. Runs until the destructor stops it
+ */
+void Datastructures::build_snapshots()
+{
+    std::unique_lock<std::mutex> lock(versions_mutex);
+    while (true) {
+        build_wanted.wait(lock, [this] { return stopping || published != changes; });
+        if (stopping)
+            return;
+
+        std::unique_lock<std::recursive_mutex> writer(writer_mutex, std::defer_lock);
+        if (readers_waiting == 0) {
+            if (build_wanted.wait_for(lock, BUILD_DELAY, [this] { return stopping || readers_waiting > 0; }))
+                continue;
+            auto now = std::chrono::steady_clock::now();
+            if ((now - last_change < BUILD_DELAY && now - first_change < BUILD_LIMIT) || !writer.try_lock())
+                continue;
+        }
+        lock.unlock();
+
+        if (!writer.owns_lock())
+            writer.lock();
+        unsigned long long version = changes;
+        publish_snapshot();
+        writer.unlock();
+
+        lock.lock();
+        published = version;
+        build_done.notify_all();
+    }
+}
+
+/**
+ * @brief Datastructures::publish_snapshot
+ * builds a snapshot of the current stations, regions, trains and search settings and
+ * makes it the one new queries see. The network and the departure lists of its stations
+ * are rebuilt only if stations or trains have changed, the region index only if regions
+ * have, and the hierarchy and landmark tables only if they are in use and the network
+ * or their settings have changed. Called with writer_mutex held
+ */
+void Datastructures::publish_snapshot() const
+{
+    Trace::Span span("publish_snapshot", "index");
+    auto previous = std::atomic_load(&snapshot);
+    auto next = std::make_shared<Snapshot>();
+
+    if (previous && !network_changed) {
+        next->network = previous->network;
+        next->departures = previous->departures;
+        next->ch = previous->ch;
+        next->landmarks = previous->landmarks;
+    }
+    else if (image_network) {
+        next->network = image_network;
+        network_changed = false;
+    }
+    else {
+        auto network = std::make_shared<Network>();
+        auto image = std::make_shared<std::string const>(build_network_image(false));
+        map_network_image(*image, *network);
+        network->storage = image;
+        next->network = network;
+
+        auto departures = std::make_shared<DepartureSlots>();
+        departures->reserve(network->ids.size());
+        for (std::size_t i = 0; i < network->ids.size(); ++i)
+            departures->push_back(station_departures.at(StationID(network->ids[i])));
+        next->departures = departures;
+        network_changed = false;
+    }
+
+    if (image_network)
+        next->regions = nullptr;
+    else if (previous && previous->regions && !regions_changed)
+        next->regions = previous->regions;
+    else {
+        auto index = std::make_shared<RegionIndex>();
+        build_region_index(*index);
+        next->regions = index;
+    }
+    regions_changed = false;
+
+    next->ch_enabled = ch_enabled;
+    if (ch_enabled && !next->ch) {
+        auto ch = std::make_shared<ContractionHierarchy>();
+        build_contraction_hierarchy(*next->network, *ch);
+        next->ch = ch;
+    }
+
+    if (alt_count == 0)
+        next->landmarks = nullptr;
+    else if (!next->landmarks || next->landmarks->count != alt_count) {
+        auto landmarks = std::make_shared<Landmarks>();
+        build_landmarks(*next->network, *landmarks);
+        next->landmarks = landmarks;
+    }
+
+    std::atomic_store(&snapshot, std::shared_ptr<Snapshot const>(next));
+}
+
+/**
+ * @brief Datastructures::build_region_index
+ * lists the parent of every region and the regions of every station. A station's
+ * regions are listed in the order station_in_regions returns them: each region it
+ * was added to, followed by the regions containing that one not listed yet.
+ * Called with writer_mutex held
+ * @param index the index to fill
+ */
+void Datastructures::build_region_index(RegionIndex &index) const
+{
+    Trace::Span span("build_region_index", "index");
+    count(INDEX_REBUILDS);
+    index.parents.reserve(regions.size());
+    for (auto const& [id, region] : regions) {
+        index.parents.insert({id, region.parent ? region.parent->region_id : NO_REGION});
+        for (auto const& [stationid, station] : region.stations) {
+            auto& found = index.station_regions[stationid];
+            for (auto r = &region; r; r = r->parent) {
+                if (std::find(found.begin(), found.end(), r->region_id) != found.end())
+                    break;
+                found.push_back(r->region_id);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Datastructures::query_context
+ * @return the scratch memory of the calling thread
+ */
+Datastructures::QueryContext& Datastructures::query_context()
+{
+    static thread_local QueryContext context;
+    return context;
+}
+
+/**
+ * @brief Datastructures::prepare_search
+ * sizes the distance and parent arrays of the context to the network. The
+ * arrays stay reset between searches, so they are filled only when resized
+ * @param ctx the calling thread's scratch memory
+ * @param network the network searched
+ */
+void Datastructures::prepare_search(QueryContext& ctx, const Network &network) const
+{
+    auto n = network.ids.size();
+    if (ctx.search_dist.size() != n) {
+        ctx.search_dist.assign(n, INFINITE_DISTANCE);
+        ctx.search_parent.assign(n, NO_INDEX);
+    }
+    if (ctx.ch_backward_dist.size() != n) {
+        ctx.ch_backward_dist.assign(n, INFINITE_DISTANCE);
+        ctx.ch_backward_parent.assign(n, NO_INDEX);
+    }
+}
+
+/**
+ * @brief Datastructures::build_network_image
+ * builds the integer-indexed adjacency arrays and the RAPTOR route patterns
+ * from the stations and trains. A train is cut short at a removed station, and
+ * for RAPTOR also at midnight, as Time has no day part to order the stops past it.
+ * The departures of each station are kept in the order they were added
+ * @param with_lookups whether to include the station names, regions and departures,
+ * which only an image opened without the stations needs
+ * @return the network image
+ */
+std::string Datastructures::build_network_image(bool with_lookups) const
+{
+    Trace::Span span("build_network_image", "index");
+    count(INDEX_REBUILDS);
+    std::unordered_map<StationID, unsigned int> index;
+    StringTable ids;
+    StringTable names;
+    std::vector<Coord> coords;
+    for (auto const& [id, station] : stations_map) {
+        index.insert({id, coords.size()});
+        ids.add(id);
+        if (with_lookups)
+            names.add(station.station_name);
+        coords.push_back(station.station_coord);
+    }
+    auto n = coords.size();
+
+    std::vector<unsigned int> id_order(n);
+    std::iota(id_order.begin(), id_order.end(), 0);
+    std::sort(id_order.begin(), id_order.end(), [&ids](unsigned int a, unsigned int b) {
+        return ids[a] < ids[b];
+    });
+
+    // Adjacency in the order the trains were added, without repeated edges
+    std::vector<std::vector<unsigned int>> next(n);
+    std::vector<std::vector<unsigned int>> stops(trains_vector.size());
+    for (unsigned int t = 0; t < trains_vector.size(); ++t) {
+        unsigned int previous = NO_INDEX;
+        for (auto const& [stationid, time] : trains_vector[t].station_times) {
+            auto found = index.find(stationid);
+            auto current = found == index.end() ? NO_INDEX : found->second;
+            if (previous != NO_INDEX && current != NO_INDEX &&
+                std::find(next[previous].begin(), next[previous].end(), current) == next[previous].end())
+                next[previous].push_back(current);
+            previous = current;
+            stops[t].push_back(current);
+        }
+    }
+
+    std::vector<unsigned int> edge_begin;
+    std::vector<unsigned int> edge_to;
+    std::vector<Distance> edge_dist;
+    edge_begin.reserve(n + 1);
+    edge_begin.push_back(0);
+    for (unsigned int i = 0; i < n; ++i) {
+        for (auto j : next[i]) {
+            edge_to.push_back(j);
+            edge_dist.push_back(calculate_distance(coords[i], coords[j]));
+        }
+        edge_begin.push_back(edge_to.size());
+    }
+
+    // Train ids are stored once and referred to by index
+    StringTable trains;
+    std::unordered_map<TrainID, unsigned int> train_index;
+    auto train_of = [&trains, &train_index](TrainID const& id) {
+        auto [found, added] = train_index.insert({id, train_index.size()});
+        if (added)
+            trains.add(id);
+        return found->second;
+    };
+
+    // Group the trains by the part of their stop sequence RAPTOR can use
+    std::map<std::vector<unsigned int>, std::vector<unsigned int>> groups;
+    for (unsigned int t = 0; t < trains_vector.size(); ++t) {
+        auto const& times = trains_vector[t].station_times;
+        unsigned int length = 0;
+        while (length < stops[t].size() && stops[t][length] != NO_INDEX &&
+               (length == 0 || times[length - 1].second <= times[length].second))
+            ++length;
+        if (length < 2)
+            continue;
+        stops[t].resize(length);
+        groups[stops[t]].push_back(t);
+    }
+
+    struct Pattern {
+        std::vector<unsigned int> stops;
+        std::vector<unsigned int> trips;
+        std::vector<Time> times;
+    };
+    std::vector<Pattern> patterns;
+    for (auto& [sequence, group] : groups) {
+        auto length = sequence.size();
+        std::sort(group.begin(), group.end(), [this, length](unsigned int a, unsigned int b) {
+            auto const& ta = trains_vector[a].station_times;
+            auto const& tb = trains_vector[b].station_times;
+            for (unsigned int i = 0; i < length; ++i) {
+                if (ta[i].second != tb[i].second)
+                    return ta[i].second < tb[i].second;
+            }
+            return trains_vector[a].id < trains_vector[b].id;
+        });
+
+        // A trip which would overtake the last one of a pattern starts a new pattern
+        auto first = patterns.size();
+        for (auto t : group) {
+            auto const& times = trains_vector[t].station_times;
+            auto p = first;
+            for (; p < patterns.size(); ++p) {
+                auto const& last = patterns[p].times;
+                bool fits = true;
+                for (unsigned int i = 0; i < length && fits; ++i)
+                    fits = last[last.size() - length + i] <= times[i].second;
+                if (fits)
+                    break;
+            }
+            if (p == patterns.size()) {
+                patterns.emplace_back();
+                patterns.back().stops = sequence;
+            }
+            patterns[p].trips.push_back(train_of(trains_vector[t].id));
+            for (unsigned int i = 0; i < length; ++i)
+                patterns[p].times.push_back(times[i].second);
+        }
+    }
+
+    std::vector<unsigned int> pattern_stop_begin {0};
+    std::vector<unsigned int> pattern_stops;
+    std::vector<unsigned int> pattern_trip_begin {0};
+    std::vector<unsigned int> pattern_trips;
+    std::vector<unsigned int> pattern_time_begin {0};
+    std::vector<Time> pattern_times;
+    for (auto const& pattern : patterns) {
+        pattern_stops.insert(pattern_stops.end(), pattern.stops.begin(), pattern.stops.end());
+        pattern_trips.insert(pattern_trips.end(), pattern.trips.begin(), pattern.trips.end());
+        pattern_times.insert(pattern_times.end(), pattern.times.begin(), pattern.times.end());
+        pattern_stop_begin.push_back(pattern_stops.size());
+        pattern_trip_begin.push_back(pattern_trips.size());
+        pattern_time_begin.push_back(pattern_times.size());
+    }
+
+    std::vector<unsigned int> counts(n + 1, 0);
+    for (auto const& pattern : patterns) {
+        for (auto stop : pattern.stops)
+            ++counts[stop + 1];
+    }
+    for (unsigned int i = 0; i < n; ++i)
+        counts[i + 1] += counts[i];
+    auto stop_routes_begin = counts;
+    std::vector<StopRoute> stop_routes(counts[n]);
+    for (unsigned int p = 0; p < patterns.size(); ++p) {
+        auto const& pattern_stops = patterns[p].stops;
+        for (unsigned int pos = 0; pos < pattern_stops.size(); ++pos)
+            stop_routes[counts[pattern_stops[pos]]++] = {p, pos};
+    }
+
+    // The queries read the departures from the stations' lists, so only an image
+    // to be saved has them
+    counts.assign(n + 1, 0);
+    if (with_lookups) {
+        for (auto const& [stationid, station] : station_departures) {
+            auto found = index.find(stationid);
+            if (found != index.end() && station->list)
+                counts[found->second + 1] += station->list->size - station->removed;
+        }
+    }
+    for (unsigned int i = 0; i < n; ++i)
+        counts[i + 1] += counts[i];
+    auto departure_begin = counts;
+    std::vector<Time> departure_times(counts[n]);
+    std::vector<unsigned int> departure_trains(counts[n]);
+    if (with_lookups) {
+        for (auto const& [stationid, station] : station_departures) {
+            auto found = index.find(stationid);
+            if (found == index.end() || !station->list)
+                continue;
+            auto const& list = *station->list;
+            for (std::size_t i = 0; i < list.size; ++i) {
+                if (list.entries[i].removed != 0)
+                    continue;
+                departure_times[counts[found->second]] = list.entries[i].time;
+                departure_trains[counts[found->second]++] = train_of(list.entries[i].train);
+            }
+        }
+    }
+
+    ImageWriter image;
+    image.add(IDS_OFFSETS, IDS_CHARS, ids);
+    image.add(ID_ORDER, id_order);
+    image.add(COORDS, coords);
+    image.add(EDGE_BEGIN, edge_begin);
+    image.add(EDGE_TO, edge_to);
+    image.add(EDGE_DIST, edge_dist);
+    image.add(PATTERN_STOP_BEGIN, pattern_stop_begin);
+    image.add(PATTERN_STOPS, pattern_stops);
+    image.add(PATTERN_TRIP_BEGIN, pattern_trip_begin);
+    image.add(PATTERN_TRIPS, pattern_trips);
+    image.add(PATTERN_TIME_BEGIN, pattern_time_begin);
+    image.add(PATTERN_TIMES, pattern_times);
+    image.add(TRAIN_OFFSETS, TRAIN_CHARS, trains);
+    image.add(STOP_ROUTES_BEGIN, stop_routes_begin);
+    image.add(STOP_ROUTES, stop_routes);
+    image.add(DEPARTURE_BEGIN, departure_begin);
+    image.add(DEPARTURE_TIMES, departure_times);
+    image.add(DEPARTURE_TRAINS, departure_trains);
+
+    if (with_lookups) {
+        std::vector<unsigned int> station_regions_begin {0};
+        std::vector<RegionID> station_regions;
+        RegionIndex region_index;
+        build_region_index(region_index);
+        for (unsigned int i = 0; i < n; ++i) {
+            auto found = region_index.station_regions.find(StationID(ids[i]));
+            if (found != region_index.station_regions.end())
+                station_regions.insert(station_regions.end(), found->second.begin(), found->second.end());
+            station_regions_begin.push_back(station_regions.size());
+        }
+
+        std::vector<RegionID> region_ids;
+        for (auto const& [id, region] : regions)
+            region_ids.push_back(id);
+        std::sort(region_ids.begin(), region_ids.end());
+        StringTable region_names;
+        for (auto id : region_ids)
+            region_names.add(regions.at(id).region_name);
+
+        image.add(NAME_OFFSETS, NAME_CHARS, names);
+        image.add(STATION_REGIONS_BEGIN, station_regions_begin);
+        image.add(STATION_REGIONS, station_regions);
+        image.add(REGION_IDS, region_ids);
+        image.add(REGION_NAME_OFFSETS, REGION_NAME_CHARS, region_names);
+    }
+    return image.finish();
+}
+
+/**
+ * @brief Datastructures::raptor
+ * round-based earliest arrival search. Round k labels the stations whose earliest
+ * arrival improves by using k trains, and only the patterns serving stations
+ * labelled in round k - 1 are scanned in round k
+ * @param from index of the station of departure
+ * @param to index of the station of arrival, used to prune later arrivals
+ * @param starttime the earliest time to leave
+ * @param max_rounds the largest number of trains boarded
+ */
+void Datastructures::raptor(QueryContext& ctx, const Network &network, unsigned int from, unsigned int to,
+                            Time starttime, unsigned int max_rounds) const
+{
+    auto n = network.ids.size();
+
+    // Only the stations labelled by the previous search need resetting
+    if (ctx.raptor_best.size() != n) {
+        ctx.raptor_arrival.assign(n, NO_TIME);
+        ctx.raptor_parent.assign(n, RaptorParent());
+        ctx.raptor_best.assign(n, NO_TIME);
+        ctx.raptor_is_marked.assign(n, false);
+        ctx.raptor_last_label.assign(n, NO_INDEX);
+    } else {
+        for (auto const& label : ctx.raptor_labels) {
+            ctx.raptor_arrival[label.station] = NO_TIME;
+            ctx.raptor_best[label.station] = NO_TIME;
+            ctx.raptor_is_marked[label.station] = false;
+            ctx.raptor_last_label[label.station] = NO_INDEX;
+        }
+    }
+    if (ctx.raptor_first_pos.size() != network.pattern_count())
+        ctx.raptor_first_pos.assign(network.pattern_count(), NO_INDEX);
+    ctx.raptor_labels.clear();
+    ctx.raptor_marked.clear();
+
+    ctx.raptor_arrival[from] = starttime;
+    ctx.raptor_best[from] = starttime;
+    ctx.raptor_labels.push_back({from, starttime, {NO_INDEX, NO_INDEX, 0, 0, 0}, NO_INDEX});
+    ctx.raptor_last_label[from] = 0;
+    ctx.raptor_marked.push_back(from);
+    ctx.raptor_is_marked[from] = true;
+    unsigned long long visited = 0;
+    unsigned long long scanned = 0;
+
+    for (unsigned int round = 1; round <= max_rounds && !ctx.raptor_marked.empty(); ++round) {
+        // Each pattern is scanned once, from the earliest stop improved last round
+        ctx.raptor_queue.clear();
+        visited += ctx.raptor_marked.size();
+        for (auto station : ctx.raptor_marked) {
+            ctx.raptor_is_marked[station] = false;
+            for (auto i = network.stop_routes_begin[station]; i < network.stop_routes_begin[station + 1]; ++i) {
+                auto [p, pos] = network.stop_routes[i];
+                if (ctx.raptor_first_pos[p] == NO_INDEX)
+                    ctx.raptor_queue.push_back(p);
+                ctx.raptor_first_pos[p] = std::min(ctx.raptor_first_pos[p], pos);
+            }
+        }
+        ctx.raptor_marked.clear();
+
+        for (auto p : ctx.raptor_queue) {
+            auto const pattern = network.pattern(p);
+            auto length = pattern.stops.size();
+            unsigned int trip = NO_INDEX;
+            unsigned int board = 0;
+
+            scanned += length - ctx.raptor_first_pos[p];
+            for (auto pos = ctx.raptor_first_pos[p]; pos < length; ++pos) {
+                auto station = pattern.stops[pos];
+
+                if (trip != NO_INDEX) {
+                    auto time = pattern.times[trip * length + pos];
+                    if (time < ctx.raptor_best[station] && time < ctx.raptor_best[to]) {
+                        ctx.raptor_best[station] = time;
+                        ctx.raptor_parent[station] = {p, trip, board, pos, round};
+                        if (!ctx.raptor_is_marked[station]) {
+                            ctx.raptor_is_marked[station] = true;
+                            ctx.raptor_marked.push_back(station);
+                        }
+                    }
+                }
+
+                // Catch the earliest trip leaving after arriving here in the previous round
+                auto ready = ctx.raptor_arrival[station];
+                if (ready == NO_TIME ||
+                    (trip != NO_INDEX && ready > pattern.times[trip * length + pos]))
+                    continue;
+                unsigned int low = 0;
+                unsigned int high = trip == NO_INDEX ? pattern.trips.size() : trip;
+                while (low < high) {
+                    auto middle = (low + high) / 2;
+                    if (pattern.times[middle * length + pos] < ready)
+                        low = middle + 1;
+                    else
+                        high = middle;
+                }
+                if (low < pattern.trips.size() && low != trip) {
+                    trip = low;
+                    board = pos;
+                }
+            }
+            ctx.raptor_first_pos[p] = NO_INDEX;
+        }
+
+        // The improved stations become ready for boarding in the next round
+        for (auto station : ctx.raptor_marked) {
+            ctx.raptor_labels.push_back({station, ctx.raptor_best[station], ctx.raptor_parent[station],
+                                         ctx.raptor_last_label[station]});
+            ctx.raptor_last_label[station] = ctx.raptor_labels.size() - 1;
+            ctx.raptor_arrival[station] = ctx.raptor_best[station];
+        }
+    }
+
+    count(SEARCHES);
+    count(NODES_VISITED, visited);
+    count(DEPARTURES_SCANNED, scanned);
+}
+
+/**
+ * @brief Datastructures::raptor_label
+ * finds the label of the earliest arrival at the station using at most the given
+ * number of trains, in the labels of the last raptor search
+ * @param station index of the station
+ * @param round the largest number of trains
+ * @return index of the label, NO_INDEX if the station can't be reached in time
+ */
+unsigned int Datastructures::raptor_label(const QueryContext &ctx, unsigned int station, unsigned int round)
+{
+    auto label = ctx.raptor_last_label[station];
+    while (label != NO_INDEX && ctx.raptor_labels[label].parent.round > round) {
+        label = ctx.raptor_labels[label].previous;
+    }
+    return label;
 }
@@ -18,6 +18,15 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <cmath>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <variant>
+#include <string_view>
 
 // Types for IDs
 using StationID = std::string;
@@ -95,6 +104,21 @@ private:
     std::string msg_;
 };
 
+// Thrown by the operations which need the stations, regions and trains as added,
+// while a network image opened with open_image is answering the queries instead
+class NotAvailable : public std::exception
+{
+public:
+    explicit NotAvailable(std::string const& msg) : msg_{msg + " not available while a network image is open"} {}
+
+    virtual const char* what() const noexcept override
+    {
+        return msg_.c_str();
+    }
+private:
+    std::string msg_;
+};
+
 
 // This is the class you are supposed to implement
 
@@ -112,7 +136,7 @@ public:
     // Short rationale for estimate: "vector.size()" operation returns
     // the vector's size in constant time, as it doesn't require looping
     // through
-    unsigned int station_count();
+    unsigned int station_count() const;
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: Linear in time complexity as it
@@ -122,7 +146,7 @@ public:
     // Estimate of performance: O(n)
     // Short rationale for estimate: Linear in time, as one for-loop
     // was used to add the contents to another data structure
-    std::vector<StationID> all_stations();
+    std::vector<StationID> all_stations() const;
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: std::unordered_map::find works average in constant time
@@ -132,12 +156,12 @@ public:
     // Estimate of performance: O(n)
     // Short rationale for estimate: std::unordered_map::find works average in constant time
     // and linear in worst case
-    Name get_station_name(StationID id);
+    Name get_station_name(StationID id) const;
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: std::unordered_map::find works average in constant time
     // and linear in worst case
-    Coord get_station_coordinates(StationID id);
+    Coord get_station_coordinates(StationID id) const;
 
     // We recommend you implement the operations below only after implementing the ones above
 
@@ -154,28 +178,30 @@ public:
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: std::map::find has a logarithmic complexity based on
     // the size of the container
-    StationID find_station_with_coord(Coord xy);
+    StationID find_station_with_coord(Coord xy) const;
 
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: std::unordered_map::find works average in constant time
     // and linear in worst case. Other operations work in constant time
     bool change_station_coord(StationID id, Coord newcoord);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: std::unordered_map::find works average in constant time
-    // and linear in worst case and std::find_if has at most linear time
-    // complexity. Other operations are constant
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: The station and the departure index are hash tables with
+    // average constant time lookups, and the departure is appended to the station's list.
+    // A full list is copied into one twice as large, which is constant amortized
     bool add_departure(StationID stationid, TrainID trainid, Time time);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: std::find and std::find_if have at most linear time
-    // complexity as well as std::erase
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: The departure index gives the departure's place in the
+    // station's list in average constant time and it is only marked removed. The list is
+    // compacted once half of it is removed, which is constant amortized per removal
     bool remove_departure(StationID stationid, TrainID trainid, Time time);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: std::unordered_map::find works average in constant time
-    // and linear in worst case. for-loop works in linear time
-    std::vector<std::pair<Time, TrainID>> station_departures_after(StationID stationid, Time time);
+    // Estimate of performance: O(d + log n)
+    // Short rationale for estimate: Each station keeps its own departures (d), and the station
+    // is found with a binary search over the snapshot's sorted ids. The departures are read
+    // without a lock, and updates to them don't wait for a new snapshot
+    std::vector<std::pair<Time, TrainID>> station_departures_after(StationID stationid, Time time) const;
 
     // We recommend you implement the operations below only after implementing the ones above
 
@@ -186,17 +212,17 @@ public:
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: for-loop works in linear time, push_back is constant
-    std::vector<RegionID> all_regions();
+    std::vector<RegionID> all_regions() const;
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: std::unordered_map::find works average in constant time
     // and linear in worst case
-    Name get_region_name(RegionID id);
+    Name get_region_name(RegionID id) const;
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: std::unordered_map::find works average in constant time
     // and linear in worst case
-    std::vector<Coord> get_region_coords(RegionID id);
+    std::vector<Coord> get_region_coords(RegionID id) const;
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: std::unordered_map::find works average in constant time
@@ -208,11 +234,10 @@ public:
     // and linear in worst case. Other operations are constant
     bool add_station_to_region(StationID id, RegionID parentid);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: std::unordered_map::find works average in constant time
-    // and linear in worst case. for-loop and std::clear are linear in time complexity
-    // helper function find_parent has also a linear std::unordered_set::find and constant operations
-    std::vector<RegionID> station_in_regions(StationID id);
+    // Estimate of performance: O(log n + k)
+    // Short rationale for estimate: The station is found with a binary search over the
+    // snapshot's sorted ids, and its k regions were listed when the snapshot was built
+    std::vector<RegionID> station_in_regions(StationID id) const;
 
     // Non-compulsory operations
 
@@ -220,7 +245,7 @@ public:
     // Short rationale for estimate: std::unordered_map::find works average in constant time
     // and linear in worst case. helper function find_children has a for-loop so it
     // is linear
-    std::vector<RegionID> all_subregions_of_region(RegionID id);
+    std::vector<RegionID> all_subregions_of_region(RegionID id) const;
 
     // Estimate of performance: O(nlog(n))
     // Short rationale for estimate: std::sort has a worst case time complexity of n log n
@@ -232,11 +257,11 @@ public:
     // and the other operations work in constant time
     bool remove_station(StationID id);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: std::unordered_map::find works average in constant time
-    // and linear in worst case, helper function common_parent uses std::unordered_set::find
-    // which has the time complexity, other operations are constant
-    RegionID common_parent_of_regions(RegionID id1, RegionID id2);
+    // Estimate of performance: O(h)
+    // Short rationale for estimate: The snapshot's parent links are hash tables with average
+    // constant time lookups, and helper function common_parent follows the h parents of both
+    // regions, remembering the first ones in an std::unordered_set
+    RegionID common_parent_of_regions(RegionID id1, RegionID id2) const;
 
     //
     // New assignment 2 operations
@@ -247,45 +272,179 @@ public:
     // that the two for loops have a linear complexity and other operations are constant
     bool add_train(TrainID trainid, std::vector<std::pair<StationID, Time>> stationtimes);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: get_station_name works worst case in linear time, looping
-    // through 'destinations' is at most linear as in the size of the container
-    std::vector<StationID> next_stations_from(StationID id);
+    // Estimate of performance: O(log n + k)
+    // Short rationale for estimate: The station is found with a binary search over the
+    // snapshot's sorted ids, and its k connections are stored together
+    std::vector<StationID> next_stations_from(StationID id) const;
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: get_station_name works worst case in linear time as does
     // 'found_train', the for loop requires iterating through and complexity is dependent on
     // the size of container, thus the complexity is together at most linear
-    std::vector<StationID> train_stations_from(StationID stationid, TrainID trainid);
+    std::vector<StationID> train_stations_from(StationID stationid, TrainID trainid) const;
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: All operations are at most linear, as clearing the elements
     // depends on the sizes of the containers
     void clear_trains();
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: get_station_name works worst case in linear time, other
-    // operations depend on the size of the containers 'path' or 'destinations' and thus is
-    // linear
-    std::vector<std::pair<StationID, Distance>> route_any(StationID fromid, StationID toid);
+    // Estimate of performance: O((n + m) log n)
+    // Short rationale for estimate: Any route will do, so the route is the one
+    // route_shortest_distance finds
+    std::vector<std::pair<StationID, Distance>> route_any(StationID fromid, StationID toid) const;
 
     // Non-compulsory operations
 
     // Estimate of performance:
     // Short rationale for estimate:
-    std::vector<std::pair<StationID, Distance>> route_least_stations(StationID fromid, StationID toid);
+    std::vector<std::pair<StationID, Distance>> route_least_stations(StationID fromid, StationID toid) const;
+
+    // Estimate of performance: O(n + m)
+    // Short rationale for estimate: The depth-first search colours each station at most
+    // once and follows each connection at most once. Only the stations touched are reset
+    std::vector<StationID> route_with_cycle(StationID fromid) const;
+
+    // Estimate of performance: O((n + m) log n)
+    // Short rationale for estimate: Dijkstra's algorithm pushes each connection at most once
+    // to the heap. With the contraction hierarchy in use only the few stations ranked
+    // above the endpoints are searched, and the core of stations left uncontracted
+    // with a bidirectional search that stops halfway
+    std::vector<std::pair<StationID, Distance>> route_shortest_distance(StationID fromid, StationID toid) const;
+
+    // Estimate of performance: O(K(R + S log T))
+    // Short rationale for estimate: RAPTOR makes one round per train boarded (K), and each round
+    // scans every route pattern (R) touched by a station improved in the previous round once.
+    // Boarding a trip at a stop is a binary search over the pattern's T trips. Rounds only
+    // label the stations they improve, so no round copies labels for all n stations
+    std::vector<std::pair<StationID, Time>> route_earliest_arrival(StationID fromid, StationID toid, Time starttime) const;
+
+    // Estimate of performance: O(K(R + S log T))
+    // Short rationale for estimate: Same rounds as route_earliest_arrival, but at most
+    // max_transfers + 1 of them, and never more than there are patterns. Picking the front
+    // from the destination's labels is linear in K
+    std::vector<std::pair<int, Time>> route_earliest_arrival_transfers(StationID fromid, StationID toid, Time starttime, unsigned int max_transfers) const;
+
+    // Estimate of performance: O(s (n + m) log n)
+    // Short rationale for estimate: One Dijkstra per source (s), each stopping as soon as
+    // every target has been settled, so the cost doesn't depend on the number of pairs
+    std::vector<std::vector<Distance>> distance_matrix(std::vector<StationID> const& sources, std::vector<StationID> const& targets) const;
 
-    // Estimate of performance:
-    // Short rationale for estimate:
-    std::vector<StationID> route_with_cycle(StationID fromid);
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only sets a flag, the hierarchy itself is built by the
+    // snapshot builder thread after stations or trains have changed
+    void use_contraction_hierarchy(bool enabled);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
-    std::vector<std::pair<StationID, Distance>> route_shortest_distance(StationID fromid, StationID toid);
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only reads the flag
+    bool contraction_hierarchy_enabled() const;
 
-    // Estimate of performance:
-    // Short rationale for estimate:
-    std::vector<std::pair<StationID, Time>> route_earliest_arrival(StationID fromid, StationID toid, Time starttime);
+    // Estimate of performance: O(n w log n), O(1) if already built
+    // Short rationale for estimate: Every station is contracted once in priority order, and
+    // contracting one runs a bounded witness search (w) from each of its neighbours
+    unsigned int contraction_hierarchy_shortcuts() const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only sets the count, the landmark tables are built
+    // by the snapshot builder thread after stations or trains have changed
+    void use_landmarks(unsigned int count);
+
+    // Estimate of performance: O(k (n + m) log n), O(1) if already built
+    // Short rationale for estimate: Choosing and measuring each of the k landmarks takes
+    // a full Dijkstra in both directions
+    std::size_t landmark_table_bytes() const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only sets a flag. While it is set, a query made after an
+    // update waits for the builder thread to publish the snapshot with the update in it
+    void wait_for_updates(bool enabled);
+
+    // Batch queries. Each query is one of the read-only operations above, with
+    // the parameters it takes filled in (a station for station_in_regions and
+    // station_departures_after in 'from')
+    enum class QueryKind { ROUTE_ANY, ROUTE_SHORTEST_DISTANCE, ROUTE_EARLIEST_ARRIVAL,
+                           ROUTE_WITH_CYCLE, STATION_IN_REGIONS, COMMON_PARENT_OF_REGIONS,
+                           STATION_DEPARTURES_AFTER };
+    struct Query {
+        QueryKind kind;
+        StationID from = NO_STATION;
+        StationID to = NO_STATION;
+        Time time = NO_TIME;
+        RegionID region1 = NO_REGION;
+        RegionID region2 = NO_REGION;
+    };
+    using QueryResult = std::variant<std::vector<std::pair<StationID, Distance>>,
+                                     std::vector<std::pair<StationID, Time>>,
+                                     std::vector<std::pair<Time, TrainID>>,
+                                     std::vector<StationID>,
+                                     std::vector<RegionID>,
+                                     RegionID>;
+
+    // Estimate of performance: O(q/t * c)
+    // Short rationale for estimate: The q queries are handed out to t worker threads in
+    // small chunks, each query costing what the operation itself costs (c)
+    std::vector<QueryResult> run_queries(std::vector<Query> const& queries, unsigned int threads) const;
+
+    // Bulk versions of add_station, add_train and add_departure for loading whole
+    // timetables. The items are added in order with the same result as calling the
+    // single operation for each, and the number of items added is returned
+
+    // Estimate of performance: O(s log n)
+    // Short rationale for estimate: Each of the s stations is inserted like in add_station,
+    // but the writer lock is taken and a new snapshot asked for only once
+    unsigned int add_stations(std::vector<std::tuple<StationID, Name, Coord>> const& stations);
+
+    // Estimate of performance: O(s)
+    // Short rationale for estimate: Each of the s stops is checked for a repeat in the
+    // departure index and added in constant time on average
+    unsigned int add_trains(std::vector<std::pair<TrainID, std::vector<std::pair<StationID, Time>>>> const& trains);
+
+    // Estimate of performance: O(d)
+    // Short rationale for estimate: As in add_trains, each of the d departures is checked
+    // in the departure index instead of scanning the existing ones
+    unsigned int add_departures(std::vector<std::tuple<StationID, TrainID, Time>> const& departures);
+
+    // Estimate of performance: O(n + r + t + d)
+    // Short rationale for estimate: Every station, region, train and departure is written
+    // once into a buffer, which is then written to the file in one go
+    bool save_snapshot(std::string const& filename) const;
+
+    // Estimate of performance: O(n log n + r + t + d)
+    // Short rationale for estimate: The file is mapped and checksummed in one pass and each
+    // item read in place and inserted once. Only the coordinate map is logarithmic
+    bool load_snapshot(std::string const& filename);
+
+    // Estimate of performance: O(n log n + r * n + t + d)
+    // Short rationale for estimate: The network is built as for the queries, with the station
+    // ids sorted for lookups and the regions of every station listed
+    bool save_image(std::string const& filename) const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: The file is mapped and only its header is read. The pages
+    // are read in (or shared from the page cache) as the queries touch them
+    bool open_image(std::string const& filename);
+
+    // Counts of the work done inside the operations, summed over all threads since the
+    // last reset. They tell whether a slow query searched a large graph or searched badly.
+    // The counts are process-wide: with several instances, each sees the work of all of
+    // them, and only the reset is per instance
+    struct OperationCounters {
+        unsigned long long hash_probes = 0;        // Lookups in the station, region, train and departure hash tables
+        unsigned long long searches = 0;           // Route searches started
+        unsigned long long nodes_visited = 0;      // Stations settled or scanned by the route searches
+        unsigned long long heap_pushes = 0;        // Priority queue pushes of the route searches
+        unsigned long long heap_pops = 0;          // Priority queue pops of the route searches
+        unsigned long long index_rebuilds = 0;     // Departure index, network, hierarchy and landmark rebuilds
+        unsigned long long departures_scanned = 0; // Departures looked at by station_departures_after and RAPTOR
+    };
+
+    // Estimate of performance: O(t)
+    // Short rationale for estimate: The counters of each of the t threads that have
+    // run operations are added up
+    OperationCounters operation_counters() const;
+
+    // Estimate of performance: O(t)
+    // Short rationale for estimate: The current totals are remembered as the new zero
+    void reset_operation_counters();
 
 private:
     // Add stuff needed for your class implementation here
@@ -299,12 +458,62 @@ private:
     std::map<Coord, Station> stations_map_coord;
 
 
+    // Departures of each station in the order they were added, with the trains leaving.
+    // station_departures_after reads the lists through the snapshot without a lock while
+    // the writers append to them: a reader sees the first 'size' entries of a list, and a
+    // full list is copied into one twice as large, which replaces it. Each update of the
+    // departures is a version of its own, counted in 'departures_published' only once it is
+    // complete, and an entry carries the versions that added and removed it, so a reader
+    // sees a train or a batch either whole or not at all. A removed departure stays in its
+    // list until half of the list has been removed. A station keeps its list when removed,
+    // but 'exists' tells clear_departures it is gone
     struct Departure {
-        StationID departure_station;
-        TrainID train_id;
-        Time departure_time;
+        Time time = NO_TIME;
+        TrainID train;
+        unsigned long long added = 0;
+        std::atomic<unsigned long long> removed {0};
+
+        Departure() = default;
+        Departure& operator=(Departure const& other)
+        {
+            time = other.time;
+            train = other.train;
+            added = other.added;
+            removed.store(other.removed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return *this;
+        }
     };
-    std::vector<Departure> departures;
+    struct DepartureList {
+        explicit DepartureList(std::size_t capacity) : entries(new Departure[capacity]), capacity(capacity) {}
+        std::unique_ptr<Departure[]> entries;
+        std::size_t capacity;
+        std::atomic<std::size_t> size {0};
+    };
+    struct StationDepartures {
+        bool exists = false;
+        std::shared_ptr<DepartureList> list; // read and replaced with std::atomic_load/store
+        std::size_t removed = 0;
+    };
+    std::unordered_map<StationID, std::shared_ptr<StationDepartures>> station_departures;
+    std::atomic<unsigned long long> departures_published {0};
+
+    // Departures by station and train, with their positions in the station's list. A
+    // train leaves a station at most once
+    using DepartureKey = std::pair<StationID, TrainID>;
+    struct DepartureKeyHash {
+        std::size_t operator()(DepartureKey const& key) const
+        {
+            return std::hash<StationID>()(key.first) * 31 + std::hash<TrainID>()(key.second);
+        }
+    };
+    std::unordered_map<DepartureKey, std::size_t, DepartureKeyHash> departure_index;
+    std::size_t live_departures = 0;
+    bool insert_departure(StationID const& stationid, TrainID const& trainid, Time time);
+    bool erase_departure(StationID const& stationid, TrainID const& trainid, Time time);
+    void index_departures(StationID const& stationid, StationDepartures& list);
+    void publish_departures();
+    void clear_departures();
+    void mark_station(StationID const& id, bool exists);
 
 
     struct Region {
@@ -324,58 +533,294 @@ private:
 
     std::vector<Train> trains_vector;
     std::unordered_map<TrainID, Train> trains_uo_map;
-    std::unordered_multimap<StationID, StationID> destinations;
 
 
-    void find_parent(Region* r) {
-        if (r == NULL)
-            return;
+    // Read-only view of an array inside a network image
+    template <typename T>
+    class Array {
+    public:
+        Array() = default;
+        Array(T const* data, std::size_t size) : data(data), count(size) {}
+        T const& operator[](std::size_t i) const { return data[i]; }
+        std::size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        T const* begin() const { return data; }
+        T const* end() const { return data + count; }
+        Array slice(std::size_t from, std::size_t to) const { return {data + from, to - from}; }
+    private:
+        T const* data = nullptr;
+        std::size_t count = 0;
+    };
+
+    // Strings of an image stored back to back, string i between offsets i and i + 1
+    struct Strings {
+        Array<std::uint32_t> offsets;
+        Array<char> chars;
+        std::size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+        std::string_view operator[](std::size_t i) const
+        {
+            return {chars.begin() + offsets[i], offsets[i + 1] - offsets[i]};
+        }
+    };
 
-        auto found_station = region_stations_set.find(r->region_id);
+    struct StopRoute {
+        unsigned int pattern;
+        unsigned int pos;
+    };
 
-        if (found_station != region_stations_set.end()) {
-            return;
+    // Trains with the same stop sequence grouped together. Trips are sorted by
+    // departure and never overtake each other, so 'times' is sorted column by column
+    struct RoutePattern {
+        Array<unsigned int> stops;
+        Array<unsigned int> trips; // indices to Network::trains
+        Array<Time> times; // trips.size() rows of stops.size() times
+    };
+
+    // Integer-indexed view of the stations and trains used by the route searches.
+    // Adjacency lists and the stop -> (pattern, position) lists are stored as flat
+    // arrays with offsets, so that a search touches only contiguous memory.
+    // All the arrays are views into one image, which is either built in memory
+    // from the stations and trains or memory-mapped from a file written by
+    // save_image. The names and regions are only in images written to a file
+    struct Network {
+        std::shared_ptr<void const> storage;
+        std::string_view image;
+        Strings ids;
+        Array<unsigned int> id_order; // station indices sorted by id
+        Array<Coord> coords;
+        Array<unsigned int> edge_begin;
+        Array<unsigned int> edge_to;
+        Array<Distance> edge_dist;
+        Array<unsigned int> pattern_stop_begin;
+        Array<unsigned int> pattern_stops;
+        Array<unsigned int> pattern_trip_begin;
+        Array<unsigned int> pattern_trips;
+        Array<unsigned int> pattern_time_begin;
+        Array<Time> pattern_times;
+        Strings trains;
+        Array<unsigned int> stop_routes_begin;
+        Array<StopRoute> stop_routes;
+        Array<unsigned int> departure_begin;
+        Array<Time> departure_times;
+        Array<unsigned int> departure_trains; // indices to 'trains'
+        Strings names;
+        Array<unsigned int> station_regions_begin;
+        Array<RegionID> station_regions;
+        Array<RegionID> region_ids; // sorted
+        Strings region_names;
+
+        bool has_lookups() const { return !names.offsets.empty(); }
+        std::size_t pattern_count() const { return pattern_stop_begin.empty() ? 0 : pattern_stop_begin.size() - 1; }
+        RoutePattern pattern(unsigned int p) const
+        {
+            return {pattern_stops.slice(pattern_stop_begin[p], pattern_stop_begin[p + 1]),
+                    pattern_trips.slice(pattern_trip_begin[p], pattern_trip_begin[p + 1]),
+                    pattern_times.slice(pattern_time_begin[p], pattern_time_begin[p + 1])};
         }
-        region_stations_set.insert(r->region_id);
-        region_stations_vec.push_back(r->region_id);
-        find_parent(r->parent);
-    }
-    std::unordered_set<RegionID> region_stations_set;
-    std::vector<RegionID> region_stations_vec;
+    };
+    static constexpr unsigned int NO_INDEX = std::numeric_limits<unsigned int>::max();
+    static constexpr Distance INFINITE_DISTANCE = std::numeric_limits<Distance>::max();
+    static unsigned int network_index(Network const& network, StationID const& id);
+    static bool map_network_image(std::string_view image, Network& network);
+
+
+    // RAPTOR labels. A round only adds labels for the stations it improved, and each
+    // label links to the same station's label from an earlier round, so the arrival
+    // using at most k trains is the first label on the chain set in round k or before.
+    // The parent records the trip, the boarding stop and the round of the label
+    struct RaptorParent {
+        unsigned int pattern;
+        unsigned int trip;
+        unsigned int board;
+        unsigned int alight;
+        unsigned int round;
+    };
+    struct RaptorLabel {
+        unsigned int station;
+        Time arrival;
+        RaptorParent parent;
+        unsigned int previous;
+    };
 
+    // A station is grey while it is on the depth-first search stack and black
+    // once all its connections have been followed
+    enum class Colour : unsigned char { WHITE, GREY, BLACK };
+
+    // Scratch memory of the queries. Every thread has its own context, which is
+    // kept between calls so that the searches don't allocate once it has grown,
+    // and the read-only queries can run in parallel
+    struct QueryContext {
+        std::vector<RaptorLabel> raptor_labels;
+        std::vector<unsigned int> raptor_last_label;
+        std::vector<Time> raptor_arrival;
+        std::vector<RaptorParent> raptor_parent;
+        std::vector<Time> raptor_best;
+        std::vector<unsigned int> raptor_marked;
+        std::vector<bool> raptor_is_marked;
+        std::vector<unsigned int> raptor_first_pos;
+        std::vector<unsigned int> raptor_queue;
+
+        std::vector<Colour> dfs_colour;
+        std::vector<std::pair<unsigned int, unsigned int>> dfs_stack;
+        std::vector<unsigned int> dfs_touched;
+
+        // Dijkstra, A* and the forward half of the hierarchy search,
+        // reset only for the stations touched
+        std::vector<Distance> search_dist;
+        std::vector<unsigned int> search_parent;
+        std::vector<unsigned int> search_touched;
+        std::vector<bool> search_is_target;
+        std::vector<Distance> ch_backward_dist;
+        std::vector<unsigned int> ch_backward_parent;
+        std::vector<unsigned int> ch_core_reached;
+
+        std::vector<RegionID> subregions_vec;
+        std::unordered_set<RegionID> parent_regions_set;
+        RegionID common_parent_id = NO_REGION;
+        bool has_common = false;
+    };
+    static QueryContext& query_context();
+    void prepare_search(QueryContext& ctx, Network const& network) const;
+
+    void raptor(QueryContext& ctx, Network const& network, unsigned int from, unsigned int to,
+                Time starttime, unsigned int max_rounds) const;
+    static unsigned int raptor_label(QueryContext const& ctx, unsigned int station, unsigned int round);
+    void dijkstra(QueryContext& ctx, Network const& network, unsigned int from, unsigned int to) const;
+    std::vector<std::pair<StationID, Distance>> route_from_path(Network const& network,
+                                                                std::vector<unsigned int> const& path) const;
+
+
+    // Contraction hierarchy over the distance-weighted connections. Each station
+    // keeps the edges to higher ranked stations in 'up' and the reversed edges
+    // from higher ranked stations in 'down'. A shortcut remembers the station it
+    // bypasses in 'via' so that routes can be unpacked
+    struct ChEdge {
+        unsigned int to;
+        Distance dist;
+        unsigned int via;
+    };
+    struct ContractionHierarchy {
+        std::vector<unsigned int> rank;
+        std::vector<unsigned int> up_begin;
+        std::vector<ChEdge> up;
+        std::vector<unsigned int> down_begin;
+        std::vector<ChEdge> down;
+        unsigned int shortcuts = 0;
+    };
+    static constexpr unsigned int WITNESS_SETTLE_LIMIT = 64;
+    static constexpr unsigned int CH_CORE_DEGREE = 8;
+    bool ch_enabled = false;
+
+
+    // ALT (A*, landmarks, triangle inequality). The distances from and to each
+    // landmark are stored station by station, alt_count values per station, so
+    // that the bound of one station is read from one place
+    static constexpr std::uint32_t ALT_UNREACHABLE = std::numeric_limits<std::uint32_t>::max();
+    unsigned int alt_count = 0;
+    struct Landmarks {
+        unsigned int count = 0;
+        std::vector<unsigned int> stations;
+        std::vector<std::uint32_t> from;
+        std::vector<std::uint32_t> to;
+    };
 
-    void find_children(Region* r) {
+
+    // The region hierarchy as the queries read it: the parent of each region (NO_REGION
+    // for the topmost ones), and the regions of each station, the ones it was added to
+    // first and then the regions containing those
+    struct RegionIndex {
+        std::unordered_map<RegionID, RegionID> parents;
+        std::unordered_map<StationID, std::vector<RegionID>> station_regions;
+    };
+    void build_region_index(RegionIndex& index) const;
+
+
+    // Everything the queries read is built into an immutable snapshot, which is published
+    // by swapping one pointer. A reader takes the current snapshot at the start of a query
+    // and keeps it alive for as long as it needs it, so an update never changes the data
+    // under a running query, and never makes a query wait. The operations that change
+    // stations, regions, trains or the search settings hold writer_mutex for their whole
+    // duration and then count a new version in 'changes'. A builder thread of its own builds
+    // and publishes the snapshots once the updates pause, or at the latest BUILD_LIMIT after
+    // the first update not yet published. Only with wait_for_updates set does a query wait
+    // for the updates made before it. Parts that haven't changed are shared with the
+    // previous snapshot, and the departure lists are shared with the writers, which update
+    // them in place as described above. The other getters read the stations and regions
+    // as added, and are for the thread making the updates
+    using DepartureSlots = std::vector<std::shared_ptr<StationDepartures const>>;
+    struct Snapshot {
+        std::shared_ptr<Network const> network;
+        std::shared_ptr<DepartureSlots const> departures; // by station index, none for an image
+        std::shared_ptr<RegionIndex const> regions; // none for an image
+        bool ch_enabled = false;
+        std::shared_ptr<ContractionHierarchy const> ch;
+        std::shared_ptr<Landmarks const> landmarks;
+    };
+    enum Change : unsigned int { SEARCH_SETTINGS = 0, NETWORK = 1, REGIONS = 2 };
+    mutable std::recursive_mutex writer_mutex;
+    mutable bool network_changed = true;
+    mutable bool regions_changed = true;
+    mutable std::shared_ptr<Snapshot const> snapshot;
+    mutable std::mutex versions_mutex;
+    mutable std::condition_variable build_done;
+    mutable std::condition_variable build_wanted;
+    std::atomic<unsigned long long> changes {0};
+    std::atomic<unsigned long long> published {0};
+    std::atomic<bool> wait_updates {false};
+    mutable unsigned int readers_waiting = 0;
+    std::chrono::steady_clock::time_point first_change;
+    std::chrono::steady_clock::time_point last_change;
+    bool stopping = false;
+    static constexpr std::chrono::milliseconds BUILD_DELAY {10};
+    static constexpr std::chrono::milliseconds BUILD_LIMIT {100};
+    std::thread builder;
+    // A network image opened with open_image. While one is open the snapshots
+    // serve it instead of the stations and trains added, until clear_all
+    std::shared_ptr<Network const> image_network;
+    std::atomic<bool> image_open {false};
+    std::shared_ptr<Snapshot const> current_snapshot() const;
+    void changed(unsigned int parts);
+    void build_snapshots();
+    void publish_snapshot() const;
+    std::string build_network_image(bool with_lookups) const;
+    void build_contraction_hierarchy(Network const& network, ContractionHierarchy& ch) const;
+    void build_landmarks(Network const& network, Landmarks& landmarks) const;
+    std::vector<unsigned int> ch_path(QueryContext& ctx, Snapshot const& snap, unsigned int from, unsigned int to) const;
+    Distance alt_bound(Snapshot const& snap, unsigned int station, unsigned int to) const;
+    void alt_search(QueryContext& ctx, Snapshot const& snap, unsigned int from, unsigned int to) const;
+    std::vector<unsigned int> shortest_path(QueryContext& ctx, Snapshot const& snap, unsigned int from, unsigned int to) const;
+
+
+    void find_children(Region const* r, QueryContext& ctx) const {
         for (auto &i : r->children) {
-            subregions_set.insert(i->region_id);
-            subregions_vec.push_back(i->region_id);
-            find_children(i);
+            ctx.subregions_vec.push_back(i->region_id);
+            find_children(i, ctx);
         }
     }
-    std::unordered_set<RegionID> subregions_set;
-    std::vector<RegionID> subregions_vec;
 
 
-    void common_parent(Region* r) {
-        if (r == NULL) {
+    void common_parent(RegionIndex const& index, RegionID r, QueryContext& ctx) const {
+        if (r == NO_REGION) {
             return;
         }
-        auto find_region = parent_regions_set.find(r->region_id);
+        auto find_region = ctx.parent_regions_set.find(r);
 
-        if (find_region != parent_regions_set.end()) {
-            common_parent_id = r->region_id;
-            has_common = true;
+        if (find_region != ctx.parent_regions_set.end()) {
+            ctx.common_parent_id = r;
+            ctx.has_common = true;
             return;
         }
-        parent_regions_set.insert(r->region_id);
-        common_parent(r->parent);
+        ctx.parent_regions_set.insert(r);
+        common_parent(index, index.parents.at(r), ctx);
     }
-    std::unordered_set<RegionID> parent_regions_set;
-    RegionID common_parent_id;
-    bool has_common;
 
     std::vector<RegionID> no_region_vec {NO_REGION};
 
-    Distance calculate_distance(Coord coord1, Coord coord2) {
+    // The process-wide counter totals at this instance's last reset_operation_counters,
+    // guarded by the counters' mutex in datastructures.cc
+    OperationCounters counters_reset;
+
+    Distance calculate_distance(Coord coord1, Coord coord2) const {
         return sqrt(pow(coord1.x - coord2.x, 2) + pow(coord1.y - coord2.y, 2));
     }
 };
@@ -78,6 +78,8 @@ using std::vector;
 #include <set>
 using std::set;
 
+#include <map>
+
 #include <array>
 using std::array;
 
@@ -112,10 +114,21 @@ using std::back_inserter;
 #include <cstddef>
 #include <cassert>
 
+#include <string_view>
+using std::string_view;
+
+#include <cctype>
+
+#include <thread>
+using std::thread;
+
 
 #include "mainprogram.hh"
 
 #include "datastructures.hh"
+#include "mappedfile.hh"
+#include "memorycounter.hh"
+#include "trace.hh"
 
 #ifdef GRAPHICAL_GUI
 #include "mainwindow.hh"
@@ -158,7 +171,7 @@ void MainProgram::test_station_info()
 {
     if (random_stations_added_ > 0) // Don't do anything if there's no stations
     {
-        auto id = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id = random_test_station();
         test_get_functions(id);
     }
 }
@@ -167,7 +180,7 @@ void MainProgram::test_next_stations_from()
 {
     if (random_stations_added_ > 0) // Don't do anything if there's no stations
     {
-        auto id = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id = random_test_station();
         ds_.next_stations_from(id);
     }
 }
@@ -176,7 +189,7 @@ void MainProgram::test_train_stations_from()
 {
  if (random_stations_added_ > 0 && random_trains_added_ > 0) // Don't do anything if there's no stations or trains
  {
-     auto stationid = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+     auto stationid = random_test_station();
      auto trainid = n_to_trainid(random<decltype(random_trains_added_)>(0, random_trains_added_));
      ds_.train_stations_from(stationid, trainid);
  }
@@ -227,7 +240,7 @@ void MainProgram::test_add_departure()
 {
     if (random_stations_added_ > 0) // Don't do anything if there's no stations
     {
-        auto id = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id = random_test_station();
         auto trainid = n_to_trainid(random<decltype(random_stations_added_)>(0, random_stations_added_));
         auto time = 100*random(0,23) + random(0,59);
         ds_.add_departure(id, trainid, time);
@@ -264,7 +277,7 @@ void MainProgram::test_remove_departure()
     // Note: It's quite improbable that any departure actually gets removed (because of randomness)
     if (random_stations_added_ > 0) // Don't do anything if there's no stations
     {
-        auto id = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id = random_test_station();
         auto trainid = n_to_trainid(random<decltype(random_stations_added_)>(0, random_stations_added_));
         auto time = 100*random(0,23) + random(0,59);
         ds_.remove_departure(id, trainid, time);
@@ -294,9 +307,11 @@ MainProgram::CmdResult MainProgram::cmd_station_departures_after(std::ostream &o
         output << ":" << endl;
         for (auto& [deptime, trainid] : departures)
         {
-            output << " " << trainid << " at ";
-            print_time(deptime, output);
+            out_ << ' ' << trainid << " at ";
+            format_time(deptime, out_);
+            out_ << '\n';
         }
+        out_.flush_to(output);
     }
     else
     {
@@ -314,7 +329,7 @@ void MainProgram::test_station_departures_after()
 {
     if (random_stations_added_ > 0) // Don't do anything if there's no stations
     {
-        auto id = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id = random_test_station();
         auto time = 100*random(0,23) + random(0,59);
         ds_.station_departures_after(id, time);
     }
@@ -328,15 +343,21 @@ MainProgram::CmdResult MainProgram::cmd_add_train(std::ostream& output, MatchIte
 
     CmdResultTrains result;
     std::vector<std::pair<StationID,Time>> stationtimes;
-    smatch stationtime;
-    auto sbeg = stationtimesstr.cbegin();
-    auto send = stationtimesstr.cend();
     StationID prevstation = NO_STATION;
     Time prevtime = NO_TIME;
-    for ( ; regex_search(sbeg, send, stationtime, stationtimes_regex_); sbeg = stationtime.suffix().first)
+    // The parameter match has already checked the list, so it's only split at whitespace and ':'
+    string_view rest = stationtimesstr;
+    while (!rest.empty())
     {
-        StationID stationid = stationtime[1];
-        Time time = convert_string_to<Time>(stationtime[2]);
+        auto item_begin = rest.find_first_not_of(" \t\n\v\f\r");
+        if (item_begin == string_view::npos) { break; }
+        rest.remove_prefix(item_begin);
+        auto item = rest.substr(0, rest.find_first_of(" \t\n\v\f\r"));
+        rest.remove_prefix(item.size());
+        auto colon = item.find(':');
+        StationID stationid(item.substr(0, colon));
+        auto timestr = item.substr(colon + 1);
+        Time time = ((timestr[0] - '0') * 10 + (timestr[1] - '0')) * 100 + (timestr[2] - '0') * 10 + (timestr[3] - '0');
         if (prevstation != NO_STATION)
         {
             result.push_back({trainid, prevstation, stationid, prevtime});
@@ -367,7 +388,7 @@ void MainProgram::test_change_station_coord()
 {
     if (random_stations_added_ > 0) // Don't do anything if there's no stations
     {
-        auto id = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id = random_test_station();
         int x = random<int>(1, 10000);
         int y = random<int>(1, 10000);
         ds_.change_station_coord(id, {x,y});
@@ -478,7 +499,7 @@ void MainProgram::test_station_in_regions()
 {
     if (random_stations_added_ > 0) // Don't do anything if there's no stations
     {
-        auto id = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id = random_test_station();
         ds_.station_in_regions(id);
     }
 }
@@ -516,38 +537,55 @@ void MainProgram::test_remove_station()
     // Choose random number to remove
     if (random_stations_added_ > 0) // Don't remove if there's nothing to remove
     {
-        auto stationid = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto stationid = random_test_station();
         ds_.remove_station(stationid);
     }
 }
 
 void MainProgram::add_random_stations_regions(unsigned int size, Coord min, Coord max)
 {
+    Workload workload;
+    generate_random_stations_regions(workload, size, min, max);
+    replay_workload(workload.begin(), workload.end());
+}
+
+void MainProgram::generate_random_stations_regions(Workload& workload, unsigned int size, Coord min, Coord max)
+{
+    using Kind = WorkloadOp::Kind;
     for (unsigned int i = 0; i < size; ++i)
     {
-        auto name = n_to_name(random_stations_added_);
-        StationID id = n_to_stationid(random_stations_added_);
+        WorkloadOp station;
+        station.kind = Kind::STATION;
+        station.name = n_to_name(random_stations_added_);
+        station.id = n_to_stationid(random_stations_added_);
 
         int x = random<int>(min.x, max.x);
         int y = random<int>(min.y, max.y);
-
-        ds_.add_station(id, name, {x, y});
+        station.xy = {x, y};
+        StationID id = station.id;
+        workload.push_back(std::move(station));
 
         // Add a new region for every 10 stations
         if (random_stations_added_ % 10 == 0)
         {
-            auto regionid = n_to_regionid(random_regions_added_);
-            vector<Coord> coords;
+            WorkloadOp region;
+            region.kind = Kind::REGION;
+            region.region = n_to_regionid(random_regions_added_);
+            region.name = convert_to_string(region.region);
             for (int j=0; j<3; ++j)
             {
-                coords.push_back({random<int>(min.x, max.x),random<int>(min.y, max.y)});
+                region.coords.push_back({random<int>(min.x, max.x),random<int>(min.y, max.y)});
             }
-            ds_.add_region(regionid, convert_to_string(regionid), std::move(coords));
+            auto regionid = region.region;
+            workload.push_back(std::move(region));
             // Add area as subarea so that we get a binary tree
             if (random_regions_added_ > 0)
             {
-                auto parentid = n_to_regionid(random_regions_added_ / 2);
-                ds_.add_subregion_to_region(regionid, parentid);
+                WorkloadOp subregion;
+                subregion.kind = Kind::SUBREGION;
+                subregion.region = regionid;
+                subregion.region2 = n_to_regionid(random_regions_added_ / 2);
+                workload.push_back(std::move(subregion));
             }
             ++random_regions_added_;
         }
@@ -555,8 +593,11 @@ void MainProgram::add_random_stations_regions(unsigned int size, Coord min, Coor
         // With a 50 % chance, add station to random region
         if (random_regions_added_ > 0 && random(0,2) == 0)
         {
-            auto rid = n_to_regionid(random<decltype(random_regions_added_)>(0, random_regions_added_));
-            ds_.add_station_to_region(id, rid);
+            WorkloadOp stationregion;
+            stationregion.kind = Kind::STATION_REGION;
+            stationregion.id = id;
+            stationregion.region = n_to_regionid(random<decltype(random_regions_added_)>(0, random_regions_added_));
+            workload.push_back(std::move(stationregion));
         }
 
         ++random_stations_added_;
@@ -771,20 +812,28 @@ void MainProgram::test_random_trains()
 }
 
 void MainProgram::add_random_trains(unsigned int n)
+{
+    Workload workload;
+    generate_random_trains(workload, n);
+    replay_workload(workload.begin(), workload.end());
+}
+
+void MainProgram::generate_random_trains(Workload& workload, unsigned int n)
 {
     if (random_stations_added_ > 0) // Don't do anything if there's no stations
     {
         for (unsigned int i=0; i<n; ++i)
         {
-            auto trainid = n_to_trainid(random_trains_added_++);
+            WorkloadOp train;
+            train.kind = WorkloadOp::Kind::TRAIN;
+            train.id = n_to_trainid(random_trains_added_++);
             auto stations = random<unsigned int>(2,10);
-            std::vector<std::pair<StationID, Time>> departures;
-            departures.reserve(stations);
+            train.stationtimes.reserve(stations);
             auto time = 100*random(0,23) + random(0,59);
             for (unsigned int j=0; j<stations; ++j)
             {
                 auto stationid = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
-                departures.emplace_back(stationid, time);
+                train.stationtimes.emplace_back(stationid, time);
                 time += random(0,60);
                 if (time % 100 > 59) // Fix if minutes exceed 59
                 {
@@ -795,7 +844,267 @@ void MainProgram::add_random_trains(unsigned int n)
                     time -= 2400;
                 }
             }
-            ds_.add_train(trainid, departures);
+            workload.push_back(std::move(train));
+        }
+    }
+}
+
+void MainProgram::generate_geographic_network(Workload& workload, unsigned int stations, unsigned int trains, Coord min, Coord max)
+{
+    using Kind = WorkloadOp::Kind;
+    if (stations == 0) { return; }
+
+    // Towns of Zipf-distributed sizes, about 50 stations each on average, the largest first
+    unsigned int towncount = std::max(1u, stations / 50);
+    double harmonic = 0;
+    for (unsigned int t = 0; t < towncount; ++t) { harmonic += 1.0 / (t + 1); }
+    vector<unsigned int> townsize(towncount);
+    unsigned int assigned = 0;
+    for (unsigned int t = 0; t < towncount; ++t)
+    {
+        townsize[t] = std::max(1u, static_cast<unsigned int>(stations / harmonic / (t + 1)));
+        assigned += townsize[t];
+    }
+    // Rounding left over to the largest town, which is large enough to give up the one
+    // station each of the smallest towns got rounded up to
+    townsize[0] = static_cast<unsigned int>(static_cast<long long>(townsize[0]) + stations - assigned);
+
+    vector<Coord> centre(towncount);
+    for (auto& c : centre) { c = {random<int>(min.x, max.x), random<int>(min.y, max.y)}; }
+
+    // Towns bucketed in a grid, for finding the nearest larger town of each town
+    unsigned int grid = std::max(1u, static_cast<unsigned int>(std::sqrt(towncount)));
+    auto cellsize_x = std::max(1, (max.x - min.x) / static_cast<int>(grid) + 1);
+    auto cellsize_y = std::max(1, (max.y - min.y) / static_cast<int>(grid) + 1);
+    auto cell_of = [&](Coord c) { return std::make_pair(static_cast<unsigned int>((c.x - min.x) / cellsize_x),
+                                                        static_cast<unsigned int>((c.y - min.y) / cellsize_y)); };
+    vector<vector<unsigned int>> cells(grid * grid);
+    for (unsigned int t = 0; t < towncount; ++t)
+    {
+        auto [cx, cy] = cell_of(centre[t]);
+        cells[std::min(cy, grid - 1) * grid + std::min(cx, grid - 1)].push_back(t);
+    }
+    auto distance2 = [](Coord a, Coord b) { long long dx = a.x - b.x; long long dy = a.y - b.y; return dx * dx + dy * dy; };
+
+    // Each town is linked to the nearest larger town. Rings of grid cells are searched until a
+    // candidate is found, and then one ring more as a nearer one may sit in a corner cell
+    vector<unsigned int> parent(towncount, 0);
+    for (unsigned int t = 1; t < towncount; ++t)
+    {
+        auto [cx, cy] = cell_of(centre[t]);
+        long long best = std::numeric_limits<long long>::max();
+        int foundring = -1;
+        for (int ring = 0; ring < static_cast<int>(grid) && (foundring == -1 || ring <= foundring + 1); ++ring)
+        {
+            for (int y = static_cast<int>(cy) - ring; y <= static_cast<int>(cy) + ring; ++y)
+            {
+                for (int x = static_cast<int>(cx) - ring; x <= static_cast<int>(cx) + ring; ++x)
+                {
+                    if (std::max(std::abs(x - static_cast<int>(cx)), std::abs(y - static_cast<int>(cy))) != ring) { continue; }
+                    if (x < 0 || y < 0 || x >= static_cast<int>(grid) || y >= static_cast<int>(grid)) { continue; }
+                    for (auto other : cells[y * grid + x])
+                    {
+                        if (other >= t) { continue; }
+                        auto d = distance2(centre[t], centre[other]);
+                        if (d < best) { best = d; parent[t] = other; if (foundring == -1) { foundring = ring; } }
+                    }
+                }
+            }
+        }
+    }
+
+    // Regions: one for the whole network, provinces by grid cell and one per town
+    auto add_region = [&](vector<Coord> coords, RegionID parentid) {
+        WorkloadOp region;
+        region.kind = Kind::REGION;
+        region.region = n_to_regionid(random_regions_added_++);
+        region.name = convert_to_string(region.region);
+        region.coords = std::move(coords);
+        auto id = region.region;
+        workload.push_back(std::move(region));
+        if (parentid != NO_REGION)
+        {
+            WorkloadOp subregion;
+            subregion.kind = Kind::SUBREGION;
+            subregion.region = id;
+            subregion.region2 = parentid;
+            workload.push_back(std::move(subregion));
+        }
+        return id;
+    };
+    auto root = add_region({min, {max.x, min.y}, max, {min.x, max.y}}, NO_REGION);
+    unsigned int provincegrid = std::max(1u, static_cast<unsigned int>(std::sqrt(grid)));
+    vector<RegionID> province(provincegrid * provincegrid, NO_REGION);
+
+    // Stations scattered around the town centres. The first station of a town is its main station.
+    // They come after all the regions and before the stations are placed in them, so that a
+    // bulk replay can add them together
+    Workload stationops;
+    Workload memberops;
+    vector<vector<unsigned long int>> townstations(towncount);
+    vector<Coord> coords;
+    coords.reserve(stations);
+    auto firststation = random_stations_added_;
+    std::normal_distribution<double> scatter(0, 1);
+    for (unsigned int t = 0; t < towncount; ++t)
+    {
+        auto spread = 20 * std::sqrt(townsize[t]);
+        auto [cx, cy] = cell_of(centre[t]);
+        auto px = std::min(cx * provincegrid / grid, provincegrid - 1);
+        auto py = std::min(cy * provincegrid / grid, provincegrid - 1);
+        auto& provinceid = province[py * provincegrid + px];
+        if (provinceid == NO_REGION)
+        {
+            auto width = (max.x - min.x) / static_cast<int>(provincegrid) + 1;
+            auto height = (max.y - min.y) / static_cast<int>(provincegrid) + 1;
+            Coord corner{min.x + static_cast<int>(px) * width, min.y + static_cast<int>(py) * height};
+            provinceid = add_region({corner, {corner.x + width, corner.y}, {corner.x + width, corner.y + height},
+                                     {corner.x, corner.y + height}}, root);
+        }
+        auto r = static_cast<int>(2 * spread) + 1;
+        auto townregion = add_region({{centre[t].x - r, centre[t].y - r}, {centre[t].x + r, centre[t].y - r},
+                                      {centre[t].x + r, centre[t].y + r}, {centre[t].x - r, centre[t].y + r}}, provinceid);
+
+        for (unsigned int i = 0; i < townsize[t]; ++i)
+        {
+            Coord xy = centre[t];
+            if (i > 0)
+            {
+                xy.x = std::clamp(static_cast<int>(centre[t].x + spread * scatter(rand_engine_)), min.x, max.x);
+                xy.y = std::clamp(static_cast<int>(centre[t].y + spread * scatter(rand_engine_)), min.y, max.y);
+            }
+            WorkloadOp station;
+            station.kind = Kind::STATION;
+            station.name = n_to_name(random_stations_added_);
+            station.id = n_to_stationid(random_stations_added_);
+            station.xy = xy;
+            WorkloadOp stationregion;
+            stationregion.kind = Kind::STATION_REGION;
+            stationregion.id = station.id;
+            stationregion.region = townregion;
+            stationops.push_back(std::move(station));
+            memberops.push_back(std::move(stationregion));
+            townstations[t].push_back(random_stations_added_);
+            coords.push_back(xy);
+            ++random_stations_added_;
+        }
+    }
+
+    std::move(stationops.begin(), stationops.end(), std::back_inserter(workload));
+    std::move(memberops.begin(), memberops.end(), std::back_inserter(workload));
+
+    // Lines: trunk lines from each town through its larger neighbours towards the largest town,
+    // and local lines from the main station of each town out to its other stations
+    struct Line { vector<unsigned long int> stops; double weight; };
+    vector<Line> lines;
+    for (unsigned int t = 1; t < towncount; ++t)
+    {
+        Line line;
+        double weight = 0;
+        for (unsigned int town = t; line.stops.size() < 8; town = parent[town])
+        {
+            line.stops.push_back(townstations[town].front());
+            weight += townsize[town];
+            if (town == 0) { break; }
+        }
+        line.weight = weight;
+        lines.push_back(std::move(line));
+    }
+    for (unsigned int t = 0; t < towncount; ++t)
+    {
+        auto& local = townstations[t];
+        if (local.size() < 2) { continue; }
+        // Around the centre by angle, so that each line serves one direction out of town
+        auto angle = [&](unsigned long int station) {
+            auto c = coords[station - firststation];
+            return std::atan2(c.y - centre[t].y, c.x - centre[t].x); };
+        std::sort(local.begin() + 1, local.end(), [&](auto a, auto b) { return angle(a) < angle(b); });
+        for (auto pos = local.begin() + 1; pos != local.end(); )
+        {
+            auto length = std::min<std::size_t>(random<unsigned int>(1, 9), local.end() - pos);
+            Line line;
+            line.stops.push_back(local.front());
+            line.stops.insert(line.stops.end(), pos, pos + length);
+            std::sort(line.stops.begin() + 1, line.stops.end(), [&](auto a, auto b) {
+                return distance2(coords[a - firststation], centre[t]) < distance2(coords[b - firststation], centre[t]); });
+            line.weight = std::sqrt(townsize[t]) * length;
+            lines.push_back(std::move(line));
+            pos += length;
+        }
+    }
+    if (lines.empty()) { return; }
+
+    // Trains on the lines in proportion to their weights, in either direction. Travelling takes
+    // a minute plus a minute per 100 units of distance, and every stop a minute
+    vector<double> cumulative;
+    cumulative.reserve(lines.size());
+    double total = 0;
+    for (auto const& line : lines) { total += line.weight; cumulative.push_back(total); }
+    std::uniform_real_distribution<double> pick(0, total);
+    for (unsigned int i = 0; i < trains; ++i)
+    {
+        auto const& line = lines[std::min<std::size_t>(std::upper_bound(cumulative.begin(), cumulative.end(), pick(rand_engine_)) - cumulative.begin(),
+                                                       lines.size() - 1)];
+        bool reverse = (random(0, 2) == 1);
+        WorkloadOp train;
+        train.kind = Kind::TRAIN;
+        train.id = n_to_trainid(random_trains_added_++);
+        train.stationtimes.reserve(line.stops.size());
+        auto minutes = random(0, 24 * 60);
+        unsigned long int previous = 0;
+        for (std::size_t j = 0; j < line.stops.size(); ++j)
+        {
+            auto stop = line.stops[reverse ? line.stops.size() - 1 - j : j];
+            if (j > 0)
+            {
+                minutes += 2 + static_cast<int>(std::sqrt(distance2(coords[stop - firststation], coords[previous - firststation])) / 100);
+            }
+            minutes %= 24 * 60;
+            train.stationtimes.emplace_back(n_to_stationid(stop), static_cast<Time>(minutes / 60 * 100 + minutes % 60));
+            previous = stop;
+        }
+        workload.push_back(std::move(train));
+    }
+}
+
+void MainProgram::replay_workload(Workload::iterator begin, Workload::iterator end, bool bulk)
+{
+    using Kind = WorkloadOp::Kind;
+    vector<std::tuple<StationID, Name, Coord>> stations;
+    vector<pair<TrainID, vector<pair<StationID, Time>>>> trains;
+    for (auto op = begin; op != end; ++op)
+    {
+        // In bulk, runs of stations and trains go through add_stations and add_trains
+        if (bulk && (op->kind == Kind::STATION || op->kind == Kind::TRAIN))
+        {
+            if (op->kind == Kind::STATION) { stations.emplace_back(std::move(op->id), std::move(op->name), op->xy); }
+            else { trains.emplace_back(std::move(op->id), std::move(op->stationtimes)); }
+            auto next = op + 1;
+            if (next == end || next->kind != op->kind)
+            {
+                if (!stations.empty()) { ds_.add_stations(stations); stations.clear(); }
+                if (!trains.empty()) { ds_.add_trains(trains); trains.clear(); }
+            }
+            continue;
+        }
+
+        switch (op->kind)
+        {
+            case Kind::STATION:
+                ds_.add_station(op->id, op->name, op->xy);
+                break;
+            case Kind::REGION:
+                ds_.add_region(op->region, op->name, std::move(op->coords));
+                break;
+            case Kind::SUBREGION:
+                ds_.add_subregion_to_region(op->region, op->region2);
+                break;
+            case Kind::STATION_REGION:
+                ds_.add_station_to_region(op->id, op->region);
+                break;
+            case Kind::TRAIN:
+                ds_.add_train(op->id, std::move(op->stationtimes));
+                break;
         }
     }
 }
@@ -1031,8 +1340,8 @@ void MainProgram::test_route_any()
     if (random_stations_added_ > 0)
     {
         // Choose two random stations
-        auto id1 = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
-        auto id2 = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id1 = random_test_station();
+        auto id2 = random_test_station();
         ds_.route_any(id1, id2);
     }
 }
@@ -1074,8 +1383,8 @@ void MainProgram::test_route_shortest_distance()
     if (random_stations_added_ > 0)
     {
         // Choose two random stations
-        auto id1 = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
-        auto id2 = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id1 = random_test_station();
+        auto id2 = random_test_station();
         ds_.route_shortest_distance(id1, id2);
     }
 }
@@ -1117,8 +1426,8 @@ void MainProgram::test_route_least_stations()
     if (random_stations_added_ > 0)
     {
         // Choose two random stations
-        auto id1 = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
-        auto id2 = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id1 = random_test_station();
+        auto id2 = random_test_station();
         ds_.route_least_stations(id1, id2);
     }
 }
@@ -1184,7 +1493,7 @@ void MainProgram::test_route_with_cycle()
     if (random_stations_added_ > 0)
     {
         // Choose random station
-        auto id = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id = random_test_station();
         ds_.route_with_cycle(id);
     }
 }
@@ -1228,14 +1537,119 @@ void MainProgram::test_route_earliest_arrival()
     if (random_stations_added_ > 0)
     {
         // Choose two random stations
-        auto id1 = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
-        auto id2 = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+        auto id1 = random_test_station();
+        auto id2 = random_test_station();
         auto hours = random(0, 24);
         auto minutes = random(0, 60);
         ds_.route_earliest_arrival(id1, id2, 100*hours+minutes);
     }
 }
 
+MainProgram::CmdResult MainProgram::cmd_route_earliest_arrival_transfers(std::ostream &output, MatchIter begin, MatchIter end)
+{
+    string fromid = *begin++;
+    string toid = *begin++;
+    string starttimestr = *begin++;
+    string maxtransfersstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    Time starttime = convert_string_to<Time>(starttimestr);
+    unsigned int maxtransfers = convert_string_to<unsigned int>(maxtransfersstr);
+    auto front = ds_.route_earliest_arrival_transfers(fromid, toid, starttime, maxtransfers);
+
+    if (front.empty())
+    {
+        output << "No route found!" << endl;
+    }
+    else if (front.front() == make_pair(NO_VALUE, NO_TIME))
+    {
+        output << "Starting or destination station not found!" << endl;
+    }
+    else
+    {
+        output << "Earliest arrivals from ";
+        print_station_brief(fromid, output, false);
+        output << " to ";
+        print_station_brief(toid, output, false);
+        output << " after ";
+        print_time(starttime, output, false);
+        output << ":" << endl;
+        for (auto& [transfers, time] : front)
+        {
+            output << " " << transfers << " transfer(s): arrival at ";
+            print_time(time, output);
+        }
+    }
+
+    return {};
+}
+
+void MainProgram::test_route_earliest_arrival_transfers()
+{
+    if (random_stations_added_ > 0)
+    {
+        // Choose two random stations
+        auto id1 = random_test_station();
+        auto id2 = random_test_station();
+        auto hours = random(0, 24);
+        auto minutes = random(0, 60);
+        ds_.route_earliest_arrival_transfers(id1, id2, 100*hours+minutes, random(0, 4));
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_distance_matrix(std::ostream &output, MatchIter begin, MatchIter end)
+{
+    string sourcesstr = *begin++;
+    string targetsstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    auto split = [](string const& str)
+    {
+        vector<StationID> ids;
+        istringstream istr(str);
+        StationID id;
+        while (getline(istr, id, ';')) { ids.push_back(id); }
+        return ids;
+    };
+    auto sources = split(sourcesstr);
+    auto targets = split(targetsstr);
+
+    auto matrix = ds_.distance_matrix(sources, targets);
+
+    output << "Distances (rows from, columns to):" << endl;
+    output << setw(12) << "";
+    for (auto& target : targets) { output << " " << setw(10) << target; }
+    output << endl;
+    for (unsigned int row = 0; row < matrix.size(); ++row)
+    {
+        output << setw(12) << sources[row];
+        for (auto dist : matrix[row])
+        {
+            if (dist == NO_DISTANCE) { output << " " << setw(10) << "-"; }
+            else { output << " " << setw(10) << dist; }
+        }
+        output << endl;
+    }
+
+    return {};
+}
+
+void MainProgram::test_distance_matrix()
+{
+    if (random_stations_added_ > 0)
+    {
+        // Choose 10 random sources and targets
+        vector<StationID> sources;
+        vector<StationID> targets;
+        for (int i = 0; i < 10; ++i)
+        {
+            sources.push_back(random_test_station());
+            targets.push_back(random_test_station());
+        }
+        ds_.distance_matrix(sources, targets);
+    }
+}
+
 MainProgram::CmdResult MainProgram::cmd_clear_trains(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
 {
     assert( begin == end && "Impossible number of parameters!");
@@ -1253,6 +1667,7 @@ MainProgram::CmdResult MainProgram::cmd_randseed(std::ostream& output, MatchIter
 
     unsigned long int seed = convert_string_to<unsigned long int>(seedstr);
 
+    rand_seed_ = seed;
     rand_engine_.seed(seed);
     init_primes();
 
@@ -1292,356 +1707,2072 @@ MainProgram::CmdResult MainProgram::cmd_read(std::ostream& output, MatchIter beg
     return {};
 }
 
+namespace
+{
+// One line parsed by bulk_read or ingest. Lines the bulk parser doesn't recognise are
+// kept as they are and run through the normal command parser in their turn
+struct BulkCommand
+{
+    enum class Kind { STATION, REGION, SUBREGION, STATION_REGION, TRAIN, DEPARTURE,
+                      REMOVE_DEPARTURE, REMOVE_STATION, OTHER };
+    Kind kind = Kind::OTHER;
+    string id;
+    string id2;
+    RegionID region = NO_REGION;
+    RegionID region2 = NO_REGION;
+    Name name;
+    Coord xy;
+    vector<Coord> coords;
+    vector<pair<StationID, Time>> stationtimes;
+    Time time = NO_TIME;
+    string line;
+};
 
-MainProgram::CmdResult MainProgram::cmd_testread(std::ostream& output, MatchIter begin, MatchIter end)
+// Hand-written scanner for the parameters of the commands in the timetable files,
+// accepting exactly what the parameter regexes of those commands accept
+class BulkScanner
 {
-    string infilename = *begin++;
-    string outfilename = *begin++;
-    assert( begin == end && "Impossible number of parameters!");
+public:
+    explicit BulkScanner(string_view text) : text_(text) {}
 
-    ifstream input(infilename);
-    if (input)
-    {
-        ifstream expected_output(outfilename);
-        if (output)
-        {
-            stringstream actual_output;
-            command_parser(input, actual_output, PromptStyle::NO_NESTING);
+    bool at_end() const { return pos_ == text_.size(); }
 
-            vector<string> actual_lines;
-            while (actual_output)
-            {
-                string line;
-                getline(actual_output, line);
-                if (!actual_output) { break; }
-                actual_lines.push_back(line);
-            }
+    bool space()
+    {
+        auto start = pos_;
+        skip_space();
+        return pos_ > start;
+    }
 
-            vector<string> expected_lines;
-            while (expected_output)
-            {
-                string line;
-                getline(expected_output, line);
-                if (!expected_output) { break; }
-                expected_lines.push_back(line);
-            }
+    bool word(string_view expected)
+    {
+        if (text_.substr(pos_, expected.size()) != expected) { return false; }
+        auto after = pos_ + expected.size();
+        if (after < text_.size() && !is_space(text_[after])) { return false; }
+        pos_ = after;
+        return true;
+    }
 
-            string heading_actual = "Actual output";
-            unsigned int actual_max_length = heading_actual.length();
-            auto actual_max_iter = max_element(actual_lines.cbegin(), actual_lines.cend(),
-                                               [](string s1, string s2){ return s1.length() < s2.length(); });
-            if (actual_max_iter != actual_lines.cend())
-            {
-                actual_max_length = actual_max_iter->length();
-            }
+    bool id(string& result)
+    {
+        auto start = pos_;
+        while (pos_ < text_.size() && (std::isalnum(static_cast<unsigned char>(text_[pos_])) || text_[pos_] == '-')) { ++pos_; }
+        result.assign(text_.substr(start, pos_ - start));
+        return pos_ > start;
+    }
 
-            string heading_expected = "Expected output";
-            unsigned int expected_max_length = heading_expected.length();
-            auto expected_max_iter = std::max_element(expected_lines.cbegin(), expected_lines.cend(),
-                                                    [](string s1, string s2){ return s1.length() < s2.length(); });
-            if (expected_max_iter != expected_lines.cend())
-            {
-                expected_max_length = expected_max_iter->length();
-            }
+    bool number(unsigned long long int& result)
+    {
+        auto start = pos_;
+        result = 0;
+        while (pos_ < text_.size() && std::isdigit(static_cast<unsigned char>(text_[pos_])))
+        {
+            result = result * 10 + (text_[pos_++] - '0');
+        }
+        return pos_ > start && pos_ - start < 19;
+    }
 
-            auto pos_actual = actual_lines.cbegin();
-            auto pos_expected = expected_lines.cbegin();
-            output << "  " << heading_actual << string(actual_max_length - heading_actual.length(), ' ') << " | " << heading_expected << endl;
-            output << "--" << string(actual_max_length, '-') << "-|-" << string(expected_max_length, '-') << endl;
+    bool name(Name& result)
+    {
+        if (pos_ >= text_.size() || text_[pos_] != '"') { return false; }
+        auto start = ++pos_;
+        while (pos_ < text_.size() && (std::isalnum(static_cast<unsigned char>(text_[pos_])) || text_[pos_] == ' ' || text_[pos_] == '-')) { ++pos_; }
+        if (pos_ == start || pos_ >= text_.size() || text_[pos_] != '"') { return false; }
+        result.assign(text_.substr(start, pos_ - start));
+        ++pos_;
+        return true;
+    }
 
-            bool lines_ok = true;
-            while (pos_expected != expected_lines.cend() || pos_actual != actual_lines.cend())
-            {
-                if (pos_expected != expected_lines.cend())
-                {
-                    if (pos_actual != actual_lines.cend())
-                    {
-                        bool ok = (*pos_expected == *pos_actual);
-                        output << (ok ? ' ' : '?') << ' ' << *pos_actual << string(actual_max_length - pos_actual->length(), ' ')
-                               << " | " << *pos_expected << endl;
-                        lines_ok = lines_ok && ok;
-                        ++pos_actual;
-                    }
-                    else
-                    { // Actual output was too short
-                        output << "? " << string(actual_max_length, ' ')
-                               << " | " << *pos_expected << endl;
-                        lines_ok = false;
-                    }
-                    ++pos_expected;
-                }
-                else
-                { // Actual output was too long
-                    output << "? " << *pos_actual << string(actual_max_length - pos_actual->length(), ' ')
-                           << " | " << endl;
-                    lines_ok = false;
-                    ++pos_actual;
-                }
-            }
-            if (lines_ok)
-            {
-                output << "**No differences in output.**" << endl;
-                if (test_status_ == TestStatus::NOT_RUN)
-                {
-                    test_status_ = TestStatus::NO_DIFFS;
-                }
-            }
-            else
-            {
-                output << "**Differences found! (Lines beginning with '?')**" << endl;
-                test_status_ = TestStatus::DIFFS_FOUND;
-            }
+    bool coord(Coord& result)
+    {
+        unsigned long long int x = 0;
+        unsigned long long int y = 0;
+        if (!character('(')) { return false; }
+        skip_space();
+        if (!number(x)) { return false; }
+        skip_space();
+        if (!character(',')) { return false; }
+        skip_space();
+        if (!number(y)) { return false; }
+        skip_space();
+        if (!character(')')) { return false; }
+        if (x > static_cast<unsigned long long int>(std::numeric_limits<int>::max()) ||
+            y > static_cast<unsigned long long int>(std::numeric_limits<int>::max())) { return false; }
+        result = {static_cast<int>(x), static_cast<int>(y)};
+        return true;
+    }
 
-        }
-        else
+    bool time(Time& result)
+    {
+        if (text_.size() - pos_ < 4) { return false; }
+        for (unsigned int i = 0; i < 4; ++i)
         {
-            output << "Cannot open file '" << outfilename << "'!" << endl;
+            if (!std::isdigit(static_cast<unsigned char>(text_[pos_ + i]))) { return false; }
         }
+        int hours = (text_[pos_] - '0') * 10 + (text_[pos_ + 1] - '0');
+        int minutes = (text_[pos_ + 2] - '0') * 10 + (text_[pos_ + 3] - '0');
+        if (hours > 23 || minutes > 59) { return false; }
+        result = hours * 100 + minutes;
+        pos_ += 4;
+        return true;
     }
-    else
+
+    bool character(char c)
     {
-        output << "Cannot open file '" << infilename << "'!" << endl;
+        if (pos_ >= text_.size() || text_[pos_] != c) { return false; }
+        ++pos_;
+        return true;
     }
 
-    return {};
-}
+private:
+    static bool is_space(char c) { return std::isspace(static_cast<unsigned char>(c)); }
+    void skip_space() { while (pos_ < text_.size() && is_space(text_[pos_])) { ++pos_; } }
 
-MainProgram::CmdResult MainProgram::cmd_stopwatch(std::ostream& output, MatchIter begin, MatchIter end)
+    string_view text_;
+    std::size_t pos_ = 0;
+};
+
+bool parse_bulk_command(string_view line, BulkCommand& command)
 {
-    string on = *begin++;
-    string off = *begin++;
-    string next = *begin++;
-    assert(begin == end && "Invalid number of parameters");
+    using Kind = BulkCommand::Kind;
+    BulkScanner scan(line);
+    scan.space();
+    unsigned long long int number = 0;
 
-    if (!on.empty())
+    if (scan.word("add_station"))
     {
-        stopwatch_mode = StopwatchMode::ON;
-        output << "Stopwatch: on" << endl;
+        command.kind = Kind::STATION;
+        return scan.space() && scan.id(command.id) && scan.space() && scan.name(command.name) &&
+                scan.space() && scan.coord(command.xy) && scan.at_end();
     }
-    else if (!off.empty())
+    if (scan.word("add_departure"))
     {
-        stopwatch_mode = StopwatchMode::OFF;
-        output << "Stopwatch: off" << endl;
+        command.kind = Kind::DEPARTURE;
+        return scan.space() && scan.id(command.id) && scan.space() && scan.id(command.id2) &&
+                scan.space() && scan.time(command.time) && scan.at_end();
     }
-    else if (!next.empty())
+    if (scan.word("remove_departure"))
     {
-        stopwatch_mode = StopwatchMode::NEXT;
-        output << "Stopwatch: on for the next command" << endl;
+        command.kind = Kind::REMOVE_DEPARTURE;
+        return scan.space() && scan.id(command.id) && scan.space() && scan.id(command.id2) &&
+                scan.space() && scan.time(command.time) && scan.at_end();
     }
-    else
+    if (scan.word("remove_station"))
     {
-        assert(!"Impossible stopwatch mode!");
+        command.kind = Kind::REMOVE_STATION;
+        return scan.space() && scan.id(command.id) && scan.at_end();
     }
-
-    return {};
-}
-
-std::string MainProgram::print_station_name(StationID id, std::ostream &output, bool nl)
-{
-    try
+    if (scan.word("add_train"))
     {
-        if (id != NO_STATION)
+        command.kind = Kind::TRAIN;
+        if (!(scan.space() && scan.id(command.id))) { return false; }
+        while (!scan.at_end())
         {
-            auto name = ds_.get_station_name(id);
-            if (!name.empty())
-            {
-                output << name;
-            }
-            else
-            {
-                output << "*";
-            }
-
-            ostringstream retstream;
-            retstream << name;
-            if (nl) { output << endl; }
-            return retstream.str();
+            StationID station;
+            Time time = NO_TIME;
+            if (!(scan.space() && scan.id(station) && scan.character(':') && scan.time(time))) { return false; }
+            command.stationtimes.push_back({station, time});
         }
-        else
+        return command.stationtimes.size() >= 2;
+    }
+    if (scan.word("add_region"))
+    {
+        command.kind = Kind::REGION;
+        if (!(scan.space() && scan.number(number) && scan.space() && scan.name(command.name))) { return false; }
+        command.region = number;
+        while (!scan.at_end())
         {
-            output << "--NO_STATION--";
-            if (nl) { output << endl; }
-            return "";
+            Coord xy;
+            if (!(scan.space() && scan.coord(xy))) { return false; }
+            command.coords.push_back(xy);
         }
+        return command.coords.size() >= 3;
     }
-    catch (NotImplemented const& e)
+    if (scan.word("add_subregion_to_region"))
     {
-        output << endl << "NotImplemented while printing station name : " << e.what() << endl;
-        std::cerr << endl << "NotImplemented while printing station name : " << e.what() << endl;
-        return "";
+        command.kind = Kind::SUBREGION;
+        if (!(scan.space() && scan.number(number))) { return false; }
+        command.region = number;
+        if (!(scan.space() && scan.number(number) && scan.at_end())) { return false; }
+        command.region2 = number;
+        return true;
+    }
+    if (scan.word("add_station_to_region"))
+    {
+        command.kind = Kind::STATION_REGION;
+        if (!(scan.space() && scan.id(command.id) && scan.space() && scan.number(number) && scan.at_end())) { return false; }
+        command.region = number;
+        return true;
     }
+    return false;
 }
 
-std::string MainProgram::print_coord(Coord coord, std::ostream& output, bool nl)
+// Parses the lines of one chunk of a file into the chunk's own buffer
+void parse_bulk_chunk(string_view chunk, vector<BulkCommand>& commands, unsigned long int& lines)
 {
-    if (coord != NO_COORD)
-    {
-        output << "(" << coord.x << "," << coord.y << ")";
-        ostringstream retstream;
-        retstream << "(" << coord.x << "," << coord.y << ")";
-        if (nl) { output << endl; }
-        return retstream.str();
-    }
-    else
+    while (!chunk.empty())
     {
-        output << "(--NO_COORD--)";
-        if (nl) { output << endl; }
-        return "";
+        auto end = chunk.find('\n');
+        auto line = chunk.substr(0, end);
+        chunk.remove_prefix(end == string_view::npos ? chunk.size() : end + 1);
+        ++lines;
+
+        while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) { line.remove_suffix(1); }
+        if (line.empty()) { continue; }
+
+        commands.emplace_back();
+        if (!parse_bulk_command(line, commands.back()))
+        {
+            commands.back() = BulkCommand();
+            commands.back().line.assign(line);
+        }
     }
 }
+}
 
-string MainProgram::print_train(TrainID id, std::ostream &output, bool nl)
+MainProgram::CmdResult MainProgram::cmd_bulk_read(std::ostream& output, MatchIter begin, MatchIter end)
 {
-    try
+    string filenames = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    Stopwatch stopwatch;
+    stopwatch.start();
+
+    // Split every file into chunks at line boundaries, a few per thread so that
+    // the threads finish at about the same time
+    unsigned int threads = std::max(1u, thread::hardware_concurrency());
+    vector<std::unique_ptr<MappedFile>> files;
+    vector<string_view> chunks;
+    istringstream filelist(filenames);
+    string filename;
+    while (getline(filelist, filename, ';'))
     {
-        if (id != NO_TRAIN)
+        files.push_back(std::make_unique<MappedFile>(filename));
+        if (!files.back()->is_open())
         {
-            output << id;
-            if (nl) { output << endl; }
+            output << "Cannot open file '" << filename << "'!" << endl;
+            continue;
+        }
+        auto contents = files.back()->contents();
+        std::size_t target = contents.size() / (4 * threads) + 1;
+        while (!contents.empty())
+        {
+            auto cut = contents.find('\n', std::min(target, contents.size()) - 1);
+            cut = (cut == string_view::npos) ? contents.size() : cut + 1;
+            chunks.push_back(contents.substr(0, cut));
+            contents.remove_prefix(cut);
+        }
+    }
 
-            ostringstream retstream;
-            retstream << id;
-            return retstream.str();
+    vector<vector<BulkCommand>> parsed(chunks.size());
+    vector<unsigned long int> lines(chunks.size(), 0);
+    std::atomic<std::size_t> next_chunk {0};
+    auto work = [&]()
+    {
+        for (auto i = next_chunk++; i < chunks.size(); i = next_chunk++)
+        {
+            parse_bulk_chunk(chunks[i], parsed[i], lines[i]);
         }
-        else
+    };
+    vector<thread> workers;
+    for (unsigned int i = 1; i < std::min<std::size_t>(threads, chunks.size()); ++i)
+    {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers) { worker.join(); }
+
+    // Apply the commands in file order, handing runs of the same command to the bulk operations
+    using Kind = BulkCommand::Kind;
+    vector<std::tuple<StationID, Name, Coord>> stations;
+    vector<pair<TrainID, vector<pair<StationID, Time>>>> trains;
+    vector<std::tuple<StationID, TrainID, Time>> departures;
+    unsigned long int added_stations = 0;
+    unsigned long int added_regions = 0;
+    unsigned long int added_trains = 0;
+    unsigned long int added_departures = 0;
+    unsigned long int other_lines = 0;
+    auto flush = [&]()
+    {
+        if (!stations.empty()) { added_stations += ds_.add_stations(stations); stations.clear(); }
+        if (!trains.empty()) { added_trains += ds_.add_trains(trains); trains.clear(); }
+        if (!departures.empty()) { added_departures += ds_.add_departures(departures); departures.clear(); }
+    };
+    Kind previous = Kind::OTHER;
+    for (auto& chunk : parsed)
+    {
+        for (auto& command : chunk)
         {
-            output << "--NO_TRAIN--";
-            if (nl) { output << endl; }
-            return "";
+            if (command.kind != previous) { flush(); }
+            previous = command.kind;
+            switch (command.kind)
+            {
+                case Kind::STATION:
+                    stations.emplace_back(std::move(command.id), std::move(command.name), command.xy);
+                    break;
+                case Kind::TRAIN:
+                    trains.emplace_back(std::move(command.id), std::move(command.stationtimes));
+                    break;
+                case Kind::DEPARTURE:
+                    departures.emplace_back(std::move(command.id), std::move(command.id2), command.time);
+                    break;
+                case Kind::REGION:
+                    if (ds_.add_region(command.region, command.name, command.coords)) { ++added_regions; }
+                    break;
+                case Kind::SUBREGION:
+                    ds_.add_subregion_to_region(command.region, command.region2);
+                    break;
+                case Kind::STATION_REGION:
+                    ds_.add_station_to_region(command.id, command.region);
+                    break;
+                case Kind::REMOVE_DEPARTURE:
+                    ds_.remove_departure(command.id, command.id2, command.time);
+                    break;
+                case Kind::REMOVE_STATION:
+                    ds_.remove_station(command.id);
+                    break;
+                case Kind::OTHER:
+                    ++other_lines;
+                    command_parse_line(command.line, output);
+                    break;
+            }
         }
+        chunk.clear();
     }
-    catch (NotImplemented const& e)
+    flush();
+    stopwatch.stop();
+    view_dirty = true;
+
+    unsigned long int total_lines = 0;
+    for (auto count : lines) { total_lines += count; }
+    output << "Read " << total_lines << " lines in " << stopwatch.elapsed() << " sec using "
+           << threads << " thread(s)" << endl;
+    output << "Added " << added_stations << " stations, " << added_regions << " regions, "
+           << added_trains << " trains and " << added_departures << " departures" << endl;
+    if (other_lines > 0)
     {
-        output << endl << "NotImplemented while printing train : " << e.what() << endl;
-        std::cerr << endl << "NotImplemented while printing train : " << e.what() << endl;
-        return "";
+        output << other_lines << " line(s) were run through the normal command parser" << endl;
     }
+
+    return {};
 }
 
-string MainProgram::print_time(Time time, std::ostream &output, bool nl)
+MainProgram::CmdResult MainProgram::cmd_save_snapshot(std::ostream& output, MatchIter begin, MatchIter end)
 {
-    if (time != NO_TIME)
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    Stopwatch stopwatch;
+    stopwatch.start();
+    bool saved = ds_.save_snapshot(filename);
+    stopwatch.stop();
+
+    if (saved)
     {
-        output << setw(4) << setfill('0') << time;
-        ostringstream retstream;
-        retstream << setw(4) << setfill('0') << time;
-        if (nl) { output << endl; }
-        return retstream.str();
+        output << "Saved snapshot to '" << filename << "' in " << stopwatch.elapsed() << " sec" << endl;
     }
     else
     {
-        output << "(--NO_TIME--)";
-        if (nl) { output << endl; }
-        return "";
+        output << "Cannot write snapshot file '" << filename << "'!" << endl;
     }
-}
 
-string const stationidx = "([a-zA-Z0-9-]+)";
-string const trainidx = "([a-zA-Z0-9-]+)";
-string const regionidx = "([0-9]+)";
-string const namex = "([ a-zA-Z0-9-]+)";
-string const timex = "((?:[01][0-9][0-5][0-9])|(?:2[0-3][0-5][0-9]))";
-string const numx = "([0-9]+)";
-string const optcoordx = "\\([[:space:]]*[0-9]+[[:space:]]*,[[:space:]]*[0-9]+[[:space:]]*\\)";
-string const coordx = "\\([[:space:]]*([0-9]+)[[:space:]]*,[[:space:]]*([0-9]+)[[:space:]]*\\)";
-string const wsx = "[[:space:]]+";
-string const optstationtimeidx = "[a-zA-Z0-9-]+:(?:(?:[01][0-9][0-5][0-9])|(?:2[0-3][0-5][0-9]))";
+    return {};
+}
 
-vector<MainProgram::CmdInfo> MainProgram::cmds_ =
+MainProgram::CmdResult MainProgram::cmd_load_snapshot(std::ostream& output, MatchIter begin, MatchIter end)
 {
-    {"station_count", "", "", &MainProgram::cmd_station_count, nullptr },
-    {"clear_all", "", "", &MainProgram::cmd_clear_all, nullptr },
-    {"all_stations", "", "", &MainProgram::cmd_all_stations, &MainProgram::test_all_stations },
-    {"add_station", "StationID \"Name\" (x,y)", stationidx+wsx+'"'+namex+'"'+wsx+coordx, &MainProgram::cmd_add_station, nullptr },
-    {"station_info", "StationID", stationidx, &MainProgram::cmd_station_info, &MainProgram::test_station_info },
-    {"stations_alphabetically", "", "", &MainProgram::NoParListCmd<&Datastructures::stations_alphabetically>, &MainProgram::NoParListTestCmd<&Datastructures::stations_alphabetically> },
-    {"stations_distance_increasing", "", "", &MainProgram::NoParListCmd<&Datastructures::stations_distance_increasing>,
-                                             &MainProgram::NoParListTestCmd<&Datastructures::stations_distance_increasing> },
-    {"find_station_with_coord", "(x,y)", coordx, &MainProgram::cmd_find_station_with_coord, &MainProgram::test_find_station_with_coord },
-    {"change_station_coord", "StationID (x,y)", stationidx+wsx+coordx, &MainProgram::cmd_change_station_coord, &MainProgram::test_change_station_coord },
-    {"add_departure", "StationID TrainID Time", stationidx+wsx+trainidx+wsx+timex, &MainProgram::cmd_add_departure, &MainProgram::test_add_departure },
-    {"remove_departure", "StationID TrainID Time", stationidx+wsx+trainidx+wsx+timex, &MainProgram::cmd_remove_departure, &MainProgram::test_remove_departure },
-    {"station_departures_after", "StationID Time", stationidx+wsx+timex, &MainProgram::cmd_station_departures_after, &MainProgram::test_station_departures_after },
-//    {"mindist", "", "", &MainProgram::NoParstationCmd<&Datastructures::min_distance>, &MainProgram::NoParstationTestCmd<&Datastructures::min_distance> },
-//    {"maxdist", "", "", &MainProgram::NoParstationCmd<&Datastructures::max_distance>, &MainProgram::NoParstationTestCmd<&Datastructures::max_distance> },
-    {"add_region", "RegionID \"Name\" (x,y) (x,y)...", regionidx+wsx+'"'+namex+'"'+"((?:"+wsx+optcoordx+")+)", &MainProgram::cmd_add_region, nullptr },
-    {"all_regions", "", "", &MainProgram::cmd_all_regions, nullptr },
-    {"region_info", "RegionID", regionidx, &MainProgram::cmd_region_info, &MainProgram::test_region_info },
-    {"add_subregion_to_region", "SubregionID RegionID", regionidx+wsx+regionidx, &MainProgram::cmd_add_subregion_to_region, nullptr },
-    {"add_station_to_region", "StationID RegionID", stationidx+wsx+regionidx, &MainProgram::cmd_add_station_to_region, nullptr },
-    {"station_in_regions", "StationID", stationidx, &MainProgram::cmd_station_in_regions, &MainProgram::test_station_in_regions },
-    {"all_subregions_of_region", "RegionID", regionidx, &MainProgram::cmd_all_subregions_of_region, &MainProgram::test_all_subregions_of_region },
-    {"stations_closest_to", "(x,y)", coordx, &MainProgram::cmd_stations_closest_to, &MainProgram::test_stations_closest_to },
-    {"remove_station", "StationID", stationidx, &MainProgram::cmd_remove_station, &MainProgram::test_remove_station },
-    {"common_parent_of_regions", "RegionID1 RegionID2", regionidx+wsx+regionidx, &MainProgram::cmd_common_parent_of_regions, &MainProgram::test_common_parent_of_regions },
-    {"add_train", "TrainID StationID1:Time1 ... StationIDlast:Timelast", trainidx+"((?:"+wsx+optstationtimeidx+")+)", &MainProgram::cmd_add_train, nullptr },
-    {"next_stations_from", "StationID", stationidx, &MainProgram::cmd_next_stations_from, &MainProgram::test_next_stations_from },
-    {"train_stations_from", "StationID TrainID", stationidx+wsx+trainidx, &MainProgram::cmd_train_stations_from, &MainProgram::test_train_stations_from },
-    {"clear_trains", "", "", &MainProgram::cmd_clear_trains, nullptr },
-    {"route_any", "StationID StationID", stationidx+wsx+stationidx, &MainProgram::cmd_route_any, &MainProgram::test_route_any },
-    {"route_least_stations", "StationID StationID", stationidx+wsx+stationidx, &MainProgram::cmd_route_least_stations, &MainProgram::test_route_least_stations },
-    {"route_with_cycle", "StationID", stationidx, &MainProgram::cmd_route_with_cycle, &MainProgram::test_route_with_cycle },
-    {"route_shortest_distance", "StationID StationID", stationidx+wsx+stationidx, &MainProgram::cmd_route_shortest_distance, &MainProgram::test_route_shortest_distance },
-    {"route_earliest_arrival", "StationID StationID StartTime", stationidx+wsx+stationidx+wsx+timex, &MainProgram::cmd_route_earliest_arrival, &MainProgram::test_route_earliest_arrival },
-    {"quit", "", "", nullptr, nullptr },
-    {"help", "", "", &MainProgram::help_command, nullptr },
-    {"random_stations", "number_of_stations_to_add  (minx,miny) (maxx,maxy) (coordinates optional)",
-     numx+"(?:"+wsx+coordx+wsx+coordx+")?", &MainProgram::cmd_random_stations, &MainProgram::test_random_stations },
-    {"random_trains", "max_number_of_trains_to_add", numx,
-     &MainProgram::cmd_random_trains, &MainProgram::test_random_trains },
-    {"read", "\"in-filename\" [silent]", "\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+"(silent))?", &MainProgram::cmd_read, nullptr },
-    {"testread", "\"in-filename\" \"out-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\""+wsx+"\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_testread, nullptr },
-    {"perftest", "cmd1|all|compulsory[;cmd2...] timeout repeat_count n1[;n2...] (parts in [] are optional, alternatives separated by |)",
-     "([0-9a-zA-Z_]+(?:;[0-9a-zA-Z_]+)*)"+wsx+numx+wsx+numx+wsx+"([0-9]+(?:;[0-9]+)*)", &MainProgram::cmd_perftest, nullptr },
-    {"stopwatch", "on|off|next (alternatives separated by |)", "(?:(on)|(off)|(next))", &MainProgram::cmd_stopwatch, nullptr },
-    {"random_seed", "new-random-seed-integer", numx, &MainProgram::cmd_randseed, nullptr },
-    {"#", "comment text", ".*", &MainProgram::cmd_comment, nullptr },
-};
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
 
-MainProgram::CmdResult MainProgram::help_command(std::ostream& output, MatchIter /*begin*/, MatchIter /*end*/)
+    Stopwatch stopwatch;
+    stopwatch.start();
+    bool loaded = ds_.load_snapshot(filename);
+    stopwatch.stop();
+
+    if (loaded)
+    {
+        view_dirty = true;
+        output << "Loaded snapshot '" << filename << "' in " << stopwatch.elapsed() << " sec: "
+               << ds_.station_count() << " stations" << endl;
+    }
+    else
+    {
+        output << "Cannot load snapshot file '" << filename << "' (missing, damaged or of another version)!" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_save_image(std::ostream& output, MatchIter begin, MatchIter end)
 {
-    output << "Commands:" << endl;
-    for (auto& i : cmds_)
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    Stopwatch stopwatch;
+    stopwatch.start();
+    bool saved = ds_.save_image(filename);
+    stopwatch.stop();
+
+    if (saved)
     {
-        output << "  " << i.cmd << " " << i.info << endl;
+        output << "Saved network image to '" << filename << "' in " << stopwatch.elapsed() << " sec" << endl;
+    }
+    else
+    {
+        output << "Cannot write network image file '" << filename << "'!" << endl;
     }
 
     return {};
 }
 
-MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter begin, MatchIter end)
+MainProgram::CmdResult MainProgram::cmd_open_image(std::ostream& output, MatchIter begin, MatchIter end)
 {
-#ifdef _GLIBCXX_DEBUG
-    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
-#endif // _GLIBCXX_DEBUG
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
 
-    try {
-    // Note: everything below is indented too little by one indentation level! (because of try block above)
+    Stopwatch stopwatch;
+    stopwatch.start();
+    bool opened = ds_.open_image(filename);
+    stopwatch.stop();
 
-    vector<string> optional_cmds({"route_least_stations", "route_with_cycle", "route_shortest_distance", "route_earliest_arrival"});
-    vector<string> nondefault_cmds({"station_count","all_stations","station_info","stations_alphabetically","stations_distance_increasing","find_station_with_coord",
-                                    "change_station_coord","add_departure","remove_departure","region_info","station_in_regions","all_subregions_of_region",
-                                    "stations_closest_to","remove_station","common_parent_of_regions"});
+    if (opened)
+    {
+        view_dirty = true;
+        output << "Opened network image '" << filename << "' in " << stopwatch.elapsed() << " sec: "
+               << ds_.station_count() << " stations (read-only until clear_all)" << endl;
+    }
+    else
+    {
+        output << "Cannot open network image file '" << filename << "' (missing, damaged or of another version)!" << endl;
+    }
 
-    string commandstr = *begin++;
-    unsigned int timeout = convert_string_to<unsigned int>(*begin++);
-    unsigned int repeat_count = convert_string_to<unsigned int>(*begin++);
-    string sizes = *begin++;
-    assert(begin == end && "Invalid number of parameters");
+    return {};
+}
+
+
+MainProgram::CmdResult MainProgram::cmd_testread(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string infilename = *begin++;
+    string outfilename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
 
-    vector<string> testcmds;
-    bool additional_get_cmds = true;
-    if (commandstr != "all" && commandstr != "compulsory")
+    ifstream input(infilename);
+    if (input)
     {
-        additional_get_cmds = false;
-        smatch scmd;
-        auto cbeg = commandstr.cbegin();
-        auto cend = commandstr.cend();
-        for ( ; regex_search(cbeg, cend, scmd, commands_regex_); cbeg = scmd.suffix().first)
+        ifstream expected_output(outfilename);
+        if (output)
         {
-            testcmds.push_back(scmd[1]);
-        }
-    }
+            stringstream actual_output;
+            command_parser(input, actual_output, PromptStyle::NO_NESTING);
+
+            vector<string> actual_lines;
+            while (actual_output)
+            {
+                string line;
+                getline(actual_output, line);
+                if (!actual_output) { break; }
+                actual_lines.push_back(line);
+            }
+
+            vector<string> expected_lines;
+            while (expected_output)
+            {
+                string line;
+                getline(expected_output, line);
+                if (!expected_output) { break; }
+                expected_lines.push_back(line);
+            }
+
+            string heading_actual = "Actual output";
+            unsigned int actual_max_length = heading_actual.length();
+            auto actual_max_iter = max_element(actual_lines.cbegin(), actual_lines.cend(),
+                                               [](string s1, string s2){ return s1.length() < s2.length(); });
+            if (actual_max_iter != actual_lines.cend())
+            {
+                actual_max_length = actual_max_iter->length();
+            }
+
+            string heading_expected = "Expected output";
+            unsigned int expected_max_length = heading_expected.length();
+            auto expected_max_iter = std::max_element(expected_lines.cbegin(), expected_lines.cend(),
+                                                    [](string s1, string s2){ return s1.length() < s2.length(); });
+            if (expected_max_iter != expected_lines.cend())
+            {
+                expected_max_length = expected_max_iter->length();
+            }
+
+            auto pos_actual = actual_lines.cbegin();
+            auto pos_expected = expected_lines.cbegin();
+            output << "  " << heading_actual << string(actual_max_length - heading_actual.length(), ' ') << " | " << heading_expected << endl;
+            output << "--" << string(actual_max_length, '-') << "-|-" << string(expected_max_length, '-') << endl;
+
+            bool lines_ok = true;
+            while (pos_expected != expected_lines.cend() || pos_actual != actual_lines.cend())
+            {
+                if (pos_expected != expected_lines.cend())
+                {
+                    if (pos_actual != actual_lines.cend())
+                    {
+                        bool ok = (*pos_expected == *pos_actual);
+                        output << (ok ? ' ' : '?') << ' ' << *pos_actual << string(actual_max_length - pos_actual->length(), ' ')
+                               << " | " << *pos_expected << endl;
+                        lines_ok = lines_ok && ok;
+                        ++pos_actual;
+                    }
+                    else
+                    { // Actual output was too short
+                        output << "? " << string(actual_max_length, ' ')
+                               << " | " << *pos_expected << endl;
+                        lines_ok = false;
+                    }
+                    ++pos_expected;
+                }
+                else
+                { // Actual output was too long
+                    output << "? " << *pos_actual << string(actual_max_length - pos_actual->length(), ' ')
+                           << " | " << endl;
+                    lines_ok = false;
+                    ++pos_actual;
+                }
+            }
+            if (lines_ok)
+            {
+                output << "**No differences in output.**" << endl;
+                if (test_status_ == TestStatus::NOT_RUN)
+                {
+                    test_status_ = TestStatus::NO_DIFFS;
+                }
+            }
+            else
+            {
+                output << "**Differences found! (Lines beginning with '?')**" << endl;
+                test_status_ = TestStatus::DIFFS_FOUND;
+            }
+
+        }
+        else
+        {
+            output << "Cannot open file '" << outfilename << "'!" << endl;
+        }
+    }
+    else
+    {
+        output << "Cannot open file '" << infilename << "'!" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_stopwatch(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string on = *begin++;
+    string off = *begin++;
+    string next = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!on.empty())
+    {
+        stopwatch_mode = StopwatchMode::ON;
+        output << "Stopwatch: on" << endl;
+    }
+    else if (!off.empty())
+    {
+        stopwatch_mode = StopwatchMode::OFF;
+        output << "Stopwatch: off" << endl;
+    }
+    else if (!next.empty())
+    {
+        stopwatch_mode = StopwatchMode::NEXT;
+        output << "Stopwatch: on for the next command" << endl;
+    }
+    else
+    {
+        assert(!"Impossible stopwatch mode!");
+    }
+
+    return {};
+}
+
+namespace
+{
+// The operation counters of Datastructures in the order they are printed
+using CounterField = unsigned long long Datastructures::OperationCounters::*;
+array<pair<char const*, CounterField>, 7> const counter_fields {{
+    {"hash_probes", &Datastructures::OperationCounters::hash_probes},
+    {"searches", &Datastructures::OperationCounters::searches},
+    {"nodes_visited", &Datastructures::OperationCounters::nodes_visited},
+    {"heap_pushes", &Datastructures::OperationCounters::heap_pushes},
+    {"heap_pops", &Datastructures::OperationCounters::heap_pops},
+    {"index_rebuilds", &Datastructures::OperationCounters::index_rebuilds},
+    {"departures_scanned", &Datastructures::OperationCounters::departures_scanned},
+}};
+}
+
+MainProgram::CmdResult MainProgram::cmd_counters(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string reset = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!reset.empty())
+    {
+        ds_.reset_operation_counters();
+        output << "Operation counters reset" << endl;
+        return {};
+    }
+
+    auto counters = ds_.operation_counters();
+    output << "Operation counters since the last reset:" << endl;
+    for (auto const& [name, field] : counter_fields)
+    {
+        output << "  " << setw(20) << std::left << name << std::right << " " << counters.*field << endl;
+    }
+    if (counters.searches > 0)
+    {
+        output << "  " << setw(20) << std::left << "nodes per search" << std::right << " "
+               << double(counters.nodes_visited) / counters.searches << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_trace(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string on = *begin++;
+    string filename = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!on.empty())
+    {
+        Trace::start();
+        output << "Trace: on" << endl;
+    }
+    else
+    {
+        auto spans = Trace::stop();
+        if (!Trace::write(filename))
+        {
+            output << "Cannot write file '" << filename << "'!" << endl;
+            return {};
+        }
+        output << "Trace: off, " << spans << " spans written to '" << filename << "'" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_stats(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string reset = *begin++;
+    string filename = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!reset.empty())
+    {
+        cmd_latency_.assign(cmds_.size(), LatencyHistogram());
+        output << "Command latency statistics cleared" << endl;
+    }
+    else if (!filename.empty())
+    {
+        std::ofstream file(filename);
+        print_latency_stats(file, true);
+        if (file) { output << "Wrote command latency statistics to '" << filename << "'" << endl; }
+        else { output << "Cannot write file '" << filename << "'!" << endl; }
+    }
+    else
+    {
+        print_latency_stats(output, false);
+    }
+
+    return {};
+}
+
+void MainProgram::print_latency_stats(std::ostream& output, bool csv)
+{
+    output << setfill(' ');
+    if (csv)
+    {
+        output << "command,count,mean_us,p50_us,p90_us,p99_us,max_us" << endl;
+    }
+    else
+    {
+        output << "Command latencies in microseconds since start or 'stats reset':" << endl;
+        output << setw(32) << std::left << "command" << std::right << setw(10) << "count" << setw(12) << "mean"
+               << setw(12) << "p50" << setw(12) << "p90" << setw(12) << "p99" << setw(12) << "max" << endl;
+    }
+
+    vector<std::size_t> order;
+    for (std::size_t i = 0; i < cmds_.size(); ++i)
+    {
+        if (cmd_latency_[i].count() > 0) { order.push_back(i); }
+    }
+    std::sort(order.begin(), order.end(), [](std::size_t a, std::size_t b) { return cmds_[a].cmd < cmds_[b].cmd; });
+
+    for (auto i : order)
+    {
+        print_latency_row(output, cmds_[i].cmd, cmd_latency_[i], csv);
+    }
+    if (order.empty() && !csv)
+    {
+        output << "No commands run yet" << endl;
+    }
+}
+
+void MainProgram::print_latency_row(std::ostream& output, std::string const& name, LatencyHistogram const& histogram, bool csv)
+{
+    // Microseconds with a fixed number of decimals, as the values span several magnitudes
+    auto us = [](double ns) { ostringstream text; text << std::fixed << std::setprecision(1) << ns / 1000; return text.str(); };
+
+    if (csv)
+    {
+        output << name << "," << histogram.count() << "," << us(histogram.mean()) << ","
+               << us(histogram.quantile(0.5)) << "," << us(histogram.quantile(0.9)) << ","
+               << us(histogram.quantile(0.99)) << "," << us(histogram.max()) << endl;
+    }
+    else
+    {
+        output << setw(32) << std::left << name << std::right << setw(10) << histogram.count()
+               << setw(12) << us(histogram.mean()) << setw(12) << us(histogram.quantile(0.5))
+               << setw(12) << us(histogram.quantile(0.9)) << setw(12) << us(histogram.quantile(0.99))
+               << setw(12) << us(histogram.max()) << endl;
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_random_network(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string stationstr = *begin++;
+    string trainstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    unsigned int stations = convert_string_to<unsigned int>(stationstr);
+    unsigned int trains = convert_string_to<unsigned int>(trainstr);
+
+    Workload workload;
+    generate_geographic_network(workload, stations, trains);
+    replay_workload(workload.begin(), workload.end(), true);
+
+    output << "Added: " << stations << " stations and " << trains << " trains." << endl;
+
+    view_dirty = true;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_perftest_network(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string uniform = *begin++;
+    string geographic = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    geographic_perftest_ = uniform.empty();
+    output << "Perftest network: " << (geographic_perftest_ ? "geographic" : "uniform") << endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_parser(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string fast = *begin++;
+    string regexonly = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    use_regex_parser_ = fast.empty();
+    output << "Command parser: " << (use_regex_parser_ ? "regex" : "fast") << endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_contraction_hierarchy(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string on = *begin++;
+    string off = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    ds_.use_contraction_hierarchy(!on.empty());
+    output << "Contraction hierarchy: " << (!on.empty() ? "on" : "off") << endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_landmarks(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    unsigned int count = convert_string_to<unsigned int>(*begin++);
+    assert(begin == end && "Invalid number of parameters");
+
+    ds_.use_landmarks(count);
+    if (count == 0)
+    {
+        output << "Landmarks: off" << endl;
+    }
+    else
+    {
+        output << "Landmarks: " << count << ", tables take " << ds_.landmark_table_bytes() << " bytes" << endl;
+    }
+
+    return {};
+}
+
+std::string MainProgram::print_station_name(StationID id, std::ostream &output, bool nl)
+{
+    try
+    {
+        if (id != NO_STATION)
+        {
+            auto name = ds_.get_station_name(id);
+            if (!name.empty())
+            {
+                output << name;
+            }
+            else
+            {
+                output << "*";
+            }
+
+            ostringstream retstream;
+            retstream << name;
+            if (nl) { output << endl; }
+            return retstream.str();
+        }
+        else
+        {
+            output << "--NO_STATION--";
+            if (nl) { output << endl; }
+            return "";
+        }
+    }
+    catch (NotImplemented const& e)
+    {
+        output << endl << "NotImplemented while printing station name : " << e.what() << endl;
+        std::cerr << endl << "NotImplemented while printing station name : " << e.what() << endl;
+        return "";
+    }
+}
+
+std::string MainProgram::print_coord(Coord coord, std::ostream& output, bool nl)
+{
+    if (coord != NO_COORD)
+    {
+        output << "(" << coord.x << "," << coord.y << ")";
+        ostringstream retstream;
+        retstream << "(" << coord.x << "," << coord.y << ")";
+        if (nl) { output << endl; }
+        return retstream.str();
+    }
+    else
+    {
+        output << "(--NO_COORD--)";
+        if (nl) { output << endl; }
+        return "";
+    }
+}
+
+string MainProgram::print_train(TrainID id, std::ostream &output, bool nl)
+{
+    try
+    {
+        if (id != NO_TRAIN)
+        {
+            output << id;
+            if (nl) { output << endl; }
+
+            ostringstream retstream;
+            retstream << id;
+            return retstream.str();
+        }
+        else
+        {
+            output << "--NO_TRAIN--";
+            if (nl) { output << endl; }
+            return "";
+        }
+    }
+    catch (NotImplemented const& e)
+    {
+        output << endl << "NotImplemented while printing train : " << e.what() << endl;
+        std::cerr << endl << "NotImplemented while printing train : " << e.what() << endl;
+        return "";
+    }
+}
+
+string MainProgram::print_time(Time time, std::ostream &output, bool nl)
+{
+    if (time != NO_TIME)
+    {
+        output << setw(4) << setfill('0') << time;
+        ostringstream retstream;
+        retstream << setw(4) << setfill('0') << time;
+        if (nl) { output << endl; }
+        return retstream.str();
+    }
+    else
+    {
+        output << "(--NO_TIME--)";
+        if (nl) { output << endl; }
+        return "";
+    }
+}
+
+void MainProgram::format_station(StationID const& id, OutputBuffer& out)
+{
+    try
+    {
+        if (id != NO_STATION)
+        {
+            auto name = ds_.get_station_name(id);
+            auto xy = ds_.get_station_coordinates(id);
+            if (!name.empty()) { out << name << ": "; }
+            else { out << "*: "; }
+
+            out << "pos=";
+            if (xy != NO_COORD) { out << '(' << xy.x << ',' << xy.y << ')'; }
+            else { out << "(--NO_COORD--)"; }
+            out << ", id=" << id << '\n';
+        }
+        else
+        {
+            out << "--NO_STATION--\n";
+        }
+    }
+    catch (NotImplemented const& e)
+    {
+        out << "\nNotImplemented while printing station : " << e.what() << '\n';
+        std::cerr << endl << "NotImplemented while printing station : " << e.what() << endl;
+    }
+}
+
+void MainProgram::format_station_brief(StationID const& id, OutputBuffer& out)
+{
+    try
+    {
+        if (id != NO_STATION)
+        {
+            auto name = ds_.get_station_name(id);
+            if (!name.empty()) { out << name << ' '; }
+            else { out << "* "; }
+            out << '(' << id << ')';
+        }
+        else
+        {
+            out << "--NO_STATION--";
+        }
+    }
+    catch (NotImplemented const& e)
+    {
+        out << "\nNotImplemented while printing station : " << e.what() << '\n';
+        std::cerr << endl << "NotImplemented while printing station : " << e.what() << endl;
+    }
+}
+
+void MainProgram::format_region(RegionID id, OutputBuffer& out)
+{
+    try
+    {
+        if (id != NO_REGION)
+        {
+            auto name = ds_.get_region_name(id);
+            if (!name.empty()) { out << name << ": "; }
+            else { out << "*: "; }
+            out << "id=" << id << '\n';
+        }
+        else
+        {
+            out << "--NO_REGION--\n";
+        }
+    }
+    catch (NotImplemented const& e)
+    {
+        out << "\nNotImplemented while printing region : " << e.what() << '\n';
+        std::cerr << endl << "NotImplemented while printing region : " << e.what() << endl;
+    }
+}
+
+void MainProgram::format_time(Time time, OutputBuffer& out)
+{
+    if (time != NO_TIME) { out.padded(time, 4); }
+    else { out << "(--NO_TIME--)"; }
+}
+
+string const stationidx = "([a-zA-Z0-9-]+)";
+string const trainidx = "([a-zA-Z0-9-]+)";
+string const regionidx = "([0-9]+)";
+string const namex = "([ a-zA-Z0-9-]+)";
+string const timex = "((?:[01][0-9][0-5][0-9])|(?:2[0-3][0-5][0-9]))";
+string const numx = "([0-9]+)";
+string const optcoordx = "\\([[:space:]]*[0-9]+[[:space:]]*,[[:space:]]*[0-9]+[[:space:]]*\\)";
+string const coordx = "\\([[:space:]]*([0-9]+)[[:space:]]*,[[:space:]]*([0-9]+)[[:space:]]*\\)";
+string const wsx = "[[:space:]]+";
+string const optstationtimeidx = "[a-zA-Z0-9-]+:(?:(?:[01][0-9][0-5][0-9])|(?:2[0-3][0-5][0-9]))";
+
+vector<MainProgram::CmdInfo> MainProgram::cmds_ =
+{
+    {"station_count", "", "", &MainProgram::cmd_station_count, nullptr },
+    {"clear_all", "", "", &MainProgram::cmd_clear_all, nullptr },
+    {"all_stations", "", "", &MainProgram::cmd_all_stations, &MainProgram::test_all_stations },
+    {"add_station", "StationID \"Name\" (x,y)", stationidx+wsx+'"'+namex+'"'+wsx+coordx, &MainProgram::cmd_add_station, nullptr },
+    {"station_info", "StationID", stationidx, &MainProgram::cmd_station_info, &MainProgram::test_station_info },
+    {"stations_alphabetically", "", "", &MainProgram::NoParListCmd<&Datastructures::stations_alphabetically>, &MainProgram::NoParListTestCmd<&Datastructures::stations_alphabetically> },
+    {"stations_distance_increasing", "", "", &MainProgram::NoParListCmd<&Datastructures::stations_distance_increasing>,
+                                             &MainProgram::NoParListTestCmd<&Datastructures::stations_distance_increasing> },
+    {"find_station_with_coord", "(x,y)", coordx, &MainProgram::cmd_find_station_with_coord, &MainProgram::test_find_station_with_coord },
+    {"change_station_coord", "StationID (x,y)", stationidx+wsx+coordx, &MainProgram::cmd_change_station_coord, &MainProgram::test_change_station_coord },
+    {"add_departure", "StationID TrainID Time", stationidx+wsx+trainidx+wsx+timex, &MainProgram::cmd_add_departure, &MainProgram::test_add_departure },
+    {"remove_departure", "StationID TrainID Time", stationidx+wsx+trainidx+wsx+timex, &MainProgram::cmd_remove_departure, &MainProgram::test_remove_departure },
+    {"station_departures_after", "StationID Time", stationidx+wsx+timex, &MainProgram::cmd_station_departures_after, &MainProgram::test_station_departures_after },
+//    {"mindist", "", "", &MainProgram::NoParstationCmd<&Datastructures::min_distance>, &MainProgram::NoParstationTestCmd<&Datastructures::min_distance> },
+//    {"maxdist", "", "", &MainProgram::NoParstationCmd<&Datastructures::max_distance>, &MainProgram::NoParstationTestCmd<&Datastructures::max_distance> },
+    {"add_region", "RegionID \"Name\" (x,y) (x,y)...", regionidx+wsx+'"'+namex+'"'+"((?:"+wsx+optcoordx+")+)", &MainProgram::cmd_add_region, nullptr },
+    {"all_regions", "", "", &MainProgram::cmd_all_regions, nullptr },
+    {"region_info", "RegionID", regionidx, &MainProgram::cmd_region_info, &MainProgram::test_region_info },
+    {"add_subregion_to_region", "SubregionID RegionID", regionidx+wsx+regionidx, &MainProgram::cmd_add_subregion_to_region, nullptr },
+    {"add_station_to_region", "StationID RegionID", stationidx+wsx+regionidx, &MainProgram::cmd_add_station_to_region, nullptr },
+    {"station_in_regions", "StationID", stationidx, &MainProgram::cmd_station_in_regions, &MainProgram::test_station_in_regions },
+    {"all_subregions_of_region", "RegionID", regionidx, &MainProgram::cmd_all_subregions_of_region, &MainProgram::test_all_subregions_of_region },
+    {"stations_closest_to", "(x,y)", coordx, &MainProgram::cmd_stations_closest_to, &MainProgram::test_stations_closest_to },
+    {"remove_station", "StationID", stationidx, &MainProgram::cmd_remove_station, &MainProgram::test_remove_station },
+    {"common_parent_of_regions", "RegionID1 RegionID2", regionidx+wsx+regionidx, &MainProgram::cmd_common_parent_of_regions, &MainProgram::test_common_parent_of_regions },
+    {"add_train", "TrainID StationID1:Time1 ... StationIDlast:Timelast", trainidx+"((?:"+wsx+optstationtimeidx+")+)", &MainProgram::cmd_add_train, nullptr },
+    {"next_stations_from", "StationID", stationidx, &MainProgram::cmd_next_stations_from, &MainProgram::test_next_stations_from },
+    {"train_stations_from", "StationID TrainID", stationidx+wsx+trainidx, &MainProgram::cmd_train_stations_from, &MainProgram::test_train_stations_from },
+    {"clear_trains", "", "", &MainProgram::cmd_clear_trains, nullptr },
+    {"route_any", "StationID StationID", stationidx+wsx+stationidx, &MainProgram::cmd_route_any, &MainProgram::test_route_any },
+    {"route_least_stations", "StationID StationID", stationidx+wsx+stationidx, &MainProgram::cmd_route_least_stations, &MainProgram::test_route_least_stations },
+    {"route_with_cycle", "StationID", stationidx, &MainProgram::cmd_route_with_cycle, &MainProgram::test_route_with_cycle },
+    {"route_shortest_distance", "StationID StationID", stationidx+wsx+stationidx, &MainProgram::cmd_route_shortest_distance, &MainProgram::test_route_shortest_distance },
+    {"route_earliest_arrival", "StationID StationID StartTime", stationidx+wsx+stationidx+wsx+timex, &MainProgram::cmd_route_earliest_arrival, &MainProgram::test_route_earliest_arrival },
+    {"route_earliest_arrival_transfers", "StationID StationID StartTime MaxTransfers", stationidx+wsx+stationidx+wsx+timex+wsx+numx,
+     &MainProgram::cmd_route_earliest_arrival_transfers, &MainProgram::test_route_earliest_arrival_transfers },
+    {"distance_matrix", "StationID1[;StationID2...] StationID1[;StationID2...] (parts in [] are optional)",
+     "([a-zA-Z0-9-]+(?:;[a-zA-Z0-9-]+)*)"+wsx+"([a-zA-Z0-9-]+(?:;[a-zA-Z0-9-]+)*)", &MainProgram::cmd_distance_matrix, &MainProgram::test_distance_matrix },
+    {"quit", "", "", nullptr, nullptr },
+    {"help", "", "", &MainProgram::help_command, nullptr },
+    {"random_stations", "number_of_stations_to_add  (minx,miny) (maxx,maxy) (coordinates optional)",
+     numx+"(?:"+wsx+coordx+wsx+coordx+")?", &MainProgram::cmd_random_stations, &MainProgram::test_random_stations },
+    {"random_trains", "max_number_of_trains_to_add", numx,
+     &MainProgram::cmd_random_trains, &MainProgram::test_random_trains },
+    {"random_network", "number_of_stations number_of_trains", numx+wsx+numx, &MainProgram::cmd_random_network, nullptr },
+    {"read", "\"in-filename\" [silent]", "\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+"(silent))?", &MainProgram::cmd_read, nullptr },
+    {"bulk_read", "\"in-filename1[;in-filename2...]\" (parts in [] are optional)", "\"([-a-zA-Z0-9 ./:_;]+)\"", &MainProgram::cmd_bulk_read, nullptr },
+    {"save_snapshot", "\"out-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_save_snapshot, nullptr },
+    {"load_snapshot", "\"in-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_load_snapshot, nullptr },
+    {"save_image", "\"out-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_save_image, nullptr },
+    {"open_image", "\"in-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_open_image, nullptr },
+    {"testread", "\"in-filename\" \"out-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\""+wsx+"\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_testread, nullptr },
+    {"perftest", "cmd1|all|compulsory[;cmd2...] timeout repeat_count n1[;n2...] [csv \"out-filename\"] [threads t1[;t2...]] (parts in [] are optional, alternatives separated by |)",
+     "([0-9a-zA-Z_]+(?:;[0-9a-zA-Z_]+)*)"+wsx+numx+wsx+numx+wsx+"([0-9]+(?:;[0-9]+)*)(?:"+wsx+"csv"+wsx+"\"([-a-zA-Z0-9 ./:_]+)\")?"
+     "(?:"+wsx+"threads"+wsx+"([0-9]+(?:;[0-9]+)*))?",
+     &MainProgram::cmd_perftest, nullptr },
+    {"perftest_mix", "cmd1:weight1[;cmd2:weight2...] N seconds ops_per_sec [zipf_exponent] (parts in [] are optional, 0 ops_per_sec runs unpaced)",
+     "([0-9a-zA-Z_]+:[0-9]+(?:;[0-9a-zA-Z_]+:[0-9]+)*)"+wsx+numx+wsx+numx+wsx+numx+"(?:"+wsx+"([0-9]+(?:\\.[0-9]+)?))?",
+     &MainProgram::cmd_perftest_mix, nullptr },
+    {"perftest_compare", "\"baseline-filename\" \"new-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\""+wsx+"\"([-a-zA-Z0-9 ./:_]+)\"",
+     &MainProgram::cmd_perftest_compare, nullptr },
+    {"perftest_fit", "cmd1|all|compulsory[;cmd2...] timeout repeat_count n1;n2;n3[;n4...] (parts in [] are optional, alternatives separated by |)",
+     "([0-9a-zA-Z_]+(?:;[0-9a-zA-Z_]+)*)"+wsx+numx+wsx+numx+wsx+"([0-9]+(?:;[0-9]+)*)", &MainProgram::cmd_perftest_fit, nullptr },
+    {"perftest_ch", "n1[;n2...] query_count (parts in [] are optional)",
+     "([0-9]+(?:;[0-9]+)*)"+wsx+numx, &MainProgram::cmd_perftest_ch, nullptr },
+    {"stopwatch", "on|off|next (alternatives separated by |)", "(?:(on)|(off)|(next))", &MainProgram::cmd_stopwatch, nullptr },
+    {"counters", "[reset] (parts in [] are optional)", "(reset)?", &MainProgram::cmd_counters, nullptr },
+    {"trace", "on|off \"out-filename\" (alternatives separated by |)", "(?:(on)|off"+wsx+"\"([-a-zA-Z0-9 ./:_]+)\")",
+     &MainProgram::cmd_trace, nullptr },
+    {"stats", "[reset|csv \"out-filename\"] (parts in [] are optional, alternatives separated by |)",
+     "(?:(reset)|csv"+wsx+"\"([-a-zA-Z0-9 ./:_]+)\")?", &MainProgram::cmd_stats, nullptr },
+    {"perftest_network", "uniform|geographic (alternatives separated by |)", "(?:(uniform)|(geographic))", &MainProgram::cmd_perftest_network, nullptr },
+    {"parser", "fast|regex (alternatives separated by |)", "(?:(fast)|(regex))", &MainProgram::cmd_parser, nullptr },
+    {"contraction_hierarchy", "on|off (alternatives separated by |)", "(?:(on)|(off))", &MainProgram::cmd_contraction_hierarchy, nullptr },
+    {"landmarks", "number_of_landmarks (0 = off)", numx, &MainProgram::cmd_landmarks, nullptr },
+    {"random_seed", "new-random-seed-integer", numx, &MainProgram::cmd_randseed, nullptr },
+    {"#", "comment text", ".*", &MainProgram::cmd_comment, nullptr },
+};
+
+MainProgram::CmdResult MainProgram::help_command(std::ostream& output, MatchIter /*begin*/, MatchIter /*end*/)
+{
+    output << "Commands:" << endl;
+    for (auto& i : cmds_)
+    {
+        output << "  " << i.cmd << " " << i.info << endl;
+    }
+
+    return {};
+}
+
+namespace
+{
+// Mean and variance of the call times, updated one call at a time (Welford's method)
+struct RunningStats
+{
+    unsigned long int count = 0;
+    double mean = 0;
+    double m2 = 0;
+
+    void add(double value)
+    {
+        ++count;
+        auto delta = value - mean;
+        mean += delta / count;
+        m2 += delta * (value - mean);
+    }
+
+    double stddev() const { return (count > 1) ? std::sqrt(m2 / (count - 1)) : 0; }
+};
+
+// The batch query form of a command, for the commands Datastructures::run_queries can answer.
+// route_any is left out, as it finds the same route as route_shortest_distance
+bool query_kind(string const& command, Datastructures::QueryKind& kind)
+{
+    using Kind = Datastructures::QueryKind;
+    static array<pair<char const*, Kind>, 6> const kinds {{
+        {"station_departures_after", Kind::STATION_DEPARTURES_AFTER},
+        {"route_shortest_distance", Kind::ROUTE_SHORTEST_DISTANCE},
+        {"route_earliest_arrival", Kind::ROUTE_EARLIEST_ARRIVAL},
+        {"route_with_cycle", Kind::ROUTE_WITH_CYCLE},
+        {"station_in_regions", Kind::STATION_IN_REGIONS},
+        {"common_parent_of_regions", Kind::COMMON_PARENT_OF_REGIONS},
+    }};
+    auto found = std::find_if(kinds.begin(), kinds.end(), [&command](auto const& k) { return command == k.first; });
+    if (found == kinds.end()) { return false; }
+    kind = found->second;
+    return true;
+}
+}
+
+vector<pair<string, void(MainProgram::*)()>> MainProgram::perftest_functions(string const& commandstr, ostream& output)
+{
+    vector<string> optional_cmds({"route_least_stations", "route_with_cycle", "route_shortest_distance", "route_earliest_arrival",
+                                  "route_earliest_arrival_transfers", "distance_matrix"});
+    vector<string> nondefault_cmds({"station_count","all_stations","station_info","stations_alphabetically","stations_distance_increasing","find_station_with_coord",
+                                    "change_station_coord","add_departure","remove_departure","region_info","station_in_regions","all_subregions_of_region",
+                                    "stations_closest_to","remove_station","common_parent_of_regions"});
+
+    vector<pair<string, void(MainProgram::*)()>> testfuncs;
+    if (commandstr == "all" || commandstr == "compulsory")
+    { // Add all commands
+        for (auto& i : cmds_)
+        {
+            if (i.testfunc)
+            {
+                if (find(nondefault_cmds.begin(), nondefault_cmds.end(), i.cmd) == nondefault_cmds.end() &&
+                    (commandstr == "all" || find(optional_cmds.begin(), optional_cmds.end(), i.cmd) == optional_cmds.end()))
+                {
+                    output << i.cmd << " ";
+                    testfuncs.emplace_back(i.cmd, i.testfunc);
+                }
+            }
+        }
+    }
+    else
+    {
+        smatch scmd;
+        auto cbeg = commandstr.cbegin();
+        auto cend = commandstr.cend();
+        for ( ; regex_search(cbeg, cend, scmd, commands_regex_); cbeg = scmd.suffix().first)
+        {
+            string i = scmd[1];
+            auto pos = find_if(cmds_.begin(), cmds_.end(), [&i](auto const& cmd){ return cmd.cmd == i; });
+            if (pos != cmds_.end() && pos->testfunc)
+            {
+                output << i << " ";
+                testfuncs.emplace_back(i, pos->testfunc);
+            }
+            else
+            {
+                output << "(cannot test " << i << ") ";
+            }
+        }
+    }
+
+    return testfuncs;
+}
+
+MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter begin, MatchIter end)
+{
+#ifdef _GLIBCXX_DEBUG
+    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
+#endif // _GLIBCXX_DEBUG
+
+    try {
+    // Note: everything below is indented too little by one indentation level! (because of try block above)
+
+    string commandstr = *begin++;
+    unsigned int timeout = convert_string_to<unsigned int>(*begin++);
+    unsigned int repeat_count = convert_string_to<unsigned int>(*begin++);
+    string sizes = *begin++;
+    string csvname = *begin++;
+    string threadlist = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    bool additional_get_cmds = (commandstr == "all" || commandstr == "compulsory");
+
+    // With a CSV file every call is timed separately, for perftest_compare. The random
+    // numbers start over from the seed, so that the run can be repeated with random_seed
+    std::ofstream csv;
+    if (!csvname.empty())
+    {
+        csv.open(csvname);
+        if (!csv)
+        {
+            output << "Cannot write file '" << csvname << "'!" << endl;
+            return {};
+        }
+        rand_engine_.seed(rand_seed_);
+        csv << "seed,n,phase,command,calls,seconds,mean_sec,stddev_sec,live_bytes,allocs,peak_rss_kb";
+#ifdef USE_PERF_EVENT
+        csv << ",cycles,instructions,l1d_misses,llc_misses,branch_misses";
+#endif
+        csv << endl;
+    }
+
+    vector<unsigned int> init_ns;
+    smatch size;
+    auto sbeg = sizes.cbegin();
+    auto send = sizes.cend();
+    for ( ; regex_search(sbeg, send, size, sizes_regex_); sbeg = size.suffix().first)
+    {
+        init_ns.push_back(convert_string_to<unsigned int>(size[1]));
+    }
+
+    output << "Timeout for each N is " << timeout << " sec. " << endl;
+    output << "For each N perform " << repeat_count << " random command(s) from:" << endl;
+
+    // Initialize test functions
+    auto testfuncs = perftest_functions(commandstr, output);
+    output << endl << endl;
+
+    if (testfuncs.empty())
+    {
+        output << "No commands to test!" << endl;
+        return {};
+    }
+
+    // With a list of thread counts the commands that can run concurrently are also run as
+    // batch queries, against the same data, on each number of threads
+    vector<unsigned int> threadcounts;
+    smatch threadcount;
+    for (auto tbeg = threadlist.cbegin(); regex_search(tbeg, threadlist.cend(), threadcount, sizes_regex_); tbeg = threadcount.suffix().first)
+    {
+        threadcounts.push_back(std::max(1u, convert_string_to<unsigned int>(threadcount[1])));
+    }
+    if (!threadcounts.empty())
+    {
+        string sequential;
+        for (auto const& testfunc : testfuncs)
+        {
+            Datastructures::QueryKind kind;
+            if (!query_kind(testfunc.first, kind)) { sequential += " " + testfunc.first; }
+        }
+        if (!sequential.empty())
+        {
+            output << "Left out of the thread runs, as run_queries doesn't take them:" << sequential << endl;
+        }
+    }
+
+    // Span names for the trace come from the command table, which outlives the test functions
+    vector<char const*> spannames;
+    for (auto const& testfunc : testfuncs)
+    {
+        auto index = find_command(testfunc.first);
+        spannames.push_back((index != NO_COMMAND) ? cmds_[index].cmd.c_str() : "perftest");
+    }
+
+#ifdef USE_PERF_EVENT
+    // Counters are reported for the commands, when at least some of them can be opened
+    bool counting = Stopwatch(true).counting();
+    if (!counting)
+    {
+        output << "No hardware counters available, reporting only time" << endl;
+    }
+#endif
+    output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "cmds (sec)" << " , "
+           << setw(12) << "total (sec)" << " , " << setw(12) << "live (bytes)" << " , " << setw(9) << "bytes/N" << " , "
+           << setw(10) << "allocs" << " , " << setw(13) << "peak RSS (kB)";
+#ifdef USE_PERF_EVENT
+    if (counting)
+    {
+        for (auto name : Stopwatch::counter_names)
+        {
+            output << " , " << setw(13) << name;
+            if (name == Stopwatch::counter_names[Stopwatch::INSTRUCTIONS]) { output << " , " << setw(5) << "IPC"; }
+        }
+    }
+#endif
+    output << endl;
+    flush_output(output);
+
+    auto stop = false;
+    for (unsigned int n : init_ns)
+    {
+        if (stop) { break; }
+
+        output << setw(7) << n << " , " << flush;
+
+        ds_.clear_all();
+        ds_.clear_trains();
+        init_primes();
+
+        // The stations, regions and trains to add, the commands to run and the stations
+        // whose name and coordinates are also asked are all generated before the timing
+        auto startlive = MemoryCounter::live_bytes();
+        Workload workload;
+        if (geographic_perftest_)
+        {
+            generate_geographic_network(workload, n, n);
+        }
+        else
+        {
+            generate_random_stations_regions(workload, n);
+            generate_random_trains(workload, n);
+        }
+        vector<decltype(testfuncs)::size_type> cmdorder;
+        vector<StationID> getids;
+        cmdorder.reserve(repeat_count);
+        for (unsigned int repeat = 0; repeat < repeat_count; ++repeat)
+        {
+            cmdorder.push_back(random<decltype(testfuncs)::size_type>(0, testfuncs.size()));
+            if (additional_get_cmds && random_stations_added_ > 0)
+            {
+                getids.push_back(n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_)));
+            }
+        }
+
+        // Memory is measured from the empty data structure, the peak over adding and the commands
+        MemoryCounter::reset_peak_rss();
+        auto startrss = MemoryCounter::peak_rss_kb();
+        auto startallocs = MemoryCounter::allocations();
+
+        Stopwatch stopwatch(true); // Use also hardware counters, if enabled
+
+        // Add the stations and trains, 1000 operations at a time
+        for (auto op = workload.begin(); op != workload.end(); )
+        {
+            auto chunkend = (workload.end() - op > 1000) ? op + 1000 : workload.end();
+            Trace::Span addspan("add", "perftest");
+            stopwatch.start();
+            replay_workload(op, chunkend);
+            stopwatch.stop();
+            addspan.end();
+            op = chunkend;
+
+            if (stopwatch.elapsed() >= timeout)
+            {
+                output << "Timeout!" << endl;
+                stop = true;
+                break;
+            }
+            if (check_stop())
+            {
+                output << "Stopped!" << endl;
+                stop = true;
+                break;
+            }
+        }
+        if (stop) { break; }
+        Workload().swap(workload); // What was moved out now belongs to the data structure
+
+#ifdef USE_PERF_EVENT
+        auto addcounts = stopwatch.counts();
+#endif
+        auto addsec = stopwatch.elapsed();
+        long long livebytes = static_cast<long long>(MemoryCounter::live_bytes()) - static_cast<long long>(startlive);
+
+        output << setw(12) << addsec << " , " << flush;
+
+        if (addsec >= timeout)
+        {
+            output << "Timeout!" << endl;
+            stop = true;
+            break;
+        }
+
+        vector<RunningStats> callstats(csv.is_open() ? testfuncs.size() : 0);
+        ds_.reset_operation_counters();
+        stopwatch.start();
+        for (unsigned int repeat = 0; repeat < repeat_count; ++repeat)
+        {
+            auto cmdpos = testfuncs.begin() + cmdorder[repeat];
+
+            Trace::Span callspan(spannames[cmdorder[repeat]], "perftest");
+            if (csv.is_open())
+            {
+                auto callstart = Stopwatch::Clock::now();
+                (this->*cmdpos->second)();
+                callstats[cmdpos - testfuncs.begin()].add(
+                    std::chrono::duration<double>(Stopwatch::Clock::now() - callstart).count());
+            }
+            else
+            {
+                (this->*cmdpos->second)();
+            }
+            callspan.end();
+            if (repeat < getids.size()) // Only for all and compulsory, and if there are stations
+            {
+                ds_.get_station_name(getids[repeat]);
+                ds_.get_station_coordinates(getids[repeat]);
+            }
+
+            if (repeat % 10 == 0)
+            {
+                stopwatch.stop();
+                if (stopwatch.elapsed() >= timeout)
+                {
+                    output << "Timeout!" << endl;
+                    stop = true;
+                    break;
+                }
+                if (check_stop())
+                {
+                    output << "Stopped!" << endl;
+                    stop = true;
+                    break;
+                }
+                stopwatch.start();
+            }
+        }
+        stopwatch.stop();
+        if (stop) { break; }
+
+        auto totalsec = stopwatch.elapsed();
+
+        output << setw(12) << totalsec-addsec << " , " << setw(12) << totalsec;
+        output << " , " << setw(12) << livebytes << " , " << setw(9) << (n > 0 ? livebytes / static_cast<long long>(n) : 0)
+               << " , " << setw(10) << MemoryCounter::allocations() - startallocs
+               << " , " << setw(13) << static_cast<long long>(MemoryCounter::peak_rss_kb()) - static_cast<long long>(startrss);
+
+        if (csv.is_open())
+        {
+            // Rows for adding, for each command and for the whole N. Counters are given for the
+            // phases, empty where not available
+            csv << rand_seed_ << ',' << n << ",add,," << n << ',' << addsec << ",,," << livebytes << ",,";
+#ifdef USE_PERF_EVENT
+            for (auto count : addcounts) { csv << ','; if (count != Stopwatch::NO_COUNT) { csv << count; } }
+#endif
+            csv << endl;
+            for (unsigned int c = 0; c < testfuncs.size(); ++c)
+            {
+                auto const& stats = callstats[c];
+                if (stats.count == 0) { continue; }
+                csv << rand_seed_ << ',' << n << ",cmd," << testfuncs[c].first << ',' << stats.count << ','
+                    << stats.mean * stats.count << ',' << stats.mean << ',' << stats.stddev() << ",,,";
+#ifdef USE_PERF_EVENT
+                csv << ",,,,,";
+#endif
+                csv << endl;
+            }
+            csv << rand_seed_ << ',' << n << ",total,," << repeat_count << ',' << totalsec << ",,," << livebytes << ','
+                << MemoryCounter::allocations() - startallocs << ','
+                << static_cast<long long>(MemoryCounter::peak_rss_kb()) - static_cast<long long>(startrss);
+#ifdef USE_PERF_EVENT
+            for (auto count : stopwatch.counts()) { csv << ','; if (count != Stopwatch::NO_COUNT) { csv << count; } }
+#endif
+            csv << endl;
+        }
+#ifdef USE_PERF_EVENT
+        if (counting)
+        {
+            // Counts of the commands only, "-" for the counters this machine doesn't provide
+            auto totalcounts = stopwatch.counts();
+            Stopwatch::Counts cmdcounts;
+            for (unsigned int i = 0; i < Stopwatch::COUNTERS; ++i)
+            {
+                cmdcounts[i] = (totalcounts[i] == Stopwatch::NO_COUNT) ? Stopwatch::NO_COUNT : totalcounts[i] - addcounts[i];
+            }
+            for (unsigned int i = 0; i < Stopwatch::COUNTERS; ++i)
+            {
+                output << " , " << setw(13);
+                if (cmdcounts[i] == Stopwatch::NO_COUNT) { output << "-"; }
+                else { output << cmdcounts[i]; }
+                if (i == Stopwatch::INSTRUCTIONS)
+                {
+                    output << " , " << setw(5);
+                    auto cycles = cmdcounts[Stopwatch::CYCLES];
+                    auto instructions = cmdcounts[Stopwatch::INSTRUCTIONS];
+                    if (cycles > 0 && instructions != Stopwatch::NO_COUNT)
+                    {
+                        auto precision = output.precision(2);
+                        output << std::fixed << double(instructions) / cycles << std::defaultfloat;
+                        output.precision(precision);
+                    }
+                    else { output << "-"; }
+                }
+            }
+        }
+#endif
+
+        output << endl;
+
+        // Work done inside Datastructures, per command run
+        auto counters = ds_.operation_counters();
+        output << setw(7) << "" << "   per command:";
+        for (auto const& [name, field] : counter_fields)
+        {
+            output << " " << name << " " << double(counters.*field) / std::max(repeat_count, 1u);
+        }
+        output << endl;
+        flush_output(output);
+
+        if (!threadcounts.empty())
+        {
+            stop = !perftest_threads(output, testfuncs, cmdorder, threadcounts, timeout);
+        }
+    }
+
+    ds_.clear_all();
+    ds_.clear_trains();
+    init_primes();
+
+    }
+    catch (NotImplemented const&)
+    {
+        // Clean up after NotImplemented
+        ds_.clear_all();
+        init_primes();
+        throw;
+    }
+
+#ifdef _GLIBCXX_DEBUG
+    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
+#endif // _GLIBCXX_DEBUG
+
+    return {};
+}
+
+bool MainProgram::perftest_threads(std::ostream& output, vector<pair<string, void(MainProgram::*)()>> const& testfuncs,
+                                   vector<std::size_t> const& cmdorder,
+                                   vector<unsigned int> const& threadcounts, unsigned int timeout)
+{
+    // The same commands as in the sequential run, with new random parameters generated
+    // before the timing. Commands without a batch query form are left out
+    vector<Datastructures::Query> queries;
+    for (auto cmd : cmdorder)
+    {
+        Datastructures::Query query;
+        if (!query_kind(testfuncs[cmd].first, query.kind)) { continue; }
+        if (random_stations_added_ > 0)
+        {
+            query.from = random_test_station();
+            query.to = random_test_station();
+        }
+        if (random_regions_added_ > 0)
+        {
+            query.region1 = n_to_regionid(random<decltype(random_regions_added_)>(0, random_regions_added_));
+            query.region2 = n_to_regionid(random<decltype(random_regions_added_)>(0, random_regions_added_));
+        }
+        query.time = 100 * random(0, 24) + random(0, 60);
+        queries.push_back(query);
+    }
+    if (queries.empty()) { return true; }
+
+    // Efficiency is the speed-up over the first thread count divided by the growth in threads
+    double basethroughput = 0;
+    for (auto threads : threadcounts)
+    {
+        Stopwatch stopwatch;
+        stopwatch.start();
+        ds_.run_queries(queries, threads);
+        stopwatch.stop();
+
+        auto elapsed = stopwatch.elapsed();
+        auto throughput = (elapsed > 0) ? queries.size() / elapsed : 0;
+        if (basethroughput == 0) { basethroughput = throughput; }
+        auto speedup = (basethroughput > 0) ? throughput / basethroughput : 0;
+        auto efficiency = speedup * threadcounts.front() / threads;
+
+        output << setw(7) << "" << "   threads " << setw(3) << threads << " , " << setw(12) << elapsed << " sec , "
+               << setw(12) << static_cast<unsigned long int>(throughput) << " queries/sec , ";
+        auto precision = output.precision(2);
+        output << std::fixed << "speed-up " << setw(6) << speedup << " , efficiency " << setw(6) << 100 * efficiency << " %"
+               << std::defaultfloat << endl;
+        output.precision(precision);
+        flush_output(output);
+
+        if (elapsed >= timeout)
+        {
+            output << "Timeout!" << endl;
+            return false;
+        }
+        if (check_stop())
+        {
+            output << "Stopped!" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+namespace
+{
+// Growth classes the perftest_fit results are fitted to, from the slowest growing up
+enum class Growth { CONSTANT, LOGARITHMIC, LINEAR, LINEARITHMIC, QUADRATIC, GROWTHS };
+
+array<char const*, static_cast<size_t>(Growth::GROWTHS)> const growth_names {{"O(1)", "O(log n)", "O(n)", "O(n log n)", "O(n^2)"}};
+
+double growth_value(Growth growth, double n)
+{
+    switch (growth)
+    {
+        case Growth::CONSTANT: return 1;
+        case Growth::LOGARITHMIC: return std::log2(n);
+        case Growth::LINEAR: return n;
+        case Growth::LINEARITHMIC: return n * std::log2(n);
+        case Growth::QUADRATIC: return n * n;
+        case Growth::GROWTHS: break;
+    }
+    return 1;
+}
+
+// The estimates of datastructures.hh for the tested commands, as functions of N alone
+// (the random data grows all of stations, regions, trains and departures with N).
+// Update this table whenever an estimate there changes
+vector<pair<string, Growth>> const expected_growths {
+    {"all_stations", Growth::LINEAR}, {"station_info", Growth::LINEAR},
+    {"stations_alphabetically", Growth::LINEARITHMIC}, {"stations_distance_increasing", Growth::LINEARITHMIC},
+    {"find_station_with_coord", Growth::LOGARITHMIC}, {"change_station_coord", Growth::LOGARITHMIC},
+    {"add_departure", Growth::CONSTANT}, {"remove_departure", Growth::CONSTANT},
+    {"station_departures_after", Growth::LOGARITHMIC}, {"region_info", Growth::LINEAR},
+    {"station_in_regions", Growth::LOGARITHMIC}, {"all_subregions_of_region", Growth::LINEAR},
+    {"stations_closest_to", Growth::LINEARITHMIC}, {"remove_station", Growth::LINEAR},
+    {"common_parent_of_regions", Growth::LINEAR}, {"next_stations_from", Growth::LOGARITHMIC},
+    {"train_stations_from", Growth::LINEAR}, {"route_any", Growth::LINEARITHMIC},
+    {"route_with_cycle", Growth::LINEAR}, {"route_shortest_distance", Growth::LINEARITHMIC},
+    {"route_earliest_arrival", Growth::LINEARITHMIC}, {"route_earliest_arrival_transfers", Growth::LINEARITHMIC},
+    {"distance_matrix", Growth::LINEARITHMIC}, {"random_stations", Growth::LINEAR}, {"random_trains", Growth::LINEAR}};
+
+// A higher growth class only counts as fitting better when its residual error is at most this
+// part of the lower class's error, so that noise in the timings doesn't move the fit up a class
+double const GROWTH_MARGIN = 0.5;
+
+// Two-sided 95 % critical values of Student's t distribution by degrees of freedom,
+// the last one is used for all larger degrees
+array<double, 10> const t_critical {{12.71, 4.30, 3.18, 2.78, 2.57, 2.45, 2.36, 2.31, 2.26, 2.23}};
+
+struct GrowthFit
+{
+    double error = 0; // Root mean square of the residuals relative to the times
+    bool significant = false; // Slope positive and significantly non-zero
+};
+
+// Least squares fit of time = a + b * f(n), with O(1) the intercept alone. The residuals are
+// weighted by 1 / time, so that the small N count as much as the large ones
+GrowthFit fit_growth_class(Growth growth, vector<pair<unsigned int, double>> const& times)
+{
+    double weights = 0;
+    double mean = 0;
+    double fmean = 0;
+    for (auto const& i : times)
+    {
+        if (i.second <= 0) { return {}; }
+        auto weight = 1 / (i.second * i.second);
+        weights += weight;
+        mean += weight * i.second;
+        fmean += weight * growth_value(growth, i.first);
+    }
+    mean /= weights;
+    fmean /= weights;
+
+    double ft = 0;
+    double ff = 0;
+    if (growth != Growth::CONSTANT)
+    {
+        for (auto const& i : times)
+        {
+            auto weight = 1 / (i.second * i.second);
+            auto f = growth_value(growth, i.first) - fmean;
+            ft += weight * f * (i.second - mean);
+            ff += weight * f * f;
+        }
+    }
+    auto slope = (ff > 0) ? ft / ff : 0;
+    auto intercept = mean - slope * fmean;
+    double error = 0;
+    for (auto const& i : times)
+    {
+        auto difference = (i.second - intercept - slope * growth_value(growth, i.first)) / i.second;
+        error += difference * difference;
+    }
+
+    GrowthFit fit;
+    fit.error = std::sqrt(error / times.size());
+    if (ff > 0 && slope > 0 && times.size() > 2)
+    {
+        auto freedom = times.size() - 2;
+        auto slope_error = std::sqrt(error / freedom / ff);
+        fit.significant = slope > t_critical[std::min(freedom, t_critical.size()) - 1] * slope_error;
+    }
+    return fit;
+}
+}
+
+MainProgram::CmdResult MainProgram::cmd_perftest_mix(std::ostream& output, MatchIter begin, MatchIter end)
+{
+#ifdef _GLIBCXX_DEBUG
+    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
+#endif // _GLIBCXX_DEBUG
+
+    string weightstr = *begin++;
+    unsigned int n = convert_string_to<unsigned int>(*begin++);
+    unsigned int seconds = convert_string_to<unsigned int>(*begin++);
+    unsigned int rate = convert_string_to<unsigned int>(*begin++);
+    string zipfstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    // Commands with their weights, picked by a binary search over the cumulative weights
+    vector<pair<string, void(MainProgram::*)()>> testfuncs;
+    vector<unsigned long int> cumulative;
+    unsigned long int totalweight = 0;
+    smatch weight;
+    for (auto wbeg = weightstr.cbegin(); regex_search(wbeg, weightstr.cend(), weight, weights_regex_); wbeg = weight.suffix().first)
+    {
+        string name = weight[1];
+        auto pos = find_if(cmds_.begin(), cmds_.end(), [&name](auto const& cmd){ return cmd.cmd == name; });
+        auto w = convert_string_to<unsigned long int>(weight[2]);
+        if (pos == cmds_.end() || !pos->testfunc)
+        {
+            output << "Cannot test " << name << "!" << endl;
+            return {};
+        }
+        if (w == 0) { continue; }
+        testfuncs.emplace_back(name, pos->testfunc);
+        totalweight += w;
+        cumulative.push_back(totalweight);
+    }
+    if (testfuncs.empty())
+    {
+        output << "No commands to test!" << endl;
+        return {};
+    }
+
+    ds_.clear_all();
+    ds_.clear_trains();
+    init_primes();
+    {
+        Workload workload;
+        if (geographic_perftest_) { generate_geographic_network(workload, n, n); }
+        else
+        {
+            generate_random_stations_regions(workload, n);
+            generate_random_trains(workload, n);
+        }
+        replay_workload(workload.begin(), workload.end(), true);
+    }
+
+    station_zipf_ = zipfstr.empty() ? 0 : convert_string_to<double>(zipfstr);
+    station_zipf_cumulative_.clear();
+
+    output << "Mixed workload on N=" << n << " (" << (geographic_perftest_ ? "geographic" : "uniform") << ") for "
+           << seconds << " sec, ";
+    if (rate > 0) { output << "target " << rate << " ops/sec"; }
+    else { output << "as fast as possible"; }
+    if (station_zipf_ > 0) { output << ", stations Zipf s=" << station_zipf_; }
+    output << endl;
+    flush_output(output);
+
+    // With a target rate the operations are scheduled at fixed intervals, and latency is counted
+    // from the scheduled start, so that a slow operation also shows in the ones queued behind it
+    using Clock = LatencyHistogram::Clock;
+    vector<LatencyHistogram> latency(testfuncs.size());
+    LatencyHistogram alllatency;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::seconds(seconds);
+    auto interval = (rate > 0) ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / rate)) : Clock::duration::zero();
+    unsigned long int ops = 0;
+    auto now = start;
+    bool stopped = false;
+    try {
+    for ( ; now < deadline && !stopped; ++ops)
+    {
+        auto w = random<unsigned long int>(0, totalweight);
+        auto c = std::upper_bound(cumulative.begin(), cumulative.end(), w) - cumulative.begin();
+
+        auto scheduled = now;
+        if (rate > 0)
+        {
+            scheduled = start + interval * ops;
+            if (scheduled >= deadline) { break; }
+            if (scheduled > now) { std::this_thread::sleep_until(scheduled); }
+        }
+        auto opstart = (rate > 0) ? scheduled : Clock::now();
+        (this->*testfuncs[c].second)();
+        now = Clock::now();
+        latency[c].record(now - opstart);
+        alllatency.record(now - opstart);
+
+        if (ops % 1000 == 0 && check_stop())
+        {
+            output << "Stopped!" << endl;
+            stopped = true;
+        }
+    }
+    }
+    catch (NotImplemented const&)
+    {
+        station_zipf_ = 0;
+        ds_.clear_all();
+        init_primes();
+        throw;
+    }
+    auto elapsed = std::chrono::duration<double>(now - start).count();
+    station_zipf_ = 0;
+
+    output << "Ran " << alllatency.count() << " operations in " << elapsed << " sec, "
+           << (elapsed > 0 ? static_cast<unsigned long int>(alllatency.count() / elapsed) : 0) << " ops/sec" << endl;
+    output << "Latencies in microseconds:" << endl;
+    output << setfill(' ') << setw(32) << std::left << "command" << std::right << setw(10) << "count" << setw(12) << "mean"
+           << setw(12) << "p50" << setw(12) << "p90" << setw(12) << "p99" << setw(12) << "max" << endl;
+    for (unsigned int c = 0; c < testfuncs.size(); ++c)
+    {
+        print_latency_row(output, testfuncs[c].first, latency[c], false);
+    }
+    print_latency_row(output, "(all)", alllatency, false);
+
+    ds_.clear_all();
+    ds_.clear_trains();
+    init_primes();
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_perftest_compare(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string basename = *begin++;
+    string newname = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    // Rows of a perftest CSV file by phase, command and N
+    struct Row { unsigned long int calls = 0; double seconds = 0; double mean = 0; double stddev = 0; };
+    using Rows = std::map<tuple<string, string, unsigned int>, Row>;
+    auto read_rows = [&output](string const& filename, Rows& rows) {
+        std::ifstream file(filename);
+        if (!file)
+        {
+            output << "Cannot open file '" << filename << "'!" << endl;
+            return false;
+        }
+        string line;
+        getline(file, line); // Header
+        while (getline(file, line))
+        {
+            vector<string> fields;
+            istringstream fieldstream(line);
+            for (string field; getline(fieldstream, field, ','); ) { fields.push_back(field); }
+            if (fields.size() < 8) { continue; }
+            try
+            {
+                Row row;
+                row.calls = std::stoul(fields[4]);
+                row.seconds = std::stod(fields[5]);
+                row.mean = fields[6].empty() ? row.seconds / std::max(row.calls, 1ul) : std::stod(fields[6]);
+                row.stddev = fields[7].empty() ? 0 : std::stod(fields[7]);
+                rows[std::make_tuple(fields[2], fields[3], std::stoul(fields[1]))] = row;
+            }
+            catch (std::exception const&)
+            {
+                output << "Skipping invalid line in '" << filename << "': " << line << endl;
+            }
+        }
+        return true;
+    };
+
+    Rows baseline;
+    Rows current;
+    if (!read_rows(basename, baseline) || !read_rows(newname, current)) { return {}; }
+
+    // Welch's t-test on the call times of each command. |t| above 3.29 is significant at
+    // the 0.1% level for the call counts perftest uses, and a slowdown needs to be over 5%
+    // to matter. The add and total phases are single measurements, so only the change is shown
+    constexpr double significant_t = 3.29;
+    constexpr double relevant_change = 0.05;
+
+    output << setfill(' ');
+    output << setw(32) << std::left << "command" << std::right << " , " << setw(7) << "N" << " , " << setw(12) << "baseline"
+           << " , " << setw(12) << "new" << " , " << setw(8) << "change" << " , " << setw(7) << "t" << endl;
+    unsigned int slower = 0;
+    for (auto const& i : current)
+    {
+        auto const& [phase, command, n] = i.first;
+        auto base = baseline.find(i.first);
+        if (base == baseline.end()) { continue; }
+        auto const& b = base->second;
+        auto const& c = i.second;
+        auto basevalue = (phase == "cmd") ? b.mean : b.seconds;
+        auto newvalue = (phase == "cmd") ? c.mean : c.seconds;
+        auto change = (basevalue > 0) ? newvalue / basevalue - 1 : 0;
+
+        output << setw(32) << std::left << (phase == "cmd" ? command : phase) << std::right << " , " << setw(7) << n << " , "
+               << setw(12) << basevalue << " , " << setw(12) << newvalue << " , ";
+        auto precision = output.precision(1);
+        output << std::fixed << setw(7) << change * 100 << "%";
+        if (phase == "cmd" && b.calls > 1 && c.calls > 1)
+        {
+            auto error = std::sqrt(b.stddev * b.stddev / b.calls + c.stddev * c.stddev / c.calls);
+            auto t = (error > 0) ? (c.mean - b.mean) / error : 0;
+            output << " , " << setw(7) << t;
+            if (t > significant_t && change > relevant_change)
+            {
+                output << " , SLOWER";
+                ++slower;
+            }
+            else if (t < -significant_t && change < -relevant_change)
+            {
+                output << " , faster";
+            }
+        }
+        else
+        {
+            output << " , " << setw(7) << "-";
+        }
+        output << std::defaultfloat << endl;
+        output.precision(precision);
+    }
+    output << slower << " significant slowdown(s)" << endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_perftest_fit(std::ostream& output, MatchIter begin, MatchIter end)
+{
+#ifdef _GLIBCXX_DEBUG
+    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
+#endif // _GLIBCXX_DEBUG
+
+    string commandstr = *begin++;
+    unsigned int timeout = convert_string_to<unsigned int>(*begin++);
+    unsigned int repeat_count = convert_string_to<unsigned int>(*begin++);
+    string sizes = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    vector<unsigned int> init_ns;
+    smatch size;
+    auto sbeg = sizes.cbegin();
+    auto send = sizes.cend();
+    for ( ; regex_search(sbeg, send, size, sizes_regex_); sbeg = size.suffix().first)
+    {
+        init_ns.push_back(convert_string_to<unsigned int>(size[1]));
+    }
+
+    output << "Timeout for each N is " << timeout << " sec. " << endl;
+    output << "For each N time " << repeat_count << " call(s) of each of:" << endl;
+    auto testfuncs = perftest_functions(commandstr, output);
+    output << endl << endl;
+
+    if (testfuncs.empty() || repeat_count == 0)
+    {
+        output << "No commands to test!" << endl;
+        return {};
+    }
+    if (init_ns.size() < 3)
+    {
+        output << "Fitting needs at least 3 values of N!" << endl;
+        return {};
+    }
+
+    // Seconds per call for each command and N
+    output << setw(32) << std::left << "command" << std::right;
+    for (auto n : init_ns) { output << " , " << setw(12) << n; }
+    output << endl;
+    flush_output(output);
+
+    vector<vector<pair<unsigned int, double>>> times(testfuncs.size());
+    auto stop = false;
+    for (unsigned int c = 0; c < testfuncs.size() && !stop; ++c)
+    {
+        output << setw(32) << std::left << testfuncs[c].first << std::right << flush;
+        try
+        {
+            for (unsigned int n : init_ns)
+            {
+                // Each command gets fresh data, so that earlier commands don't change it
+                ds_.clear_all();
+                ds_.clear_trains();
+                init_primes();
+                add_random_stations_regions(n);
+                add_random_trains(n);
+
+                // One untimed call, so that building the query snapshot isn't charged to the command
+                (this->*testfuncs[c].second)();
+
+                Stopwatch stopwatch;
+                stopwatch.start();
+                for (unsigned int repeat = 0; repeat < repeat_count; ++repeat)
+                {
+                    (this->*testfuncs[c].second)();
+                }
+                stopwatch.stop();
+
+                auto seconds = stopwatch.elapsed() / repeat_count;
+                output << " , " << setw(12) << seconds << flush;
+                times[c].emplace_back(n, seconds);
+                if (stopwatch.elapsed() >= timeout)
+                {
+                    output << " , Timeout!";
+                    break;
+                }
+                if (check_stop())
+                {
+                    output << " , Stopped!";
+                    stop = true;
+                    break;
+                }
+            }
+        }
+        catch (NotImplemented const&)
+        {
+            output << " , Not implemented!";
+            times[c].clear();
+        }
+        output << endl;
+        flush_output(output);
+    }
+
+    ds_.clear_all();
+    ds_.clear_trains();
+    init_primes();
+
+    // Fitted growth against the estimate
+    output << endl << setw(32) << std::left << "command" << std::right << " , " << setw(10) << "expected" << " , "
+           << setw(10) << "fitted" << " , " << setw(8) << "error" << endl;
+    for (unsigned int c = 0; c < testfuncs.size(); ++c)
+    {
+        output << setw(32) << std::left << testfuncs[c].first << std::right << " , ";
+        auto expected = find_if(expected_growths.begin(), expected_growths.end(),
+                                [&](auto const& i){ return i.first == testfuncs[c].first; });
+        output << setw(10) << ((expected != expected_growths.end()) ? growth_names[static_cast<size_t>(expected->second)] : "-") << " , ";
+        if (times[c].size() < 3)
+        {
+            output << setw(10) << "-" << " , " << setw(8) << "-" << endl;
+            continue;
+        }
+        array<GrowthFit, static_cast<size_t>(Growth::GROWTHS)> fits;
+        auto fitted = Growth::CONSTANT;
+        for (unsigned int g = 0; g < fits.size(); ++g)
+        {
+            auto growth = static_cast<Growth>(g);
+            fits[g] = fit_growth_class(growth, times[c]);
+            if (fits[g].significant && fits[g].error < GROWTH_MARGIN * fits[static_cast<size_t>(fitted)].error) { fitted = growth; }
+        }
+        auto precision = output.precision(3);
+        output << setw(10) << growth_names[static_cast<size_t>(fitted)] << " , " << setw(8) << fits[static_cast<size_t>(fitted)].error;
+        output.precision(precision);
+        auto worse = false;
+        for (auto g = (expected != expected_growths.end()) ? static_cast<size_t>(expected->second) + 1 : fits.size(); g < fits.size(); ++g)
+        {
+            worse = worse || (fits[g].significant && fits[g].error < GROWTH_MARGIN * fits[static_cast<size_t>(expected->second)].error);
+        }
+        if (worse)
+        {
+            output << " , WORSE THAN EXPECTED";
+        }
+        output << endl;
+    }
+
+#ifdef _GLIBCXX_DEBUG
+    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
+#endif // _GLIBCXX_DEBUG
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_perftest_ch(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string sizes = *begin++;
+    unsigned int query_count = convert_string_to<unsigned int>(*begin++);
+    assert(begin == end && "Invalid number of parameters");
 
     vector<unsigned int> init_ns;
     smatch size;
@@ -1652,224 +3783,87 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
         init_ns.push_back(convert_string_to<unsigned int>(size[1]));
     }
 
-    output << "Timeout for each N is " << timeout << " sec. " << endl;
-    output << "For each N perform " << repeat_count << " random command(s) from:" << endl;
-
-    // Initialize test functions
-    vector<void(MainProgram::*)()> testfuncs;
-    if (testcmds.empty())
-    { // Add all commands
-        for (auto& i : cmds_)
-        {
-            if (i.testfunc)
-            {
-                if (find(nondefault_cmds.begin(), nondefault_cmds.end(), i.cmd) == nondefault_cmds.end() &&
-                    (commandstr == "all" || find(optional_cmds.begin(), optional_cmds.end(), i.cmd) == optional_cmds.end()))
-                {
-                    output << i.cmd << " ";
-                    testfuncs.push_back(i.testfunc);
-                }
-            }
-        }
-    }
-    else
-    {
-        for (auto& i : testcmds)
-        {
-            auto pos = find_if(cmds_.begin(), cmds_.end(), [&i](auto const& cmd){ return cmd.cmd == i; });
-            if (pos != cmds_.end() && pos->testfunc)
-            {
-                output << i << " ";
-                testfuncs.push_back(pos->testfunc);
-            }
-            else
-            {
-                output << "(cannot test " << i << ") ";
-            }
-        }
-    }
-    output << endl << endl;
+    output << "For each N add N random stations and trains (" << (geographic_perftest_ ? "geographic" : "uniform")
+           << "), build the contraction hierarchy" << endl;
+    output << "and perform " << query_count << " random route_shortest_distance queries with and without it" << endl << endl;
 
-    if (testfuncs.empty())
-    {
-        output << "No commands to test!" << endl;
-        return {};
-    }
-
-#ifdef USE_PERF_EVENT
-    output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "add (count)" << " , " << setw(12) << "cmds (sec)" << " , "
-           << setw(12) << "cmds (count)"  << " , " << setw(12) << "total (sec)" << " , " << setw(12) << "total (count)" << endl;
-#else
-    output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "cmds (sec)" << " , "
-           << setw(12) << "total (sec)" << endl;
-#endif
+    output << setw(7) << "N" << " , " << setw(12) << "build (sec)" << " , " << setw(12) << "shortcuts" << " , "
+           << setw(12) << "dijkstra (s)" << " , " << setw(12) << "ch (sec)" << " , " << setw(12) << "speedup" << " , "
+           << setw(12) << "mismatches" << endl;
     flush_output(output);
 
-    auto stop = false;
+    auto was_enabled = ds_.contraction_hierarchy_enabled();
     for (unsigned int n : init_ns)
     {
-        if (stop) { break; }
+        if (check_stop())
+        {
+            output << "Stopped!" << endl;
+            break;
+        }
 
         output << setw(7) << n << " , " << flush;
 
         ds_.clear_all();
         ds_.clear_trains();
         init_primes();
-
-        Stopwatch stopwatch(true); // Use also instruction counting, if enabled
-
-        // Add random stations
-        for (unsigned int i = 0; i < n / 1000; ++i)
         {
-            stopwatch.start();
-            add_random_stations_regions(1000);
-            stopwatch.stop();
-
-            if (stopwatch.elapsed() >= timeout)
-            {
-                output << "Timeout!" << endl;
-                stop = true;
-                break;
-            }
-            if (check_stop())
+            Workload workload;
+            if (geographic_perftest_) { generate_geographic_network(workload, n, n); }
+            else
             {
-                output << "Stopped!" << endl;
-                stop = true;
-                break;
+                generate_random_stations_regions(workload, n);
+                generate_random_trains(workload, n);
             }
+            replay_workload(workload.begin(), workload.end(), true);
         }
-        if (stop) { break; }
-
-        if (n % 1000 != 0)
-        {
-            stopwatch.start();
-            add_random_stations_regions(n % 1000);
-            stopwatch.stop();
-        }
-
-        // Add random trains
-        for (unsigned int i = 0; i < n / 1000; ++i)
-        {
-            stopwatch.start();
-            add_random_trains(1000);
-            stopwatch.stop();
 
-            if (stopwatch.elapsed() >= timeout)
-            {
-                output << "Timeout!" << endl;
-                stop = true;
-                break;
-            }
-            if (check_stop())
-            {
-                output << "Stopped!" << endl;
-                stop = true;
-                break;
-            }
-        }
-        if (stop) { break; }
+        ds_.use_contraction_hierarchy(true);
+        Stopwatch build;
+        build.start();
+        auto shortcuts = ds_.contraction_hierarchy_shortcuts();
+        build.stop();
 
-        if (n % 1000 != 0)
+        vector<pair<StationID, StationID>> queries;
+        for (unsigned int i = 0; i < query_count; ++i)
         {
-            stopwatch.start();
-            add_random_trains(n % 1000);
-            stopwatch.stop();
+            queries.emplace_back(n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_)),
+                                 n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_)));
         }
 
-#ifdef USE_PERF_EVENT
-        auto addcount = stopwatch.count();
-#endif
-        auto addsec = stopwatch.elapsed();
-
-#ifdef USE_PERF_EVENT
-        output << setw(12) << addsec << " , " << setw(12) << addcount << " , " << flush;
-#else
-        output << setw(12) << addsec << " , " << flush;
-#endif
-
-        if (addsec >= timeout)
+        // Only the total distances are compared, equally short routes may differ
+        vector<Distance> dijkstra_dists;
+        ds_.use_contraction_hierarchy(false);
+        Stopwatch plain;
+        plain.start();
+        for (auto& [from, to] : queries)
         {
-            output << "Timeout!" << endl;
-            stop = true;
-            break;
+            auto route = ds_.route_shortest_distance(from, to);
+            dijkstra_dists.push_back(route.empty() ? NO_DISTANCE : route.back().second);
         }
+        plain.stop();
 
-        stopwatch.start();
-        for (unsigned int repeat = 0; repeat < repeat_count; ++repeat)
+        unsigned int mismatches = 0;
+        ds_.use_contraction_hierarchy(true);
+        Stopwatch hierarchy;
+        hierarchy.start();
+        for (unsigned int i = 0; i < queries.size(); ++i)
         {
-            auto cmdpos = random(testfuncs.begin(), testfuncs.end());
-
-            (this->**cmdpos)();
-            if (additional_get_cmds)
-            {
-                if (random_stations_added_ > 0) // Don't do anything if there's no stations
-                {
-                    StationID id = n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
-                    ds_.get_station_name(id);
-                    ds_.get_station_coordinates(id);
-                }
-            }
-
-            if (repeat % 10 == 0)
-            {
-                stopwatch.stop();
-                if (stopwatch.elapsed() >= timeout)
-                {
-                    output << "Timeout!" << endl;
-                    stop = true;
-                    break;
-                }
-                if (check_stop())
-                {
-                    output << "Stopped!" << endl;
-                    stop = true;
-                    break;
-                }
-                stopwatch.start();
-            }
+            auto route = ds_.route_shortest_distance(queries[i].first, queries[i].second);
+            if ((route.empty() ? NO_DISTANCE : route.back().second) != dijkstra_dists[i]) { ++mismatches; }
         }
-        stopwatch.stop();
-        if (stop) { break; }
-
-#ifdef USE_PERF_EVENT
-        auto totalcount = stopwatch.count();
-#endif
-        auto totalsec = stopwatch.elapsed();
-
-#ifdef USE_PERF_EVENT
-        output << setw(12) << totalsec-addsec << " , " << setw(12) << totalcount-addcount << " , " << setw(12) << totalsec << " , " << setw(12) << totalcount;
-#else
-        output << setw(12) << totalsec-addsec << " , " << setw(12) << totalsec;
-#endif
+        hierarchy.stop();
 
-//        unsigned long int maxmem;
-//        string unit;
-//        tie(maxmem, unit) = mempeak();
-//        maxmem -=  startmem;
-//        if (maxmem != 0)
-//        {
-//            output << ", memory " << maxmem << " " << unit;
-//        }
-        output << endl;
+        output << setw(12) << build.elapsed() << " , " << setw(12) << shortcuts << " , "
+               << setw(12) << plain.elapsed() << " , " << setw(12) << hierarchy.elapsed() << " , "
+               << setw(12) << (hierarchy.elapsed() > 0 ? plain.elapsed() / hierarchy.elapsed() : 0.0) << " , "
+               << setw(12) << mismatches << endl;
         flush_output(output);
     }
 
     ds_.clear_all();
     ds_.clear_trains();
     init_primes();
-
-    }
-    catch (NotImplemented const&)
-    {
-        // Clean up after NotImplemented
-        ds_.clear_all();
-        init_primes();
-        throw;
-    }
-
-#ifdef _GLIBCXX_DEBUG
-    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
-#endif // _GLIBCXX_DEBUG
+    ds_.use_contraction_hierarchy(was_enabled);
 
     return {};
 }
@@ -1886,24 +3880,66 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
 
     if (inputline.empty()) { return true; }
 
-    smatch match;
-    bool matched = regex_match(inputline, match, cmds_regex_);
-    if (matched)
+    Trace::Span parsespan("parse", "parser");
+
+    // The command is looked up from the hash table and its parameters matched with the
+    // hand-written scanner where the scanner can match exactly what the regexes would.
+    // Everything else goes through the regexes
+    Params params;
+    std::size_t param_count = 0;
+    CmdInfo const* pos = nullptr;
+    bool matched = false;
+    bool matched2 = false;
+    string paramstr; // The regex submatches point here
+    if (!use_regex_parser_ && inputline.find_first_of("\r\n") == string::npos)
+    {
+        auto is_space = [](char c) { return std::isspace(static_cast<unsigned char>(c)); };
+        auto name_begin = std::find_if_not(inputline.cbegin(), inputline.cend(), is_space);
+        auto name_end = std::find_if(name_begin, inputline.cend(), is_space);
+        auto index = find_command(string_view(inputline).substr(name_begin - inputline.cbegin(), name_end - name_begin));
+        if (index != NO_COMMAND && cmds_[index].has_param_tokens)
+        {
+            matched = true;
+            pos = &cmds_[index];
+            param_count = match_params(*pos, inputline, std::find_if_not(name_end, inputline.cend(), is_space), params);
+            matched2 = (param_count > 0);
+        }
+    }
+    if (!pos)
     {
-        assert(match.size() == 3);
-        string cmd = match[1];
-        string params = match[2];
+        smatch match;
+        matched = regex_match(inputline, match, cmds_regex_);
+        if (matched)
+        {
+            assert(match.size() == 3);
+            string cmdstr = match[1];
+            paramstr = match[2];
 
-        auto pos = find_if(cmds_.begin(), cmds_.end(), [cmd](CmdInfo const& ci) { return ci.cmd == cmd; });
-        assert(pos != cmds_.end());
+            auto found = find_if(cmds_.begin(), cmds_.end(), [cmdstr](CmdInfo const& ci) { return ci.cmd == cmdstr; });
+            assert(found != cmds_.end());
+            pos = &*found;
+
+            smatch match2;
+            matched2 = regex_match(paramstr, match2, pos->param_regex);
+            if (matched2)
+            {
+                assert(match2.size() <= MAX_PARAMS && "Too many parameters!");
+                param_count = std::copy(match2.begin(), match2.end(), params.begin()) - params.begin();
+            }
+        }
+    }
+
+    parsespan.end();
+
+    if (matched)
+    {
+        string const& cmd = pos->cmd;
 
-        smatch match2;
-        bool matched2 = regex_match(params, match2, pos->param_regex);
         if (matched2)
         {
             if (pos->func)
             {
-                assert(!match2.empty());
+                assert(param_count > 0);
 
                 Stopwatch stopwatch;
                 bool use_stopwatch = (stopwatch_mode != StopwatchMode::OFF);
@@ -1917,23 +3953,32 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
                 {
                     stopwatch.start();
                 }
+                auto started = LatencyHistogram::Clock::now();
 
                 CmdResult result;
+                Trace::Span cmdspan(pos->cmd.c_str(), "command");
                 try
                 {
-                    result = (this->*(pos->func))(output, ++(match2.begin()), match2.end());
+                    result = (this->*(pos->func))(output, params.data() + 1, params.data() + param_count);
                 }
                 catch (NotImplemented const& e)
                 {
                     output << endl << "NotImplemented from cmd " << pos->cmd << " : " << e.what() << endl;
                     std::cerr << endl << "NotImplemented from cmd " << pos->cmd << " : " << e.what() << endl;
                 }
+                catch (NotAvailable const& e)
+                {
+                    output << endl << "NotAvailable from cmd " << pos->cmd << " : " << e.what() << endl;
+                    std::cerr << endl << "NotAvailable from cmd " << pos->cmd << " : " << e.what() << endl;
+                }
 
                 if (use_stopwatch)
                 {
                     stopwatch.stop();
                 }
+                cmdspan.end();
 
+                Trace::Span formatspan("format", "output");
                 switch (result.first)
                 {
                     case ResultType::NOTHING:
@@ -1945,44 +3990,44 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
                         auto& [regions, stations] = std::get<CmdResultIDs>(result.second);
                         if (stations.size() == 1 && stations.front() == NO_STATION)
                         {
-                            output << "Failed (NO_STATION returned)!" << std::endl;
+                            out_ << "Failed (NO_STATION returned)!" << '\n';
                         }
                         else
                         {
                             if (!stations.empty())
                             {
-                                if (stations.size() == 1) { output << "Station:" << std::endl; }
-                                else { output << "Stations:" << std::endl; }
+                                if (stations.size() == 1) { out_ << "Station:" << '\n'; }
+                                else { out_ << "Stations:" << '\n'; }
 
                                 unsigned int num = 0;
                                 for (StationID id : stations)
                                 {
                                     ++num;
-                                    if (stations.size() > 1) { output << num << ". "; }
-                                    else { output << "   "; }
-                                    print_station(id, output);
+                                    if (stations.size() > 1) { out_ << num << ". "; }
+                                    else { out_ << "   "; }
+                                    format_station(id, out_);
                                 }
                             }
                         }
 
                         if (regions.size() == 1 && regions.front() == NO_REGION)
                         {
-                            output << "Failed (NO_REGION returned)!" << std::endl;
+                            out_ << "Failed (NO_REGION returned)!" << '\n';
                         }
                         else
                         {
                             if (!regions.empty())
                             {
-                                if (regions.size() == 1) { output << "Region:" << std::endl; }
-                                else { output << "Regions:" << std::endl; }
+                                if (regions.size() == 1) { out_ << "Region:" << '\n'; }
+                                else { out_ << "Regions:" << '\n'; }
 
                                 unsigned int num = 0;
                                 for (RegionID id : regions)
                                 {
                                     ++num;
-                                    if (regions.size() > 1) { output << num << ". "; }
-                                    else { output << "   "; }
-                                    print_region(id, output);
+                                    if (regions.size() > 1) { out_ << num << ". "; }
+                                    else { out_ << "   "; }
+                                    format_region(id, out_);
                                 }
                             }
                         }
@@ -1995,7 +4040,7 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
                         {
                             if (route.size() == 1 && get<1>(route.front()) == NO_STATION)
                             {
-                                output << "Failed (...NO_STATION... returned)!" << std::endl;
+                                out_ << "Failed (...NO_STATION... returned)!" << '\n';
                             }
                             else
                             {
@@ -2003,32 +4048,32 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
                                 for (auto& r : route)
                                 {
                                     auto [trainid, stationid1, stationid2, time, dist] = r;
-                                    output << num << ". ";
+                                    out_ << num << ". ";
                                     if (stationid1 != NO_STATION)
                                     {
-                                        print_station_brief(stationid1, output, false);
+                                        format_station_brief(stationid1, out_);
                                     }
                                     if (stationid2 != NO_STATION)
                                     {
-                                        output << " -> ";
-                                        print_station_brief(stationid2, output, false);
+                                        out_ << " -> ";
+                                        format_station_brief(stationid2, out_);
                                     }
                                     if (trainid != NO_TRAIN)
                                     {
-                                        output << ": ";
-                                        print_train(trainid, output, false);
+                                        out_ << ": ";
+                                        out_ << trainid;
                                     }
                                     if (time != NO_TIME)
                                     {
-                                        output << " (at ";
-                                        print_time(time, output, false);
-                                        output << ")";
+                                        out_ << " (at ";
+                                        format_time(time, out_);
+                                        out_ << ")";
                                     }
                                     if (dist != NO_DISTANCE)
                                     {
-                                        output << " (distance " << dist << ")";
+                                        out_ << " (distance " << dist << ")";
                                     }
-                                    output << endl;
+                                    out_ << '\n';
 
                                     ++num;
                                 }
@@ -2043,7 +4088,7 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
                     {
                         if (route.size() == 1 && get<1>(route.front()) == NO_STATION)
                         {
-                            output << "Failed (...NO_STATION... returned)!" << std::endl;
+                            out_ << "Failed (...NO_STATION... returned)!" << '\n';
                         }
                         else
                         {
@@ -2051,28 +4096,28 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
                             for (auto& r : route)
                             {
                                 auto [trainid, stationid1, stationid2, time] = r;
-                                output << num << ". ";
+                                out_ << num << ". ";
                                 if (stationid1 != NO_STATION)
                                 {
-                                    print_station_brief(stationid1, output, false);
+                                    format_station_brief(stationid1, out_);
                                 }
                                 if (stationid2 != NO_STATION)
                                 {
-                                    output << " -> ";
-                                    print_station_brief(stationid2, output, false);
+                                    out_ << " -> ";
+                                    format_station_brief(stationid2, out_);
                                 }
                                 if (trainid != NO_TRAIN)
                                 {
-                                    output << ": ";
-                                    print_train(trainid, output, false);
+                                    out_ << ": ";
+                                    out_ << trainid;
                                 }
                                 if (time != NO_TIME)
                                 {
-                                    output << " (at ";
-                                    print_time(time, output, false);
-                                    output << ")";
+                                    out_ << " (at ";
+                                    format_time(time, out_);
+                                    out_ << ")";
                                 }
-                                output << endl;
+                                out_ << '\n';
 
                                 ++num;
                             }
@@ -2086,6 +4131,11 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
                     }
                 }
 
+                // The result was formatted into the buffer, which is written out in one go
+                cmd_latency_[pos - cmds_.data()].record(LatencyHistogram::Clock::now() - started);
+                out_.flush_to(output);
+                formatspan.end();
+
                 if (result != prev_result)
                 {
                     prev_result = move(result);
@@ -2150,6 +4200,125 @@ void MainProgram::command_parser(istream& input, ostream& output, PromptStyle pr
     view_dirty = true; // To be safe, assume that results have been changed
 }
 
+void MainProgram::ingest(istream& input, ostream& output)
+{
+    // Runs of the same command are applied together, at most this many at a time
+    constexpr std::size_t INGEST_BATCH = 4096;
+    // Progress is reported after this many lines, or after a second if the feed is slow
+    constexpr unsigned long int INGEST_REPORT_LINES = 100000;
+
+    using Kind = BulkCommand::Kind;
+    vector<pair<TrainID, vector<pair<StationID, Time>>>> trains;
+    vector<std::tuple<StationID, TrainID, Time>> departures;
+    unsigned long int lines = 0;
+    unsigned long int added_trains = 0;
+    unsigned long int added_departures = 0;
+    unsigned long int removed_departures = 0;
+    unsigned long int removed_stations = 0;
+    unsigned long int failed = 0;
+    unsigned long int other = 0;
+    // Other commands, such as reading the stations, run as usual but print nothing
+    std::ostream discard(nullptr);
+
+    auto flush = [&]()
+    {
+        if (!trains.empty())
+        {
+            auto added = ds_.add_trains(trains);
+            added_trains += added;
+            failed += trains.size() - added;
+            trains.clear();
+        }
+        if (!departures.empty())
+        {
+            auto added = ds_.add_departures(departures);
+            added_departures += added;
+            failed += departures.size() - added;
+            departures.clear();
+        }
+    };
+
+    Stopwatch stopwatch;
+    stopwatch.start();
+    double reported_at = 0;
+    unsigned long int reported_lines = 0;
+    auto report = [&](char const* what)
+    {
+        auto elapsed = stopwatch.elapsed();
+        output << what << " " << lines << " lines in " << elapsed << " sec ("
+               << static_cast<unsigned long int>(elapsed > 0 ? lines / elapsed : 0) << " lines/sec): "
+               << added_trains << " trains and " << added_departures << " departures added, "
+               << removed_departures << " departures and " << removed_stations << " stations removed, "
+               << failed << " failed, " << other << " other commands" << endl;
+        reported_at = elapsed;
+        reported_lines = lines;
+    };
+
+    string line;
+    BulkCommand command;
+    Kind pending = Kind::OTHER;
+    while (true)
+    {
+        // Apply what has been read before waiting for more, so that a slow feed
+        // isn't held back by the batching
+        if (input.rdbuf()->in_avail() <= 0)
+        {
+            flush();
+            if (lines > reported_lines && stopwatch.elapsed() - reported_at >= 1.0) { report("Ingested"); }
+        }
+        if (!getline(input, line)) { break; }
+        ++lines;
+
+        string_view text = line;
+        while (!text.empty() && std::isspace(static_cast<unsigned char>(text.back()))) { text.remove_suffix(1); }
+        if (text.empty()) { continue; }
+
+        command = BulkCommand();
+        if (!parse_bulk_command(text, command) ||
+            (command.kind != Kind::TRAIN && command.kind != Kind::DEPARTURE &&
+             command.kind != Kind::REMOVE_DEPARTURE && command.kind != Kind::REMOVE_STATION))
+        {
+            flush();
+            pending = Kind::OTHER;
+            ++other;
+            if (!command_parse_line(line, discard)) { break; }
+            continue;
+        }
+
+        if (command.kind != pending || trains.size() + departures.size() >= INGEST_BATCH) { flush(); }
+        pending = command.kind;
+        switch (command.kind)
+        {
+            case Kind::TRAIN:
+                trains.emplace_back(std::move(command.id), std::move(command.stationtimes));
+                break;
+            case Kind::DEPARTURE:
+                departures.emplace_back(std::move(command.id), std::move(command.id2), command.time);
+                break;
+            case Kind::REMOVE_DEPARTURE:
+                if (ds_.remove_departure(command.id, command.id2, command.time)) { ++removed_departures; }
+                else { ++failed; }
+                break;
+            case Kind::REMOVE_STATION:
+                if (ds_.remove_station(command.id)) { ++removed_stations; }
+                else { ++failed; }
+                break;
+            default:
+                break;
+        }
+
+        if (lines % INGEST_REPORT_LINES == 0)
+        {
+            flush();
+            report("Ingested");
+        }
+    }
+    flush();
+    stopwatch.stop();
+    report("Finished:");
+    view_dirty = true;
+}
+
 void MainProgram::setui(MainWindow* ui)
 {
     ui_ = ui;
@@ -2190,12 +4359,14 @@ std::array<unsigned long int, 20> const MainProgram::primes2{81031,  81041,  810
 
 MainProgram::MainProgram()
 {
-    rand_engine_.seed(time(nullptr));
-
-    //    startmem = get<0>(mempeak());
+    rand_seed_ = time(nullptr);
+    rand_engine_.seed(rand_seed_);
 
     init_primes();
     init_regexs();
+
+    // The commands run one after another, and each should see what the ones before it changed
+    ds_.wait_for_updates(true);
 }
 
 int MainProgram::mainprogram(int argc, char* argv[])
@@ -2204,13 +4375,19 @@ int MainProgram::mainprogram(int argc, char* argv[])
 
     if (args.size() < 1 || args.size() > 2)
     {
-        cerr << "Usage: " + ((args.size() > 0) ? args[0] : "<program name>") + " [<command file>]" << endl;
+        cerr << "Usage: " + ((args.size() > 0) ? args[0] : "<program name>") + " [<command file>|--console|--ingest]" << endl;
         return EXIT_FAILURE;
     }
 
     MainProgram mainprg;
 
-    if (args.size() == 2 && args[1] != "--console")
+    if (args.size() == 2 && args[1] == "--ingest")
+    {
+        // No prompts or echo: timetable changes are applied from standard input in batches
+        std::ios::sync_with_stdio(false);
+        mainprg.ingest(cin, cout);
+    }
+    else if (args.size() == 2 && args[1] != "--console")
     {
         string filename = args[1];
         ifstream input(filename);
@@ -2271,6 +4448,30 @@ StationID MainProgram::n_to_stationid(unsigned long n)
  return ostr.str();
 }
 
+StationID MainProgram::random_test_station()
+{
+    if (station_zipf_ <= 0)
+    {
+        return n_to_stationid(random<decltype(random_stations_added_)>(0, random_stations_added_));
+    }
+
+    // Station k is picked with a weight of 1/(k+1)^s, so the stations added first are the busiest
+    if (station_zipf_cumulative_.size() != random_stations_added_)
+    {
+        station_zipf_cumulative_.resize(random_stations_added_);
+        double total = 0;
+        for (unsigned long int k = 0; k < random_stations_added_; ++k)
+        {
+            total += 1.0 / std::pow(k + 1, station_zipf_);
+            station_zipf_cumulative_[k] = total;
+        }
+    }
+    if (station_zipf_cumulative_.empty()) { return n_to_stationid(0); }
+    std::uniform_real_distribution<double> pick(0, station_zipf_cumulative_.back());
+    auto pos = std::upper_bound(station_zipf_cumulative_.begin(), station_zipf_cumulative_.end(), pick(rand_engine_));
+    return n_to_stationid(std::min<unsigned long int>(pos - station_zipf_cumulative_.begin(), random_stations_added_ - 1));
+}
+
 RegionID MainProgram::n_to_regionid(unsigned long n)
 {
     return n;
@@ -2302,12 +4503,182 @@ void MainProgram::init_regexs()
         first = false;
 
         cmd.param_regex = regex(cmd.param_regex_str+"[[:space:]]*", std::regex_constants::ECMAScript | std::regex_constants::optimize);
+        cmd.has_param_tokens = compile_param_tokens(cmd);
     }
     cmds_regex_str += ")(?:[[:space:]]*$|"+wsx+"(.*))";
     cmds_regex_ = regex(cmds_regex_str, std::regex_constants::ECMAScript | std::regex_constants::optimize);
     coords_regex_ = regex(coordx+"[[:space:]]?", std::regex_constants::ECMAScript | std::regex_constants::optimize);
-    stationtimes_regex_ = regex(stationidx+":"+timex+"[[:space:]]?", std::regex_constants::ECMAScript | std::regex_constants::optimize);
     times_regex_ = regex(wsx+"([0-9][0-9]):([0-9][0-9]):([0-9][0-9])", std::regex_constants::ECMAScript | std::regex_constants::optimize);
     commands_regex_ = regex("([0-9a-zA-Z_]+);?", std::regex_constants::ECMAScript | std::regex_constants::optimize);
     sizes_regex_ = regex(numx+";?", std::regex_constants::ECMAScript | std::regex_constants::optimize);
+    weights_regex_ = regex("([0-9a-zA-Z_]+):([0-9]+);?", std::regex_constants::ECMAScript | std::regex_constants::optimize);
+    init_command_table();
+}
+
+std::uint64_t MainProgram::command_hash(string_view name, std::uint64_t seed)
+{
+    // FNV-1a, with the seed mixed into the offset basis
+    std::uint64_t hash = 14695981039346656037ull ^ seed;
+    for (char c : name)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void MainProgram::init_command_table()
+{
+    cmd_latency_.assign(cmds_.size(), LatencyHistogram());
+
+    // Look for a seed with which no two commands share a slot, growing the table if none is found
+    unsigned int bits = 1;
+    while ((1u << bits) < 2 * cmds_.size()) { ++bits; }
+    for (;; ++bits)
+    {
+        cmd_table_.assign(std::size_t(1) << bits, NO_COMMAND);
+        cmd_hash_shift_ = 64 - bits;
+        for (cmd_hash_seed_ = 0; cmd_hash_seed_ < 10000; ++cmd_hash_seed_)
+        {
+            std::fill(cmd_table_.begin(), cmd_table_.end(), NO_COMMAND);
+            bool collision = false;
+            for (std::size_t i = 0; i < cmds_.size() && !collision; ++i)
+            {
+                auto& slot = cmd_table_[command_hash(cmds_[i].cmd, cmd_hash_seed_) >> cmd_hash_shift_];
+                collision = (slot != NO_COMMAND);
+                slot = static_cast<std::uint16_t>(i);
+            }
+            if (!collision) { return; }
+        }
+    }
+}
+
+std::size_t MainProgram::find_command(string_view name) const
+{
+    auto index = cmd_table_[command_hash(name, cmd_hash_seed_) >> cmd_hash_shift_];
+    if (index == NO_COMMAND || cmds_[index].cmd != name) { return NO_COMMAND; }
+    return index;
+}
+
+bool MainProgram::compile_param_tokens(CmdInfo& info)
+{
+    // Longer parts first, so that a list isn't taken for the space it starts with
+    static vector<pair<string, ParamToken>> const parts = {
+        {"((?:"+wsx+optstationtimeidx+")+)", ParamToken::STATIONTIME_LIST},
+        {"((?:"+wsx+optcoordx+")+)", ParamToken::COORD_LIST},
+        {coordx, ParamToken::COORD},
+        {timex, ParamToken::TIME},
+        {namex, ParamToken::NAME},
+        {stationidx, ParamToken::ID},
+        {numx, ParamToken::NUMBER},
+        {wsx, ParamToken::SPACE},
+        {"\"", ParamToken::QUOTE},
+    };
+
+    info.param_tokens.clear();
+    string_view rest = info.param_regex_str;
+    while (!rest.empty())
+    {
+        auto part = find_if(parts.begin(), parts.end(), [rest](pair<string, ParamToken> const& p) {
+            return rest.substr(0, p.first.size()) == p.first; });
+        if (part == parts.end())
+        {
+            info.param_tokens.clear();
+            return false;
+        }
+        info.param_tokens.push_back(part->second);
+        rest.remove_prefix(part->first.size());
+    }
+    return true;
+}
+
+std::size_t MainProgram::match_params(CmdInfo const& info, string const& line, string::const_iterator pos, Params& params)
+{
+    auto end = line.cend();
+    auto is_space = [](char c) { return std::isspace(static_cast<unsigned char>(c)); };
+    auto is_digit = [](char c) { return std::isdigit(static_cast<unsigned char>(c)); };
+    auto is_id = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '-'; };
+    auto is_name = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == ' '; };
+
+    auto skip = [&end](string::const_iterator& it, auto predicate) {
+        auto start = it;
+        while (it != end && predicate(*it)) { ++it; }
+        return it != start;
+    };
+    auto literal = [&end](string::const_iterator& it, char c) {
+        if (it == end || *it != c) { return false; }
+        ++it;
+        return true;
+    };
+    auto time = [&](string::const_iterator& it) {
+        if (end - it < 4 || !is_digit(it[0]) || !is_digit(it[1]) || !is_digit(it[2]) || !is_digit(it[3])) { return false; }
+        if (it[0] > '2' || (it[0] == '2' && it[1] > '3') || it[2] > '5') { return false; }
+        it += 4;
+        return true;
+    };
+    std::size_t count = 0;
+    auto capture = [&](string::const_iterator first, string::const_iterator last) {
+        params[count].first = first;
+        params[count].second = last;
+        params[count].matched = true;
+        ++count;
+    };
+    // A coordinate, optionally capturing both numbers
+    auto coord = [&](string::const_iterator& it, bool captures) {
+        if (!literal(it, '(')) { return false; }
+        skip(it, is_space);
+        auto xbegin = it;
+        if (!skip(it, is_digit)) { return false; }
+        auto xend = it;
+        skip(it, is_space);
+        if (!literal(it, ',')) { return false; }
+        skip(it, is_space);
+        auto ybegin = it;
+        if (!skip(it, is_digit)) { return false; }
+        auto yend = it;
+        skip(it, is_space);
+        if (!literal(it, ')')) { return false; }
+        if (captures) { capture(xbegin, xend); capture(ybegin, yend); }
+        return true;
+    };
+
+    capture(pos, end);
+    for (auto token : info.param_tokens)
+    {
+        auto start = pos;
+        bool ok = true;
+        switch (token)
+        {
+            case ParamToken::SPACE: ok = skip(pos, is_space); break;
+            case ParamToken::QUOTE: ok = literal(pos, '"'); break;
+            case ParamToken::ID: ok = skip(pos, is_id); if (ok) { capture(start, pos); } break;
+            case ParamToken::NUMBER: ok = skip(pos, is_digit); if (ok) { capture(start, pos); } break;
+            case ParamToken::NAME: ok = skip(pos, is_name); if (ok) { capture(start, pos); } break;
+            case ParamToken::TIME: ok = time(pos); if (ok) { capture(start, pos); } break;
+            case ParamToken::COORD: ok = coord(pos, true); break;
+            case ParamToken::COORD_LIST:
+            case ParamToken::STATIONTIME_LIST:
+            {
+                // One or more items each preceded by whitespace, stopping before the first that doesn't match
+                unsigned int items = 0;
+                for (;;)
+                {
+                    auto item = pos;
+                    bool item_ok = skip(item, is_space);
+                    if (token == ParamToken::COORD_LIST) { item_ok = item_ok && coord(item, false); }
+                    else { item_ok = item_ok && skip(item, is_id) && literal(item, ':') && time(item); }
+                    if (!item_ok) { break; }
+                    pos = item;
+                    ++items;
+                }
+                ok = (items > 0);
+                if (ok) { capture(start, pos); }
+                break;
+            }
+        }
+        if (!ok) { return 0; }
+    }
+
+    skip(pos, is_space);
+    return pos == end ? count : 0;
 }
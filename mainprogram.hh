@@ -23,8 +23,14 @@
 #include <variant>
 #include <bitset>
 #include <cassert>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <algorithm>
+#include <cmath>
 
 #include "datastructures.hh"
+#include "outputbuffer.hh"
 
 class MainWindow; // In case there's UI
 
@@ -35,12 +41,17 @@ public:
 
 
     class Stopwatch;
+    class LatencyHistogram;
 
     enum class PromptStyle { NORMAL, NO_ECHO, NO_NESTING };
     enum class TestStatus { NOT_RUN, NO_DIFFS, DIFFS_FOUND };
 
     bool command_parse_line(std::string input, std::ostream& output);
     void command_parser(std::istream& input, std::ostream& output, PromptStyle promptstyle);
+    // Applies add_train, add_departure, remove_departure and remove_station lines in
+    // batches without per-line output, reporting the counts and rate now and then.
+    // Other commands are run as usual with their output discarded
+    void ingest(std::istream& input, std::ostream& output);
 
     void setui(MainWindow* ui);
 
@@ -56,6 +67,7 @@ private:
     static std::string const PROMPT;
 
     std::minstd_rand rand_engine_;
+    unsigned long int rand_seed_ = 0;
 
     static std::array<unsigned long int, 20> const primes1;
     static std::array<unsigned long int, 20> const primes2;
@@ -69,6 +81,12 @@ private:
     StationID n_to_stationid(unsigned long int n);
     RegionID n_to_regionid(unsigned long int n);
     TrainID n_to_trainid(unsigned long int n);
+
+    // Station for a test command: uniformly random, or by Zipf popularity with exponent
+    // station_zipf_ (set by perftest_mix) over the stations in the order they were added
+    StationID random_test_station();
+    double station_zipf_ = 0;
+    std::vector<double> station_zipf_cumulative_;
     Coord n_to_coord(unsigned long int n);
 
 
@@ -82,10 +100,25 @@ private:
     using CmdResult = std::pair<ResultType, std::variant<CmdResultIDs, CmdResultTrains, CmdResultRoute>>;
     CmdResult prev_result;
     bool view_dirty = true;
+    // Results are formatted here and written to the output once per command
+    OutputBuffer out_;
+
+    // Latency of every command run in the session, by index in cmds_
+    std::vector<LatencyHistogram> cmd_latency_;
+    void print_latency_stats(std::ostream& output, bool csv);
+    void print_latency_row(std::ostream& output, std::string const& name, LatencyHistogram const& histogram, bool csv);
 
     TestStatus test_status_ = TestStatus::NOT_RUN;
 
-    using MatchIter = std::smatch::const_iterator;
+    // Parameters are handed to the commands as submatches of the input line. They come
+    // either from the hand-written scanner below or are copied from the regex match
+    using MatchIter = std::ssub_match const*;
+    static constexpr std::size_t MAX_PARAMS = 16;
+    using Params = std::array<std::ssub_match, MAX_PARAMS>;
+
+    // The parts parameter regexes are made of, for the hand-written scanner. A command
+    // whose regex is only made of these is matched without std::regex
+    enum class ParamToken { SPACE, QUOTE, ID, NUMBER, NAME, TIME, COORD, COORD_LIST, STATIONTIME_LIST };
     struct CmdInfo
     {
         std::string cmd;
@@ -94,15 +127,31 @@ private:
         CmdResult(MainProgram::*func)(std::ostream& output, MatchIter begin, MatchIter end);
         void(MainProgram::*testfunc)();
         std::regex param_regex = {};
+        std::vector<ParamToken> param_tokens = {};
+        bool has_param_tokens = false;
     };
     static std::vector<CmdInfo> cmds_;
+
+    // Perfect hash from command name to its index in cmds_, built by init_regexs
+    static constexpr std::uint16_t NO_COMMAND = std::numeric_limits<std::uint16_t>::max();
+    std::vector<std::uint16_t> cmd_table_;
+    std::uint64_t cmd_hash_seed_ = 0;
+    unsigned int cmd_hash_shift_ = 0;
+    bool use_regex_parser_ = false;
+    bool geographic_perftest_ = false; // perftest data from generate_geographic_network
+    static std::uint64_t command_hash(std::string_view name, std::uint64_t seed);
+    void init_command_table();
+    std::size_t find_command(std::string_view name) const;
+    static bool compile_param_tokens(CmdInfo& info);
+    static std::size_t match_params(CmdInfo const& info, std::string const& line,
+                                    std::string::const_iterator pos, Params& params);
     // Regex objects and their initialization
     std::regex cmds_regex_;
     std::regex coords_regex_;
-    std::regex stationtimes_regex_;
     std::regex times_regex_;
     std::regex commands_regex_;
     std::regex sizes_regex_;
+    std::regex weights_regex_;
     void init_regexs();
 
 
@@ -135,15 +184,40 @@ private:
     CmdResult cmd_route_with_cycle(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_route_shortest_distance(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_route_earliest_arrival(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_route_earliest_arrival_transfers(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_distance_matrix(std::ostream& output, MatchIter begin, MatchIter end);
 
     CmdResult help_command(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_randseed(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_random_stations(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_random_trains(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_read(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_bulk_read(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_save_snapshot(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_load_snapshot(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_save_image(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_open_image(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_stats(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_random_network(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_perftest_network(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_parser(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_testread(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_stopwatch(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_trace(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_counters(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_perftest(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_perftest_compare(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_perftest_mix(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_perftest_fit(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_perftest_ch(std::ostream& output, MatchIter begin, MatchIter end);
+    std::vector<std::pair<std::string, void(MainProgram::*)()>> perftest_functions(std::string const& commandstr, std::ostream& output);
+    // Runs the commands of one perftest round that have a batch query form on each number of
+    // threads and prints the throughput. Returns false if it timed out or was stopped
+    bool perftest_threads(std::ostream& output, std::vector<std::pair<std::string, void(MainProgram::*)()>> const& testfuncs,
+                          std::vector<std::size_t> const& cmdorder,
+                          std::vector<unsigned int> const& threadcounts, unsigned int timeout);
+    CmdResult cmd_contraction_hierarchy(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_landmarks(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_comment(std::ostream& output, MatchIter begin, MatchIter end);
 
     void test_all_stations();
@@ -167,11 +241,37 @@ private:
     void test_route_with_cycle();
     void test_route_shortest_distance();
     void test_route_earliest_arrival();
+    void test_route_earliest_arrival_transfers();
+    void test_distance_matrix();
     void test_random_stations();
     void test_random_trains();
 
     void add_random_stations_regions(unsigned int size, Coord min = {1,1}, Coord max = {10000, 10000});
     void add_random_trains(unsigned int n);
+
+    // Random additions generated ahead into a buffer, so that perftest times only the
+    // data structure work of replaying them. Replaying moves the data out of the buffer
+    struct WorkloadOp
+    {
+        enum class Kind { STATION, REGION, SUBREGION, STATION_REGION, TRAIN };
+        Kind kind = Kind::STATION;
+        std::string id; // StationID or TrainID
+        Name name;
+        Coord xy = NO_COORD;
+        RegionID region = NO_REGION;
+        RegionID region2 = NO_REGION;
+        std::vector<Coord> coords;
+        std::vector<std::pair<StationID, Time>> stationtimes;
+    };
+    using Workload = std::vector<WorkloadOp>;
+    void generate_random_stations_regions(Workload& workload, unsigned int size, Coord min = {1,1}, Coord max = {10000, 10000});
+    void generate_random_trains(Workload& workload, unsigned int n);
+    // Finland-like network: stations clustered in towns of Zipf-distributed sizes, regions
+    // nested as the whole area, provinces and towns, trunk lines linking each town to its
+    // nearest larger town and local lines out from the main station of each town
+    void generate_geographic_network(Workload& workload, unsigned int stations, unsigned int trains,
+                                     Coord min = {1,1}, Coord max = {10000, 10000});
+    void replay_workload(Workload::iterator begin, Workload::iterator end, bool bulk = false);
     Distance calc_distance(Coord c1, Coord c2);
     std::string print_station(StationID id, std::ostream& output, bool nl = true);
     std::string print_station_brief(StationID id, std::ostream& output, bool nl = true);
@@ -181,6 +281,12 @@ private:
     std::string print_train(TrainID id, std::ostream& output, bool nl = true);
     std::string print_time(Time time, std::ostream& output, bool nl = true);
 
+    // The same into the output buffer, without the returned copies
+    void format_station(StationID const& id, OutputBuffer& out);
+    void format_station_brief(StationID const& id, OutputBuffer& out);
+    void format_region(RegionID id, OutputBuffer& out);
+    void format_time(Time time, OutputBuffer& out);
+
     template <typename Type>
     Type random(Type start, Type end);
     template <typename To>
@@ -267,6 +373,8 @@ void MainProgram::NoParListTestCmd()
 
 
 #ifdef USE_PERF_EVENT
+#include <cstring>
+
 extern "C"
 {
 #include <unistd.h>
@@ -292,23 +400,55 @@ class MainProgram::Stopwatch
 public:
     using Clock = std::chrono::high_resolution_clock;
 
+#ifdef USE_PERF_EVENT
+    // Hardware counters opened as one group, so that they all cover the same stretch.
+    // A counter the machine or the kernel doesn't offer reads as NO_COUNT
+    enum Counter { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, COUNTERS };
+    static constexpr long long NO_COUNT = -1;
+    using Counts = std::array<long long, COUNTERS>;
+    static constexpr std::array<char const*, COUNTERS> counter_names {
+        {"cycles", "instructions", "L1D misses", "LLC misses", "branch misses"}};
+#endif
+
     Stopwatch(bool use_counter = false) : use_counter_(use_counter)
     {
 #ifdef USE_PERF_EVENT
+        fds_.fill(-1);
+        ids_.fill(0);
         if (use_counter_)
         {
-            memset(&pe_, 0, sizeof(pe_));
-            pe_.type = PERF_TYPE_HARDWARE;
-            pe_.size = sizeof(pe_);
-            pe_.config = PERF_COUNT_HW_INSTRUCTIONS;
-            pe_.disabled = 1;
-            pe_.exclude_kernel = 1;
-            pe_.exclude_hv = 1;
-
-            fd_ = perf_event_open(&pe_, 0, -1, -1, 0);
-            if (fd_ == -1) {
-                throw "Couldn't open perf events!";
+            for (unsigned int i = 0; i < COUNTERS; ++i)
+            {
+                struct perf_event_attr pe;
+                memset(&pe, 0, sizeof(pe));
+                pe.size = sizeof(pe);
+                pe.type = PERF_TYPE_HARDWARE;
+                switch (i)
+                {
+                    case CYCLES: pe.config = PERF_COUNT_HW_CPU_CYCLES; break;
+                    case INSTRUCTIONS: pe.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+                    case L1D_MISSES:
+                        pe.type = PERF_TYPE_HW_CACHE;
+                        pe.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                        break;
+                    case LLC_MISSES: pe.config = PERF_COUNT_HW_CACHE_MISSES; break;
+                    case BRANCH_MISSES: pe.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+                }
+                pe.disabled = (leader_ == -1); // The others follow the leader
+                pe.exclude_kernel = 1;
+                pe.exclude_hv = 1;
+                pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                                 PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+                int fd = perf_event_open(&pe, 0, -1, leader_, 0);
+                if (fd == -1) { continue; } // Left out, the rest are still counted
+                if (leader_ == -1) { leader_ = fd; }
+                fds_[i] = fd;
+                ioctl(fd, PERF_EVENT_IOC_ID, &ids_[i]);
             }
+            // Without any counters the stopwatch only measures time
+            use_counter_ = (leader_ != -1);
         }
 #endif
         reset();
@@ -317,13 +457,16 @@ public:
     ~Stopwatch()
     {
 #ifdef USE_PERF_EVENT
-        if (use_counter_)
+        for (auto fd : fds_)
         {
-            close(fd_);
+            if (fd != -1) { close(fd); }
         }
 #endif
     }
 
+    Stopwatch(Stopwatch const&) = delete;
+    Stopwatch& operator=(Stopwatch const&) = delete;
+
     void start()
     {
         running_ = true;
@@ -331,9 +474,9 @@ public:
 #ifdef USE_PERF_EVENT
         if (use_counter_)
         {
-            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
-            read(fd_, &startcount_, sizeof(startcount_));
-            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+            ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            startcounts_ = read_counts();
+            ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
         }
 #endif
     }
@@ -344,9 +487,12 @@ public:
 #ifdef USE_PERF_EVENT
         if (use_counter_)
         {
-            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
-            long long c; read(fd_, &c, sizeof(c));
-            counter_ += (c - startcount_);
+            ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            auto c = read_counts();
+            for (unsigned int i = 0; i < COUNTERS; ++i)
+            {
+                if (c[i] != NO_COUNT) { counters_[i] += c[i] - startcounts_[i]; }
+            }
         }
 #endif
         elapsed_ += (Clock::now() - starttime_);
@@ -358,10 +504,10 @@ public:
 #ifdef USE_PERF_EVENT
         if (use_counter_)
         {
-            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
-            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
-            counter_ = 0;
+            ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
         }
+        counters_.fill(0);
 #endif
         elapsed_ = elapsed_.zero();
     }
@@ -380,25 +526,29 @@ public:
     }
 
 #ifdef USE_PERF_EVENT
-    long long count()
+    // Whether any hardware counter could be opened
+    bool counting() const { return use_counter_; }
+
+    // The counts accumulated between starts and stops, NO_COUNT for the counters not available
+    Counts counts()
     {
-        if (use_counter_)
-        {
-            if (!running_)
-            {
-                return counter_;
-            }
-            else
-            {
-                long long c;
-                read(fd_, &c, sizeof(c));
-                return counter_ + (c - startcount_);
-            }
-        }
-        else
+        Counts result;
+        result.fill(NO_COUNT);
+        if (!use_counter_) { return result; }
+        auto current = running_ ? read_counts() : Counts();
+        for (unsigned int i = 0; i < COUNTERS; ++i)
         {
-            assert(!"perf_event not enabled during StopWatch creation!");
+            if (fds_[i] == -1) { continue; }
+            result[i] = counters_[i];
+            if (running_ && current[i] != NO_COUNT) { result[i] += current[i] - startcounts_[i]; }
         }
+        return result;
+    }
+
+    long long count()
+    {
+        assert(use_counter_ && "perf_event not enabled during StopWatch creation!");
+        return counts()[INSTRUCTIONS];
     }
 #endif
 
@@ -409,12 +559,119 @@ private:
 
     bool use_counter_;
 #ifdef USE_PERF_EVENT
-    struct perf_event_attr pe_;
-    long long startcount_ = 0;
-    long long counter_ = 0;
-    int fd_ = 0;
+    // One read gives every counter of the group, scaled up if the kernel had to
+    // share the hardware with other groups for part of the time
+    Counts read_counts()
+    {
+        Counts result;
+        result.fill(NO_COUNT);
+        std::uint64_t buffer[3 + 2 * COUNTERS];
+        if (read(leader_, buffer, sizeof(buffer)) < static_cast<ssize_t>(3 * sizeof(std::uint64_t))) { return result; }
+        auto number = buffer[0];
+        auto enabled = buffer[1];
+        auto running = buffer[2];
+        for (std::uint64_t j = 0; j < number && j < COUNTERS; ++j)
+        {
+            auto value = buffer[3 + 2 * j];
+            auto id = buffer[4 + 2 * j];
+            if (running > 0 && running < enabled) { value = static_cast<std::uint64_t>(double(value) * enabled / running); }
+            for (unsigned int i = 0; i < COUNTERS; ++i)
+            {
+                if (fds_[i] != -1 && ids_[i] == id) { result[i] = static_cast<long long>(value); }
+            }
+        }
+        return result;
+    }
+
+    int leader_ = -1;
+    std::array<int, COUNTERS> fds_;
+    std::array<std::uint64_t, COUNTERS> ids_;
+    Counts startcounts_ = {};
+    Counts counters_ = {};
 #endif
 };
 
 
+// Log-linear histogram of durations in the manner of HdrHistogram: values below 128 ns
+// are counted exactly and each doubling above that is split into 64 buckets, so any
+// reported value is within about 1.6 % of the recorded one. Recording is one branch,
+// a bit scan and an increment. The buckets are allocated on the first recording
+class MainProgram::LatencyHistogram
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void record(Clock::duration duration)
+    {
+        auto ns = static_cast<std::uint64_t>(std::max<Clock::rep>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+        if (counts_.empty()) { counts_.assign(BUCKETS, 0); }
+        ++counts_[bucket(std::min(ns, MAX_VALUE))];
+        ++total_;
+        sum_ += ns;
+        max_ = std::max(max_, ns);
+    }
+
+    std::uint64_t count() const { return total_; }
+    std::uint64_t max() const { return max_; }
+    double mean() const { return total_ == 0 ? 0 : static_cast<double>(sum_) / total_; }
+
+    // The smallest recorded value v such that a fraction q of the values are at most v,
+    // rounded up to the end of its bucket
+    std::uint64_t quantile(double q) const
+    {
+        if (total_ == 0) { return 0; }
+        auto target = static_cast<std::uint64_t>(std::ceil(q * total_));
+        target = std::max<std::uint64_t>(1, std::min(target, total_));
+        std::uint64_t seen = 0;
+        for (unsigned int i = 0; i < counts_.size(); ++i)
+        {
+            seen += counts_[i];
+            if (seen >= target) { return std::min(highest(i), max_); }
+        }
+        return max_;
+    }
+
+private:
+    static constexpr unsigned int SUB_BITS = 6;
+    static constexpr unsigned int EXACT = 2u << SUB_BITS; // 128
+    static constexpr unsigned int TOP_BIT = 40; // about 18 minutes, longer ones are clamped
+    static constexpr std::uint64_t MAX_VALUE = (std::uint64_t(2) << TOP_BIT) - 1;
+    static constexpr unsigned int BUCKETS = EXACT + (TOP_BIT - SUB_BITS) * (1u << SUB_BITS);
+
+    static unsigned int top_bit(std::uint64_t value)
+    {
+#if defined(__GNUC__)
+        return 63 - __builtin_clzll(value);
+#else
+        unsigned int bit = 0;
+        while (value >>= 1) { ++bit; }
+        return bit;
+#endif
+    }
+
+    static unsigned int bucket(std::uint64_t ns)
+    {
+        if (ns < EXACT) { return static_cast<unsigned int>(ns); }
+        auto bit = top_bit(ns);
+        auto sub = static_cast<unsigned int>(ns >> (bit - SUB_BITS)) & ((1u << SUB_BITS) - 1);
+        return EXACT + (bit - SUB_BITS - 1) * (1u << SUB_BITS) + sub;
+    }
+
+    // The largest value counted in bucket i
+    static std::uint64_t highest(unsigned int i)
+    {
+        if (i < EXACT) { return i; }
+        auto octave = (i - EXACT) >> SUB_BITS;
+        auto sub = (i - EXACT) & ((1u << SUB_BITS) - 1);
+        auto bit = octave + SUB_BITS + 1;
+        auto lowest = (std::uint64_t(1) << bit) + (std::uint64_t(sub) << (bit - SUB_BITS));
+        return lowest + (std::uint64_t(1) << (bit - SUB_BITS)) - 1;
+    }
+
+    std::vector<std::uint64_t> counts_;
+    std::uint64_t total_ = 0;
+    std::uint64_t sum_ = 0;
+    std::uint64_t max_ = 0;
+};
+
 #endif // MAINPROGRAM_HH
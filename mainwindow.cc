@@ -71,6 +71,7 @@ MainWindow::MainWindow(QWidget *parent) :
     // Command selection
     // !!!!! Sort commands in alphabetical order (should not be done here, but is)
     std::sort(mainprg_.cmds_.begin(), mainprg_.cmds_.end(), [](auto const& l, auto const& r){ return l.cmd < r.cmd; });
+    mainprg_.init_command_table(); // The command lookup table refers to the commands by position
     for (auto& cmd : mainprg_.cmds_)
     {
         ui->cmd_select->addItem(QString::fromStdString(cmd.cmd));
@@ -427,6 +428,11 @@ void MainWindow::update_view()
         errorset.insert(std::string("NotImplemented while updating graphics: ") + e.what());
         std::cerr << std::endl << "NotImplemented while updating graphics: " << e.what() << std::endl;
     }
+    catch (NotAvailable const& e)
+    {
+        errorset.insert(std::string("NotAvailable while updating graphics: ") + e.what());
+        std::cerr << std::endl << "NotAvailable while updating graphics: " << e.what() << std::endl;
+    }
 
     if (!errorset.empty())
     {
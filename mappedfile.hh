@@ -0,0 +1,77 @@
+// MappedFile.hh
+//
+// Read-only view of a whole file, memory-mapped where the platform allows it
+// and otherwise read into memory in one go
+
+#ifndef MAPPEDFILE_HH
+#define MAPPEDFILE_HH
+
+#include <string>
+#include <string_view>
+#include <cstddef>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPEDFILE_USE_MMAP
+#else
+#include <fstream>
+#include <iterator>
+#endif
+
+class MappedFile
+{
+public:
+    explicit MappedFile(std::string const& filename)
+    {
+#ifdef MAPPEDFILE_USE_MMAP
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1) { return; }
+        struct stat info;
+        if (fstat(fd, &info) == 0)
+        {
+            size_ = info.st_size;
+            open_ = true;
+            if (size_ > 0)
+            {
+                void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) { open_ = false; size_ = 0; }
+                else { data_ = static_cast<char const*>(data); }
+            }
+        }
+        close(fd);
+#else
+        std::ifstream input(filename, std::ios::binary);
+        if (!input) { return; }
+        buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+        open_ = true;
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef MAPPEDFILE_USE_MMAP
+        if (data_) { munmap(const_cast<char*>(data_), size_); }
+#endif
+    }
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    bool is_open() const { return open_; }
+    std::string_view contents() const { return {data_, size_}; }
+
+private:
+    char const* data_ = nullptr;
+    std::size_t size_ = 0;
+    bool open_ = false;
+#ifndef MAPPEDFILE_USE_MMAP
+    std::string buffer_;
+#endif
+};
+
+#endif // MAPPEDFILE_HH
@@ -0,0 +1,143 @@
+// MemoryCounter.cc
+//
+// Replacements of the global operator new and delete that count allocations
+// and live bytes. The blocks come from malloc, whose usable size tells how much
+// to subtract again when a block is freed
+
+#include "memorycounter.hh"
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define MEMORYCOUNTER_USABLE_SIZE malloc_usable_size
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define MEMORYCOUNTER_USABLE_SIZE malloc_size
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+// Relaxed is enough, the counts are only read between measurements
+std::atomic<std::size_t> allocation_count{0};
+std::atomic<std::size_t> allocated_bytes{0};
+
+void* counted_allocate(std::size_t size)
+{
+    if (size == 0) { size = 1; }
+    void* block = nullptr;
+    while ((block = std::malloc(size)) == nullptr)
+    {
+        auto handler = std::get_new_handler();
+        if (!handler) { return nullptr; }
+        handler();
+    }
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+#ifdef MEMORYCOUNTER_USABLE_SIZE
+    allocated_bytes.fetch_add(MEMORYCOUNTER_USABLE_SIZE(block), std::memory_order_relaxed);
+#else
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+#endif
+    return block;
+}
+
+void counted_free(void* block) noexcept
+{
+    if (!block) { return; }
+#ifdef MEMORYCOUNTER_USABLE_SIZE
+    allocated_bytes.fetch_sub(MEMORYCOUNTER_USABLE_SIZE(block), std::memory_order_relaxed);
+#endif
+    std::free(block);
+}
+}
+
+void* operator new(std::size_t size)
+{
+    if (void* block = counted_allocate(size)) { return block; }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept
+{
+    return counted_allocate(size);
+}
+
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept
+{
+    return counted_allocate(size);
+}
+
+void operator delete(void* block) noexcept { counted_free(block); }
+void operator delete[](void* block) noexcept { counted_free(block); }
+void operator delete(void* block, std::size_t) noexcept { counted_free(block); }
+void operator delete[](void* block, std::size_t) noexcept { counted_free(block); }
+void operator delete(void* block, std::nothrow_t const&) noexcept { counted_free(block); }
+void operator delete[](void* block, std::nothrow_t const&) noexcept { counted_free(block); }
+
+namespace MemoryCounter
+{
+std::size_t allocations()
+{
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+std::size_t live_bytes()
+{
+    return allocated_bytes.load(std::memory_order_relaxed);
+}
+
+std::size_t peak_rss_kb()
+{
+#if defined(__linux__)
+    // VmHWM follows reset_peak_rss, unlike getrusage
+    std::ifstream status("/proc/self/status");
+    std::string key;
+    while (status >> key)
+    {
+        if (key == "VmHWM:")
+        {
+            std::size_t kb = 0;
+            status >> kb;
+            return kb;
+        }
+        status.ignore(256, '\n');
+    }
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return 0;
+}
+
+bool reset_peak_rss()
+{
+#if defined(__linux__)
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5" << std::flush;
+    return static_cast<bool>(clear_refs);
+#else
+    return false;
+#endif
+}
+}
@@ -0,0 +1,29 @@
+// MemoryCounter.hh
+//
+// Counts of the memory allocated through the global operator new, kept by the
+// replacement operators in memorycounter.cc, and the peak resident set size
+// of the process as reported by the operating system
+
+#ifndef MEMORYCOUNTER_HH
+#define MEMORYCOUNTER_HH
+
+#include <cstddef>
+
+namespace MemoryCounter
+{
+// Allocations made since the program started
+std::size_t allocations();
+
+// Bytes allocated and not yet freed. Counted as the size of the block the allocator
+// handed out, which may be a little more than what was asked for
+std::size_t live_bytes();
+
+// Highest resident set size of the process in kB, 0 if the platform doesn't tell
+std::size_t peak_rss_kb();
+
+// Starts the peak resident set size over from the current size, where the platform
+// allows it. Returns false if the peak keeps counting from the start of the program
+bool reset_peak_rss();
+}
+
+#endif // MEMORYCOUNTER_HH
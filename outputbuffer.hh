@@ -0,0 +1,75 @@
+// OutputBuffer.hh
+//
+// Text collected into a reusable buffer and written to a stream in one go.
+// Numbers are formatted with std::to_chars rather than through the stream
+
+#ifndef OUTPUTBUFFER_HH
+#define OUTPUTBUFFER_HH
+
+#include <charconv>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+class OutputBuffer
+{
+public:
+    OutputBuffer& operator<<(std::string_view text)
+    {
+        buffer_.append(text);
+        return *this;
+    }
+
+    OutputBuffer& operator<<(char const* text)
+    {
+        buffer_.append(text);
+        return *this;
+    }
+
+    OutputBuffer& operator<<(char c)
+    {
+        buffer_.push_back(c);
+        return *this;
+    }
+
+    template <typename Integer, typename = std::enable_if_t<std::is_integral<Integer>::value>>
+    OutputBuffer& operator<<(Integer value)
+    {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        buffer_.append(digits, result.ptr - digits);
+        return *this;
+    }
+
+    // Value padded with zeros on the left to at least 'width' digits, like setw and setfill('0')
+    template <typename Integer>
+    OutputBuffer& padded(Integer value, unsigned int width)
+    {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        for (auto length = static_cast<unsigned int>(result.ptr - digits); length < width; ++length)
+        {
+            buffer_.push_back('0');
+        }
+        buffer_.append(digits, result.ptr - digits);
+        return *this;
+    }
+
+    // Writes the buffer to the stream and empties it, keeping the memory for the next time
+    void flush_to(std::ostream& output)
+    {
+        if (!buffer_.empty())
+        {
+            output.write(buffer_.data(), buffer_.size());
+            buffer_.clear();
+        }
+    }
+
+    std::size_t size() const { return buffer_.size(); }
+
+private:
+    std::string buffer_;
+};
+
+#endif // OUTPUTBUFFER_HH
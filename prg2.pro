@@ -19,7 +19,7 @@
 
 QT       += core gui
 
-CONFIG += c++17 warn_on
+CONFIG += c++17 warn_on thread
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -41,12 +41,18 @@ DEFINES += QT_DEPRECATED_WARNINGS
 SOURCES += \
     datastructures.cc \
     mainwindow.cc \
-    mainprogram.cc
+    mainprogram.cc \
+    memorycounter.cc \
+    trace.cc
 
 HEADERS += \
     datastructures.hh \
     mainwindow.hh \
-    mainprogram.hh
+    mainprogram.hh \
+    mappedfile.hh \
+    memorycounter.hh \
+    outputbuffer.hh \
+    trace.hh
 
 FORMS += \
     mainwindow.ui
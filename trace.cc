@@ -0,0 +1,107 @@
+// Trace.cc
+//
+// The spans are collected into one list under a mutex. Spans are recorded for
+// commands, index rebuilds and the like rather than inner loops, so the lock is
+// taken rarely enough not to matter
+
+#include "trace.hh"
+
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+struct Event
+{
+    char const* name;
+    char const* category;
+    unsigned int thread;
+    Trace::Clock::time_point begin;
+    Trace::Clock::time_point end;
+};
+
+std::mutex events_mutex;
+std::vector<Event> events;
+Trace::Clock::time_point trace_start;
+
+// Small numbers for the threads read better in the viewers than the native ids
+unsigned int thread_number()
+{
+    static std::atomic<unsigned int> next{1};
+    static thread_local unsigned int number = next.fetch_add(1, std::memory_order_relaxed);
+    return number;
+}
+
+// Names are identifiers and command names, but escape them to keep the file valid anyway
+void write_json_string(std::ostream& output, char const* text)
+{
+    output << '"';
+    for (; *text; ++text)
+    {
+        auto c = *text;
+        if (c == '"' || c == '\\') { output << '\\' << c; }
+        else if (static_cast<unsigned char>(c) < 0x20) { output << ' '; }
+        else { output << c; }
+    }
+    output << '"';
+}
+
+double microseconds(Trace::Clock::duration duration)
+{
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+}
+
+namespace Trace
+{
+std::atomic<bool> recording{false};
+
+void start()
+{
+    std::lock_guard<std::mutex> lock(events_mutex);
+    events.clear();
+    trace_start = Clock::now();
+    recording.store(true, std::memory_order_relaxed);
+}
+
+std::size_t stop()
+{
+    recording.store(false, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(events_mutex);
+    return events.size();
+}
+
+void record(char const* name, char const* category, Clock::time_point begin, Clock::time_point end)
+{
+    auto thread = thread_number();
+    std::lock_guard<std::mutex> lock(events_mutex);
+    events.push_back({name, category, thread, begin, end});
+}
+
+bool write(std::string const& filename)
+{
+    std::ofstream output(filename);
+    if (!output) { return false; }
+
+    std::lock_guard<std::mutex> lock(events_mutex);
+    // Complete events ("X") with the start and duration in microseconds from the start of the trace
+    output << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    output.precision(3);
+    output << std::fixed;
+    bool first = true;
+    for (auto const& event : events)
+    {
+        output << (first ? "\n" : ",\n") << "{\"name\":";
+        write_json_string(output, event.name);
+        output << ",\"cat\":";
+        write_json_string(output, event.category);
+        output << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+               << ",\"ts\":" << microseconds(event.begin - trace_start)
+               << ",\"dur\":" << microseconds(event.end - event.begin) << "}";
+        first = false;
+    }
+    output << "\n]}\n";
+    return static_cast<bool>(output);
+}
+}
@@ -0,0 +1,65 @@
+// Trace.hh
+//
+// Spans of time recorded while tracing is on and written out in the Chrome trace
+// event format, which chrome://tracing and ui.perfetto.dev can show. When tracing
+// is off a span costs one relaxed atomic load
+
+#ifndef TRACE_HH
+#define TRACE_HH
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+namespace Trace
+{
+using Clock = std::chrono::steady_clock;
+
+extern std::atomic<bool> recording;
+
+inline bool enabled() { return recording.load(std::memory_order_relaxed); }
+
+// Forgets the spans recorded so far and starts recording
+void start();
+
+// Stops recording and returns the number of spans recorded
+std::size_t stop();
+
+// Writes the recorded spans as a Chrome trace JSON file. Returns false if the file can't be written
+bool write(std::string const& filename);
+
+// Records a span of the calling thread. The name and category must stay valid until the trace is written
+void record(char const* name, char const* category, Clock::time_point begin, Clock::time_point end);
+
+// Records the span from construction to destruction or end(), if tracing was on when constructed
+class Span
+{
+public:
+    Span(char const* name, char const* category) : name_(name), category_(category)
+    {
+        if (enabled()) { begin_ = Clock::now(); active_ = true; }
+    }
+    ~Span() { end(); }
+
+    Span(Span const&) = delete;
+    Span& operator=(Span const&) = delete;
+
+    void end()
+    {
+        if (active_)
+        {
+            active_ = false;
+            record(name_, category_, begin_, Clock::now());
+        }
+    }
+
+private:
+    char const* name_;
+    char const* category_;
+    Clock::time_point begin_;
+    bool active_ = false;
+};
+}
+
+#endif // TRACE_HH